@@ -0,0 +1,272 @@
+#!/usr/bin/env python3
+"""
+Generate unicode_tables.h, the grapheme cluster break and display width
+tables used by jot.
+
+Usage: gen_unicode_tables.py [UCD-DIR] > unicode_tables.h
+
+UCD-DIR holds the Unicode Character Database files
+auxiliary/GraphemeBreakProperty.txt, emoji/emoji-data.txt,
+EastAsianWidth.txt and extracted/DerivedGeneralCategory.txt (a flat
+directory with the same file names works too). Without it, the properties
+are derived from Python's unicodedata module, which covers the general
+category and East Asian width; the grapheme break classes are then
+computed as described in UAX #29 from the lists below. The lists are
+those of Unicode LISTS_VERSION, so this only runs on a Python whose
+unicodedata has the same version.
+
+Each code point gets one byte: the grapheme cluster break class in bits
+0-3, Extended_Pictographic in bit 4 and the display width (0, 1 or 2) in
+bits 5-6. The bytes are stored as a two-stage table: the first stage maps
+each block of BLOCK code points to one of the distinct blocks in the
+second stage.
+"""
+
+import os
+import sys
+import unicodedata
+
+MAX_CODE = 0x110000
+LISTS_VERSION = '14.0.0'   # The Unicode version of the lists below
+BLOCK = 128
+
+# Grapheme cluster break classes, in the order of the GCB_ constants
+CLASSES = ['Other', 'CR', 'LF', 'Control', 'Extend', 'ZWJ',
+           'Regional_Indicator', 'Prepend', 'SpacingMark',
+           'L', 'V', 'T', 'LV', 'LVT']
+
+# PropList.txt Other_Grapheme_Extend (Unicode 14.0)
+OTHER_GRAPHEME_EXTEND = [
+    (0x09BE, 0x09BE), (0x09D7, 0x09D7), (0x0B3E, 0x0B3E), (0x0B57, 0x0B57),
+    (0x0BBE, 0x0BBE), (0x0BD7, 0x0BD7), (0x0CC2, 0x0CC2), (0x0CD5, 0x0CD6),
+    (0x0D3E, 0x0D3E), (0x0D57, 0x0D57), (0x0DCF, 0x0DCF), (0x0DDF, 0x0DDF),
+    (0x1B35, 0x1B35), (0x200C, 0x200C), (0x302E, 0x302F), (0xFF9E, 0xFF9F),
+    (0x1133E, 0x1133E), (0x11357, 0x11357), (0x114B0, 0x114B0),
+    (0x114BD, 0x114BD), (0x115AF, 0x115AF), (0x11930, 0x11930),
+    (0x1D165, 0x1D165), (0x1D16E, 0x1D172), (0xE0020, 0xE007F),
+]
+
+# Prepended_Concatenation_Mark and the Indic prefixed consonants
+PREPEND = [
+    (0x0600, 0x0605), (0x06DD, 0x06DD), (0x070F, 0x070F), (0x0890, 0x0891),
+    (0x08E2, 0x08E2), (0x0D4E, 0x0D4E), (0x110BD, 0x110BD),
+    (0x110CD, 0x110CD), (0x111C2, 0x111C3), (0x1193F, 0x1193F),
+    (0x11941, 0x11941), (0x11A3A, 0x11A3A), (0x11A84, 0x11A89),
+    (0x11D46, 0x11D46),
+]
+
+# Spacing marks that UAX #29 excludes from SpacingMark, and the two
+# non-Mc characters it adds
+NOT_SPACING_MARK = [
+    (0x102B, 0x102C), (0x1038, 0x1038), (0x1062, 0x1064), (0x1067, 0x106D),
+    (0x1083, 0x1083), (0x1087, 0x108C), (0x108F, 0x108F), (0x109A, 0x109C),
+    (0x1A61, 0x1A61), (0x1A63, 0x1A64), (0xAA7B, 0xAA7B), (0xAA7D, 0xAA7D),
+    (0x11720, 0x11721),
+]
+EXTRA_SPACING_MARK = [(0x0E33, 0x0E33), (0x0EB3, 0x0EB3)]
+
+# emoji-data.txt Extended_Pictographic (Unicode 14.0)
+EXTENDED_PICTOGRAPHIC = [
+    (0x00A9, 0x00A9), (0x00AE, 0x00AE), (0x203C, 0x203C), (0x2049, 0x2049),
+    (0x2122, 0x2122), (0x2139, 0x2139), (0x2194, 0x2199), (0x21A9, 0x21AA),
+    (0x231A, 0x231B), (0x2328, 0x2328), (0x2388, 0x2388), (0x23CF, 0x23CF),
+    (0x23E9, 0x23F3), (0x23F8, 0x23FA), (0x24C2, 0x24C2), (0x25AA, 0x25AB),
+    (0x25B6, 0x25B6), (0x25C0, 0x25C0), (0x25FB, 0x25FE), (0x2600, 0x2605),
+    (0x2607, 0x2612), (0x2614, 0x2685), (0x2690, 0x2705), (0x2708, 0x2712),
+    (0x2714, 0x2714), (0x2716, 0x2716), (0x271D, 0x271D), (0x2721, 0x2721),
+    (0x2728, 0x2728), (0x2733, 0x2734), (0x2744, 0x2744), (0x2747, 0x2747),
+    (0x274C, 0x274C), (0x274E, 0x274E), (0x2753, 0x2755), (0x2757, 0x2757),
+    (0x2763, 0x2767), (0x2795, 0x2797), (0x27A1, 0x27A1), (0x27B0, 0x27B0),
+    (0x27BF, 0x27BF), (0x2934, 0x2935), (0x2B05, 0x2B07), (0x2B1B, 0x2B1C),
+    (0x2B50, 0x2B50), (0x2B55, 0x2B55), (0x3030, 0x3030), (0x303D, 0x303D),
+    (0x3297, 0x3297), (0x3299, 0x3299), (0x1F000, 0x1F0FF),
+    (0x1F10D, 0x1F10F), (0x1F12F, 0x1F12F), (0x1F16C, 0x1F171),
+    (0x1F17E, 0x1F17F), (0x1F18E, 0x1F18E), (0x1F191, 0x1F19A),
+    (0x1F1AD, 0x1F1E5), (0x1F201, 0x1F20F), (0x1F21A, 0x1F21A),
+    (0x1F22F, 0x1F22F), (0x1F232, 0x1F23A), (0x1F23C, 0x1F23F),
+    (0x1F249, 0x1F3FA), (0x1F400, 0x1F53D), (0x1F546, 0x1F64F),
+    (0x1F680, 0x1F6FF), (0x1F774, 0x1F77F), (0x1F7D5, 0x1F7FF),
+    (0x1F80C, 0x1F80F), (0x1F848, 0x1F84F), (0x1F85A, 0x1F85F),
+    (0x1F888, 0x1F88F), (0x1F8AE, 0x1F8FF), (0x1F90C, 0x1F93A),
+    (0x1F93C, 0x1F945), (0x1F947, 0x1FAFF), (0x1FC00, 0x1FFFD),
+]
+
+# Emoji_Modifier, which UAX #29 counts as Extend
+EMOJI_MODIFIER = [(0x1F3FB, 0x1F3FF)]
+
+# Unassigned code points that UAX #11 gives the wide default
+WIDE_DEFAULT = [(0x3400, 0x4DBF), (0x4E00, 0x9FFF), (0xF900, 0xFAFF),
+                (0x20000, 0x2FFFD), (0x30000, 0x3FFFD)]
+
+
+def in_ranges(ranges):
+    s = set()
+    for lo, hi in ranges:
+        s.update(range(lo, hi + 1))
+    return s
+
+
+def read_ucd(ucd, names):
+    """Yield (first, last, fields) for each line of the first file found"""
+    for name in names:
+        path = os.path.join(ucd, name)
+        if not os.path.exists(path):
+            path = os.path.join(ucd, os.path.basename(name))
+        if os.path.exists(path):
+            break
+    else:
+        sys.exit('%s: cannot find %s in %s' % (sys.argv[0], names[0], ucd))
+    with open(path, encoding='utf-8') as f:
+        for line in f:
+            line = line.split('#', 1)[0].strip()
+            if not line:
+                continue
+            fields = [x.strip() for x in line.split(';')]
+            lo, _, hi = fields[0].partition('..')
+            yield int(lo, 16), int(hi or lo, 16), fields[1:]
+
+
+def version_of(ucd):
+    path = os.path.join(ucd, 'EastAsianWidth.txt')
+    with open(path, encoding='utf-8') as f:
+        first = f.readline()
+    # "# EastAsianWidth-14.0.0.txt"
+    return first.split('-', 1)[1].rsplit('.txt', 1)[0].strip()
+
+
+def properties_from_ucd(ucd):
+    gcb = [0] * MAX_CODE
+    pict = [False] * MAX_CODE
+    eaw = ['N'] * MAX_CODE
+    gc = ['Cn'] * MAX_CODE
+    for lo, hi, (value,) in read_ucd(ucd, ['auxiliary/GraphemeBreakProperty.txt']):
+        for c in range(lo, hi + 1):
+            gcb[c] = CLASSES.index(value)
+    for lo, hi, fields in read_ucd(ucd, ['emoji/emoji-data.txt']):
+        if fields[0] == 'Extended_Pictographic':
+            for c in range(lo, hi + 1):
+                pict[c] = True
+    for lo, hi, (value,) in read_ucd(ucd, ['EastAsianWidth.txt']):
+        for c in range(lo, hi + 1):
+            eaw[c] = value
+    for lo, hi, (value,) in read_ucd(ucd, ['extracted/DerivedGeneralCategory.txt']):
+        for c in range(lo, hi + 1):
+            gc[c] = value
+    return gcb, pict, eaw, gc, version_of(ucd)
+
+
+def properties_from_unicodedata():
+    other_extend = in_ranges(OTHER_GRAPHEME_EXTEND)
+    prepend = in_ranges(PREPEND)
+    not_spacing = in_ranges(NOT_SPACING_MARK)
+    extra_spacing = in_ranges(EXTRA_SPACING_MARK)
+    modifier = in_ranges(EMOJI_MODIFIER)
+    pict_set = in_ranges(EXTENDED_PICTOGRAPHIC)
+    wide = in_ranges(WIDE_DEFAULT)
+
+    gcb = [0] * MAX_CODE
+    pict = [False] * MAX_CODE
+    eaw = ['N'] * MAX_CODE
+    gc = ['Cn'] * MAX_CODE
+    for c in range(MAX_CODE):
+        ch = chr(c)
+        cat = unicodedata.category(ch)
+        gc[c] = cat
+        eaw[c] = 'W' if cat == 'Cn' and c in wide else unicodedata.east_asian_width(ch)
+        pict[c] = c in pict_set
+        if c == 0x0D:
+            cls = 'CR'
+        elif c == 0x0A:
+            cls = 'LF'
+        elif c == 0x200D:
+            cls = 'ZWJ'
+        elif c in prepend:
+            cls = 'Prepend'
+        elif cat in ('Mn', 'Me') or c in other_extend or c in modifier:
+            cls = 'Extend'
+        elif cat in ('Zl', 'Zp', 'Cc', 'Cs') or (cat == 'Cf' and c != 0x200C):
+            cls = 'Control'
+        elif 0x1F1E6 <= c <= 0x1F1FF:
+            cls = 'Regional_Indicator'
+        elif (cat == 'Mc' and c not in not_spacing) or c in extra_spacing:
+            cls = 'SpacingMark'
+        elif 0x1100 <= c <= 0x115F or 0xA960 <= c <= 0xA97C:
+            cls = 'L'
+        elif 0x1160 <= c <= 0x11A7 or 0xD7B0 <= c <= 0xD7C6:
+            cls = 'V'
+        elif 0x11A8 <= c <= 0x11FF or 0xD7CB <= c <= 0xD7FB:
+            cls = 'T'
+        elif 0xAC00 <= c <= 0xD7A3:
+            cls = 'LV' if (c - 0xAC00) % 28 == 0 else 'LVT'
+        else:
+            cls = 'Other'
+        gcb[c] = CLASSES.index(cls)
+    return gcb, pict, eaw, gc, unicodedata.unidata_version
+
+
+def width(c, eaw, gc, visible_format):
+    """The display width, following glibc's wcwidth() for printable characters"""
+    if gc in ('Mn', 'Me') or (gc == 'Cf' and c not in visible_format):
+        return 0
+    if 0x1160 <= c <= 0x11FF or 0xD7B0 <= c <= 0xD7FF or c == 0x200B:
+        return 0
+    if eaw in ('W', 'F'):
+        return 2
+    return 1
+
+
+def main():
+    if len(sys.argv) > 2:
+        sys.exit('usage: %s [UCD-DIR]' % sys.argv[0])
+    if len(sys.argv) == 2:
+        gcb, pict, eaw, gc, version = properties_from_ucd(sys.argv[1])
+    elif unicodedata.unidata_version != LISTS_VERSION:
+        sys.exit('%s: Python has Unicode %s, but the built-in lists are Unicode %s; '
+                 'give a UCD directory' % (sys.argv[0], unicodedata.unidata_version, LISTS_VERSION))
+    else:
+        gcb, pict, eaw, gc, version = properties_from_unicodedata()
+
+    # The soft hyphen and the prepended concatenation marks are visible
+    visible_format = in_ranges(PREPEND) | {0x00AD}
+    props = bytes(gcb[c] | pict[c] << 4 | width(c, eaw[c], gc[c], visible_format) << 5
+                  for c in range(MAX_CODE))
+    blocks = {}
+    stage1 = []
+    stage2 = []
+    for start in range(0, MAX_CODE, BLOCK):
+        block = props[start:start + BLOCK]
+        if block not in blocks:
+            blocks[block] = len(blocks)
+            stage2.append(block)
+        stage1.append(blocks[block])
+    index_type = 'uint8_t' if len(stage2) <= 256 else 'uint16_t'
+
+    out = sys.stdout
+    out.write('/*\n'
+              ' * Unicode %s grapheme cluster break classes and display widths.\n'
+              ' * Generated by gen_unicode_tables.py; do not edit.\n'
+              ' */\n\n' % version)
+    out.write('#define UNICODE_BLOCK_SHIFT %d\n' % (BLOCK.bit_length() - 1))
+    out.write('#define UNICODE_BLOCK_MASK %d\n\n' % (BLOCK - 1))
+    for i, name in enumerate(CLASSES):
+        out.write('#define GCB_%s %d\n' % (name.upper(), i))
+    out.write('\n#define UNICODE_GCB(p) ((p) & 0x0f)\n')
+    out.write('#define UNICODE_PICT(p) ((p) & 0x10)\n')
+    out.write('#define UNICODE_WIDTH(p) ((p) >> 5)\n\n')
+
+    out.write('static const %s unicode_stage1[%d] = {\n' % (index_type, len(stage1)))
+    for i in range(0, len(stage1), 16):
+        out.write('\t' + ', '.join('%d' % x for x in stage1[i:i + 16]) + ',\n')
+    out.write('};\n\n')
+
+    out.write('static const uint8_t unicode_stage2[%d][%d] = {\n' % (len(stage2), BLOCK))
+    for block in stage2:
+        out.write('\t{\n')
+        for i in range(0, BLOCK, 16):
+            out.write('\t\t' + ', '.join('0x%02x' % x for x in block[i:i + 16]) + ',\n')
+        out.write('\t},\n')
+    out.write('};\n')
+
+
+if __name__ == '__main__':
+    main()
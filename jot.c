@@ -16,27 +16,42 @@
    with this program; if not, see <https://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE    /* For asprintf and wcwidth */
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <limits.h>    /* For INT_MAX */
+#include <limits.h>    /* For INT_MAX and MB_LEN_MAX */
+#include <stdint.h>    /* For uint64_t */
 #include <unistd.h>    /* For getopt */
 #include <errno.h>     /* For errno */
 #include <string.h>    /* For strlen and other string functions */
-#include <termios.h>   /* Used by disable_ctrl_u_kill_line() */
+#include <ctype.h>     /* For isalnum and isdigit */
+#include <wchar.h>     /* For mbrtowc and wcwidth */
+#include <wctype.h>    /* For iswspace */
+#include <langinfo.h>  /* For nl_langinfo */
+#include <termios.h>   /* For the terminal settings */
 #include <signal.h>
 #include <alloca.h>
 #include <assert.h>
 #include <sys/wait.h>  /* For waitpid */
 #include <fcntl.h>     /* For open flags */
+#include <sys/ioctl.h> /* For TIOCGWINSZ */
+#include <poll.h>      /* For waiting on input and resizes */
+#include <sys/socket.h> /* For the daemon socket */
+#include <sys/un.h>    /* For sockaddr_un */
+#include <sys/stat.h>  /* For chmod and umask */
+#include <pthread.h>   /* For the parallel line sort */
+#include <time.h>      /* For clock_gettime */
+#include <sys/uio.h>   /* For writev */
+#include <termcap.h>   /* For tgetstr */
 #include <readline/readline.h>
 #include <getopt.h>
 
+#include "unicode_tables.h"
+
 #define DEFAULT_BANNER ""
 #define PROGRAM_NAME "jot"
 
-/* Global variables to save original terminal settings */
-static struct termios original_termios; /* To store original settings */
-static int termios_saved = 0;           /* Flag to check if settings are saved */
 
 /* Global variable to hold the file contents */
 static char *file_contents = NULL;
@@ -45,6 +60,28 @@ static char *file_contents = NULL;
 /* Global variable to hold the edited filename */
 static char *filename = NULL;
 
+/*
+ * The terminal session. The terminal is opened once, and its settings
+ * and size are kept here so that they need not be read again.
+ */
+static struct {
+	int fd;                  /* The terminal, or -1 until tty_open() */
+	FILE *in, *out;          /* Streams on fd for readline */
+	struct termios original; /* Settings when jot started */
+	struct termios editing;  /* The original settings without the line-kill character */
+	int saved;               /* Whether 'original' and 'editing' are set */
+	int rows, cols;          /* Window size, or 0 if not known */
+	volatile sig_atomic_t resized;  /* Set by SIGWINCH: the size must be read again */
+	int resize_pipe[2];      /* Written to by signal handlers, so that the wait for input wakes up */
+	volatile sig_atomic_t suspend_requested;  /* Set by SIGTSTP */
+	volatile sig_atomic_t continued;  /* Set by SIGCONT: the screen must be drawn again */
+	volatile sig_atomic_t suspended;  /* The terminal is given back for job control */
+	pid_t job_pid;           /* In a daemon session, the client: the process job control sees */
+} tty = { .fd = -1, .resize_pipe = { -1, -1 } };
+
+static void jot_redisplay(void);
+static void fold_move_point(int to_last);
+
 /*
  * These are the standard Emacs and Vi keymaps provided by Readline.
  */
@@ -57,28 +94,10 @@ static Keymap keymaps[] = {
 };
 
 /*
- * Functions to Bind/Unbind in All Keymaps:
- *  - bind_func_in_all_keymaps(): Binds a function to a key sequence across all keymaps.
- *  - unbind_func_in_all_keymaps(): Unbinds a function from all keymaps.
- *  - Both functions iterate over the keymaps array
+ * Functions to bind in several keymaps. jot's default bindings are in the
+ * default_bindings[] table; these are for bindings that depend on the mode.
  */
 
-static void
-bind_func_in_all_keymaps(const char *seq, rl_command_func_t *func)
-{
-	for (size_t i = 0; i < sizeof(keymaps) / sizeof(keymaps[0]); i++) {
-		rl_generic_bind(ISFUNC, seq, (char *)func, keymaps[i]);
-	}
-}
-
-static void
-unbind_func_in_all_keymaps(rl_command_func_t *func)
-{
-	for (size_t i = 0; i < sizeof(keymaps) / sizeof(keymaps[0]); i++) {
-		rl_unbind_function_in_map(func, keymaps[i]);
-	}
-}
-
 /* Bind only in vi keymaps */
 static void
 bind_func_in_vi_movement_keymap(const char *seq, rl_command_func_t *func)
@@ -96,767 +115,7294 @@ bind_func_in_insert_maps(const char *seq, rl_command_func_t *func)
 	rl_bind_keyseq_in_map(seq, func, vi_insertion_keymap);
 }
 
-static int
-jot_beginning_of_line(int count, int key)
-{
-	/* Move to the start of the current line */
-	while (rl_point > 0) {
-		/* Peek at previous character */
-		int saved_point = rl_point;
-		rl_backward_char(1, 0);
-		if (rl_line_buffer[rl_point] == '\n') {
-			rl_forward_char(1, 0);
-			break;
-		}
-		if (rl_point == 0 || rl_point == saved_point) {
-			break;
-		}
-	}
-	rl_redisplay();
-	return 0;
-}
+/*
+ * Startup profiling. Each phase of startup is timed from the end of the
+ * phase before it; --profile-startup prints the times.
+ */
+enum startup_phase {
+	STARTUP_FUNCTIONS,     /* Adding jot's functions */
+	STARTUP_BINDINGS,      /* Binding and unbinding keys */
+	STARTUP_OPTIONS,       /* Parsing the command line */
+	STARTUP_TERMINAL,      /* Saving and setting up the terminal */
+	STARTUP_READ,          /* Reading the text */
+	STARTUP_MODES,         /* Choosing the syntax and modes */
+	STARTUP_INPUTRC,       /* Readline initialization, including the inputrc file */
+	STARTUP_FIRST_PAINT,   /* Up to the first frame drawn */
+	STARTUP_PHASES
+};
 
-static int
-jot_end_of_line(int count, int key)
+static const char *const startup_phase_names[STARTUP_PHASES] = {
+	"functions", "bindings", "options", "terminal", "read", "modes", "inputrc", "first paint"
+};
+
+static struct timespec startup_last;  /* When the last phase ended */
+static double startup_ms[STARTUP_PHASES];
+static unsigned startup_done;         /* Bit set of the phases that ended */
+
+static void
+startup_begin(void)
 {
-	int buffer_len = rl_end; /* rl_end is the length of the line buffer */
-	/* Move rl_point to the end of the current line or buffer */
-	while (rl_point < buffer_len) {
-		if (rl_line_buffer[rl_point] == '\n') {
-			break;
-		}
-		rl_forward_char(1, 0);
-		if (rl_point >= buffer_len) {
-			break;
-		}
-	}
-	rl_redisplay();
-	return 0;
+	memset(startup_ms, 0, sizeof(startup_ms));
+	startup_done = 0;
+	clock_gettime(CLOCK_MONOTONIC, &startup_last);
 }
 
-static int
-jot_kill_line(int count, int key)
+/* Record the end of 'phase', unless it was recorded already */
+static void
+startup_mark(enum startup_phase phase)
 {
-	int start = rl_point;
-	int end = rl_point;
-	int buffer_len = rl_end; /* Total length of the line buffer */
-
-	/* Save the current point */
-	int orig_point = rl_point;
+	struct timespec now;
 
-	/* Move the rl_point to the end of the current line, excluding the newline */
-	while (rl_point < buffer_len) {
-		if (rl_line_buffer[rl_point] == '\n') {
-			/* Do not include the newline character */
-			break;
-		}
-		/* Move forward one character (multibyte-aware) */
-		rl_forward_char(1, 0);
+	if (startup_done & (1u << phase)) {
+		return;
 	}
-
-	end = rl_point; /* Update the end position */
-
-	/* Restore rl_point to its original position */
-	rl_point = orig_point;
-
-	/* Delete text from start to end */
-	rl_delete_text(start, end);
-	rl_point = start; /* Set cursor position back to start */
-	rl_redisplay();   /* Update the display */
-
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	startup_ms[phase] = (now.tv_sec - startup_last.tv_sec) * 1e3 +
+		(now.tv_nsec - startup_last.tv_nsec) / 1e6;
+	startup_last = now;
+	startup_done |= 1u << phase;
 }
 
-
-/* Function to restore terminal settings */
 static void
-restore_terminal_settings(void)
+startup_report(FILE *fp)
 {
-	if (termios_saved) {
-	/* Open /dev/tty to get the terminal file descriptor */
-	int fd = open("/dev/tty", O_RDWR);
-	if (fd == -1) {
-		perror("open /dev/tty");
-		return;
-	}
+	double total = 0;
 
-	/* Restore the original terminal attributes */
-	if (tcsetattr(fd, TCSANOW, &original_termios) == -1) {
-		perror("tcsetattr");
-		close(fd);
-		return;
-	}
-	termios_saved = 0; /* Reset the flag */
-		close(fd);
+	for (int phase = 0; phase < STARTUP_PHASES; phase++) {
+		fprintf(fp, "%-12s %8.3f ms\n", startup_phase_names[phase], startup_ms[phase]);
+		total += startup_ms[phase];
 	}
+	fprintf(fp, "%-12s %8.3f ms\n", "total", total);
 }
 
+/*
+ * Grapheme clusters
+ *
+ * The cursor moves over, and deletion removes, whole user-perceived
+ * characters: a base character with its combining marks, a Hangul
+ * syllable, an emoji ZWJ sequence or a flag. In UTF-8 locales the
+ * boundaries follow the rules of UAX #29, with each character's class
+ * and display width looked up in the tables of unicode_tables.h, which
+ * gen_unicode_tables.py generates from the Unicode Character Database.
+ * In other locales each multibyte character is a cluster of its own.
+ * ASCII that is not followed by a combining character never looks at
+ * the tables.
+ */
+static int utf8_locale = 0;   /* Whether the locale's encoding is UTF-8 */
 
-/* Signal handler to catch signals and restore terminal settings */
+/* Called once readline has set the locale */
 static void
-signal_handler(int signum)
+unicode_init(void)
 {
-	restore_terminal_settings();
+	utf8_locale = strcmp(nl_langinfo(CODESET), "UTF-8") == 0;
+}
 
-	/* Restore default signal handler and re-raise the signal */
-	signal(signum, SIG_DFL);
-	raise(signum);
+/* Return the table entry of code point 'c' */
+static unsigned
+unicode_props(uint32_t c)
+{
+	return unicode_stage2[unicode_stage1[c >> UNICODE_BLOCK_SHIFT]][c & UNICODE_BLOCK_MASK];
 }
 
-static void
-save_terminal_settings(void)
+/*
+ * Decode the UTF-8 character at text[0..len) into *c and return its
+ * length. An invalid or truncated sequence is one byte long and decodes
+ * as U+FFFD.
+ */
+static int
+utf8_decode(const char *text, int len, uint32_t *c)
 {
-	/* Open /dev/tty to get the terminal file descriptor */
-	int fd = open("/dev/tty", O_RDWR);
-	if (fd == -1) {
-		perror("open /dev/tty");
-		exit(EXIT_FAILURE);
-	}
+	const unsigned char *s = (const unsigned char *)text;
+	uint32_t min;
+	int n;
 
-	if (tcgetattr(fd, &original_termios) == -1) {
-		perror("tcgetattr");
-		close(fd);
-		exit(EXIT_FAILURE);
+	if (s[0] < 0x80) {
+		*c = s[0];
+		return 1;
 	}
-	termios_saved = 1;
-	close(fd);
+	if (s[0] >= 0xc2 && s[0] < 0xe0) {
+		n = 2, min = 0x80, *c = s[0] & 0x1f;
+	} else if (s[0] >= 0xe0 && s[0] < 0xf0) {
+		n = 3, min = 0x800, *c = s[0] & 0x0f;
+	} else if (s[0] >= 0xf0 && s[0] < 0xf5) {
+		n = 4, min = 0x10000, *c = s[0] & 0x07;
+	} else {
+		n = 0, min = 0;
+	}
+	for (int i = 1; i < n; i++) {
+		if (i >= len || (s[i] & 0xc0) != 0x80) {
+			n = 0;
+			break;
+		}
+		*c = *c << 6 | (s[i] & 0x3f);
+	}
+	if (n == 0 || *c < min || *c > 0x10ffff || (*c >= 0xd800 && *c < 0xe000)) {
+		*c = 0xfffd;
+		return 1;
+	}
+	return n;
 }
 
-static void
-disable_ctrl_u_kill_line(void)
+/* Return the start of the UTF-8 character that ends at 'off', decoded into *c */
+static int
+utf8_prev(const char *text, int off, uint32_t *c)
 {
-	struct termios term;
+	int start = off - 1;
 
-	/* Open /dev/tty to get the terminal file descriptor */
-	int fd = open("/dev/tty", O_RDWR);
-	if (fd == -1) {
-		perror("open /dev/tty");
-		return;
+	while (start > 0 && off - start < 4 && ((unsigned char)text[start] & 0xc0) == 0x80) {
+		start--;
 	}
-
-	/* Get the current terminal attributes */
-	if (tcgetattr(fd, &term) == -1) {
-		perror("tcgetattr");
-		close(fd);
-		return;
+	if (start + utf8_decode(text + start, off - start, c) != off) {
+		/* A stray byte */
+		start = off - 1;
+		utf8_decode(text + start, 1, c);
 	}
+	return start;
+}
 
-	/* Disable the line-kill character */
-	term.c_cc[VKILL] = _POSIX_VDISABLE;
+/*
+ * Decode the character at text[0..len) into *wc and return its length.
+ * An invalid sequence is one byte long and decodes as U+FFFD.
+ */
+static int
+char_decode(const char *text, int len, wchar_t *wc)
+{
+	if (utf8_locale || (unsigned char)text[0] < 0x80) {
+		uint32_t c;
+		int n = utf8_decode(text, len, &c);
+		*wc = c;
+		return n;
+	}
 
-	/* Set the modified attributes immediately */
-	if (tcsetattr(fd, TCSANOW, &term) == -1) {
-		perror("tcsetattr");
-		close(fd);
-		return;
+	mbstate_t state;
+	memset(&state, 0, sizeof(state));
+	size_t n = mbrtowc(wc, text, len, &state);
+	if (n == (size_t)-1 || n == (size_t)-2 || n == 0) {
+		*wc = 0xfffd;
+		return 1;
 	}
-	close(fd);
+	return n;
 }
 
-/* 
- * Function to redirect stdio to /dev/tty and save original stdin and stdout.
- * Returns 0 on success, -1 on error.
+/*
+ * Whether there is no grapheme cluster boundary between two characters
+ * of classes 'prev' and 'next' (UAX #29 rules GB3 to GB13). '*pict' is
+ * 1 after an Extended_Pictographic character and the Extend characters
+ * following it, and 2 after a ZWJ that follows those; '*ri' counts the
+ * Regional_Indicator characters before 'next'. Both are updated.
  */
 static int
-redirect_stdio_to_tty(FILE **orig_stdout, FILE **orig_stdin)
+grapheme_joins(unsigned prev, unsigned next, int *pict, int *ri)
 {
-	/* Save the original stdout */
-	int orig_stdout_fd = dup(STDOUT_FILENO);
-	if (orig_stdout_fd == -1) {
-		perror("dup STDOUT_FILENO");
-		return -1;
+	int p = UNICODE_GCB(prev);
+	int n = UNICODE_GCB(next);
+	int emoji = *pict;
+
+	if (UNICODE_PICT(next)) {
+		*pict = 1;
+	} else if (emoji == 1 && n == GCB_ZWJ) {
+		*pict = 2;
+	} else if (emoji != 1 || n != GCB_EXTEND) {
+		*pict = 0;
 	}
+	*ri = n == GCB_REGIONAL_INDICATOR ? *ri + 1 : 0;
 
-	*orig_stdout = fdopen(orig_stdout_fd, "w");
-	if (*orig_stdout == NULL) {
-		perror("fdopen orig_stdout_fd");
-		close(orig_stdout_fd);
-		return -1;
+	if (p == GCB_CR && n == GCB_LF) {
+		return 1;
 	}
-
-	/* Save the original stdin */
-	int orig_stdin_fd = dup(STDIN_FILENO);
-	if (orig_stdin_fd == -1) {
-		perror("dup STDIN_FILENO");
-		fclose(*orig_stdout);
-		return -1;
+	if (p == GCB_CONTROL || p == GCB_CR || p == GCB_LF ||
+		n == GCB_CONTROL || n == GCB_CR || n == GCB_LF) {
+		return 0;
+	}
+	if (p == GCB_L && (n == GCB_L || n == GCB_V || n == GCB_LV || n == GCB_LVT)) {
+		return 1;
 	}
+	if ((p == GCB_LV || p == GCB_V) && (n == GCB_V || n == GCB_T)) {
+		return 1;
+	}
+	if ((p == GCB_LVT || p == GCB_T) && n == GCB_T) {
+		return 1;
+	}
+	if (n == GCB_EXTEND || n == GCB_ZWJ || n == GCB_SPACINGMARK || p == GCB_PREPEND) {
+		return 1;
+	}
+	if (emoji == 2 && UNICODE_PICT(next)) {
+		return 1;
+	}
+	/* Regional indicators pair up into flags */
+	return p == GCB_REGIONAL_INDICATOR && n == GCB_REGIONAL_INDICATOR && *ri % 2 == 0;
+}
 
-	*orig_stdin = fdopen(orig_stdin_fd, "r");
-	if (*orig_stdin == NULL) {
-		perror("fdopen orig_stdin_fd");
-		close(orig_stdin_fd);
-		fclose(*orig_stdout);
-		return -1;
+/* Return the end of the grapheme cluster that starts at 'off' in text[0..len) */
+static int
+grapheme_next(const char *text, int len, int off)
+{
+	if (off >= len) {
+		return len;
 	}
 
-	/* Open /dev/tty for input and output */
-	int tty_fd = open("/dev/tty", O_RDWR);
-	if (tty_fd == -1) {
-		perror("open /dev/tty");
-		fclose(*orig_stdout);
-		fclose(*orig_stdin);
-		return -1;
+	unsigned char ch = text[off];
+	if (ch < 0x80 && ch != '\r' && (off + 1 == len || (unsigned char)text[off + 1] < 0x80)) {
+		return off + 1;
+	}
+	if (!utf8_locale) {
+		wchar_t wc;
+		return off + char_decode(text + off, len - off, &wc);
 	}
 
-	/* Duplicate tty_fd to stdin, stdout, stderr */
-	if (dup2(tty_fd, STDIN_FILENO) == -1) {
-		perror("dup2 stdin");
-		close(tty_fd);
-		fclose(*orig_stdout);
-		fclose(*orig_stdin);
-		return -1;
+	uint32_t c;
+	off += utf8_decode(text + off, len - off, &c);
+	unsigned prev = unicode_props(c);
+	int pict = UNICODE_PICT(prev) ? 1 : 0;
+	int ri = UNICODE_GCB(prev) == GCB_REGIONAL_INDICATOR;
+	while (off < len) {
+		int n = utf8_decode(text + off, len - off, &c);
+		unsigned next = unicode_props(c);
+		if (!grapheme_joins(prev, next, &pict, &ri)) {
+			break;
+		}
+		prev = next;
+		off += n;
 	}
-	if (dup2(tty_fd, STDOUT_FILENO) == -1) {
-		perror("dup2 stdout");
-		close(tty_fd);
-		fclose(*orig_stdout);
-		fclose(*orig_stdin);
-		return -1;
+	return off;
+}
+
+/*
+ * Return the start of the grapheme cluster that ends at 'off'. The rules
+ * need context from before the cluster, so this backs up to a character
+ * that always starts a cluster and finds the boundaries going forward.
+ */
+static int
+grapheme_prev(const char *text, int off)
+{
+	if (off <= 0) {
+		return 0;
 	}
-	if (dup2(tty_fd, STDERR_FILENO) == -1) {
-		perror("dup2 stderr");
-		close(tty_fd);
-		fclose(*orig_stdout);
-		fclose(*orig_stdin);
-		return -1;
+	if ((unsigned char)text[off - 1] < 0x80 && text[off - 1] != '\n' &&
+		(off == 1 || (unsigned char)text[off - 2] < 0x80)) {
+		return off - 1;
 	}
 
-	/* Close tty_fd if it's not stdin, stdout, or stderr */
-	if (tty_fd > 2) {
-		close(tty_fd);
+	int start;
+	if (utf8_locale) {
+		uint32_t c;
+		start = utf8_prev(text, off, &c);
+		unsigned props = unicode_props(c);
+		while (start > 0) {
+			int before = utf8_prev(text, start, &c);
+			unsigned prev = unicode_props(c);
+			int p = UNICODE_GCB(prev);
+			int n = UNICODE_GCB(props);
+			if (n == GCB_CONTROL || n == GCB_CR || (n == GCB_LF && p != GCB_CR) ||
+				p == GCB_CONTROL || p == GCB_LF || (p == GCB_CR && n != GCB_LF) ||
+				(n == GCB_OTHER && !UNICODE_PICT(props) && p != GCB_PREPEND)) {
+				break;
+			}
+			start = before;
+			props = prev;
+		}
+	} else if (MB_CUR_MAX == 1) {
+		return off - 1;
+	} else {
+		/* Multibyte characters can only be found from the start of the line */
+		char *nl = memrchr(text, '\n', off - 1);
+		start = nl ? nl - text + 1 : 0;
+	}
+	for (;;) {
+		int next = grapheme_next(text, off, start);
+		if (next >= off) {
+			return start;
+		}
+		start = next;
 	}
+}
 
-	return 0;
+/* Return the start of the line containing 'pos' */
+static int
+line_begin(int pos)
+{
+	char *nl = memrchr(rl_line_buffer, '\n', pos);
+	return nl ? nl - rl_line_buffer + 1 : 0;
 }
 
+/* Return the end of the line containing 'pos', before its newline */
 static int
-jot_kill_backward_line(int count, int key)
+line_end(int pos)
 {
-	int start = rl_point;
-	int end = rl_point;
-	/* Find the start of the current line */
-	while (start > 0 && rl_line_buffer[start - 1] != '\n') {
-		start--;
-	}
-	/* Kill text from start to end */
-	rl_kill_text(start, end);
-	rl_point = start;
-	rl_redisplay();
-	return 0;
+	char *nl = memchr(rl_line_buffer + pos, '\n', rl_end - pos);
+	return nl ? nl - rl_line_buffer : rl_end;
 }
 
+/* Return the number of grapheme clusters from 'start' to 'end' */
 static int
-jot_kill_whole_line(int count, int key)
+grapheme_count(int start, int end)
 {
-	int buffer_len = strlen(rl_line_buffer);
-	int start = rl_point;
-	int end = rl_point;
+	int count = 0;
 
-	/* Find the start of the current line */
-	while (start > 0 && rl_line_buffer[start - 1] != '\n') {
-		start--;
+	while (start < end) {
+		start = grapheme_next(rl_line_buffer, end, start);
+		count++;
 	}
+	return count;
+}
 
-	/* Find the end of the current line */
-	while (end < buffer_len && rl_line_buffer[end] != '\n') {
-		end++;
-	}
-	/* Include the newline character if present */
-	if (end < buffer_len && rl_line_buffer[end] == '\n') {
-		end++;
+/* Return the offset 'count' grapheme clusters after 'pos', stopping at the end of its line */
+static int
+grapheme_skip(int pos, int count)
+{
+	int end = line_end(pos);
+
+	while (count-- > 0 && pos < end) {
+		pos = grapheme_next(rl_line_buffer, end, pos);
 	}
+	return pos;
+}
 
-	/* Kill text from start to end */
-	rl_kill_text(start, end);
-	rl_point = start;
-	rl_redisplay();
-	return 0;
+/* Whether the character at 'pos' is white space other than a newline */
+static int
+blank_at(int pos, int *len)
+{
+	wchar_t wc;
+
+	*len = char_decode(rl_line_buffer + pos, rl_end - pos, &wc);
+	return wc != '\n' && iswspace(wc);
 }
 
+/* Return the first offset from 'pos' that is not white space, stopping at the end of the line */
 static int
-jot_custom_ctrl_d(int count, int key)
+skip_blanks(int pos)
 {
-	if (count <= 0) {
-		return 0;
-	}
-	if (rl_point < rl_end) {
-		/* Delete the character under the cursor */
-		return rl_delete(count, key);
-	} else {
-		return rl_named_function("accept-line")(count, key);
+	int len;
+
+	while (pos < rl_end && blank_at(pos, &len)) {
+		pos += len;
 	}
+	return pos;
 }
 
-/* Function to move the cursor up 'count' lines */
+/* Whether readline is in vi command mode, where the point stays on a character */
 static int
-jot_move_cursor_up(int count, int key)
+vi_command_mode(void)
 {
-	while (count-- > 0) {
-		int orig_point = rl_point;
-		int line_col = 0;
-
-		/* Move to the start of the current line */
-		while (rl_point > 0) {
-			rl_backward_char(1, 0);
-			if (rl_line_buffer[rl_point] == '\n') {
-				rl_forward_char(1, 0);
-				break;
-			}
-			line_col++;
-		}
-
-		/* If we're at the beginning of the buffer, ring bell and restore position */
-		if (rl_point == 0) {
-			rl_point = orig_point;
-			rl_ding();
-			break;
-		}
+	return rl_get_keymap() == vi_movement_keymap;
+}
 
-		/* Move back over the newline character to the end of the previous line */
-		rl_backward_char(1, 0);
+static int jot_backward_char(int count, int key);
+static int jot_backward_delete_char(int count, int key);
+static int jot_vi_backward_delete_char(int count, int key);
 
-		/* Move to the start of the previous line */
-		while (rl_point > 0) {
-			rl_backward_char(1, 0);
-			if (rl_line_buffer[rl_point] == '\n') {
-				rl_forward_char(1, 0);
-				break;
-			}
-		}
+static int
+jot_forward_char(int count, int key)
+{
+	if (count < 0) {
+		return jot_backward_char(-count, key);
+	}
 
-		/* Move to the calculated column in the previous line */
-		for (int i = 0; i < line_col; i++) {
-			if (rl_line_buffer[rl_point] == '\n' || rl_point >= rl_end) {
-				break;
-			}
-			rl_forward_char(1, 0);
-		}
+	int limit = vi_command_mode() ? grapheme_prev(rl_line_buffer, rl_end) : rl_end;
+	int point = rl_point;
+	while (count-- > 0 && point < limit) {
+		point = grapheme_next(rl_line_buffer, rl_end, point);
+	}
+	if (point == rl_point) {
+		rl_ding();
 	}
-	rl_redisplay();
+	rl_point = point;
+	return 0;
+}
+
+static int
+jot_backward_char(int count, int key)
+{
+	if (count < 0) {
+		return jot_forward_char(-count, key);
+	}
+
+	int point = rl_point;
+	while (count-- > 0 && point > 0) {
+		point = grapheme_prev(rl_line_buffer, point);
+	}
+	if (point == rl_point) {
+		rl_ding();
+	}
+	rl_point = point;
+	return 0;
+}
+
+/*
+ * Delete the 'count' grapheme clusters under and after the cursor. Like
+ * Readline's delete-char, deleting more than one saves them in the kill
+ * ring.
+ */
+static int
+jot_delete_char(int count, int key)
+{
+	if (count < 0) {
+		return jot_backward_delete_char(-count, key);
+	}
+	if (rl_point >= rl_end) {
+		rl_ding();
+		return 0;
+	}
+
+	int end = rl_point;
+	for (int i = 0; i < count && end < rl_end; i++) {
+		end = grapheme_next(rl_line_buffer, rl_end, end);
+	}
+	if (count > 1) {
+		rl_kill_text(rl_point, end);
+	} else {
+		rl_delete_text(rl_point, end);
+	}
+	return 0;
+}
+
+static int
+jot_backward_delete_char(int count, int key)
+{
+	if (count < 0) {
+		return jot_delete_char(-count, key);
+	}
+	if (rl_insert_mode == 0) {
+		/* In overwrite mode Readline puts back the overwritten text */
+		return rl_rubout(count, key);
+	}
+	if (rl_point == 0) {
+		rl_ding();
+		return 0;
+	}
+
+	int start = rl_point;
+	for (int i = 0; i < count && start > 0; i++) {
+		start = grapheme_prev(rl_line_buffer, start);
+	}
+	if (count > 1) {
+		rl_kill_text(rl_point, start);
+	} else {
+		rl_delete_text(start, rl_point);
+	}
+	rl_point = start;
+	return 0;
+}
+
+/* Vi x: kill the 'count' grapheme clusters under and after the cursor */
+static int
+jot_vi_delete_char(int count, int key)
+{
+	if (count < 0) {
+		return jot_vi_backward_delete_char(-count, key);
+	}
+
+	/* The count stops at the end of the line */
+	int line_stop = line_end(rl_point);
+	if (rl_point >= line_stop) {
+		rl_ding();
+		return 0;
+	}
+
+	int end = rl_point;
+	for (int i = 0; i < count && end < line_stop; i++) {
+		end = grapheme_next(rl_line_buffer, line_stop, end);
+	}
+	rl_kill_text(rl_point, end);
+	if (rl_point > line_begin(rl_point) && rl_point == line_end(rl_point)) {
+		rl_point = grapheme_prev(rl_line_buffer, rl_point);
+	}
+	return 0;
+}
+
+/* Vi X: kill the 'count' grapheme clusters before the cursor */
+static int
+jot_vi_backward_delete_char(int count, int key)
+{
+	if (count < 0) {
+		return jot_vi_delete_char(-count, key);
+	}
+
+	/* The count stops at the start of the line */
+	int line_stop = line_begin(rl_point);
+	if (rl_point <= line_stop) {
+		rl_ding();
+		return 0;
+	}
+
+	int start = rl_point;
+	for (int i = 0; i < count && start > line_stop; i++) {
+		start = grapheme_prev(rl_line_buffer, start);
+	}
+	rl_kill_text(start, rl_point);
+	rl_point = start;
+	return 0;
+}
+
+/* The character vi r last replaced with, for repeating it with '.' */
+static char vi_replacement[MB_LEN_MAX + 1];
+static int vi_redoing = 0;
+
+/* Vi .: repeat the last change, letting r reuse its character */
+static int
+jot_vi_redo(int count, int key)
+{
+	vi_redoing = 1;
+	int ret = rl_vi_redo(count, key);
+	vi_redoing = 0;
+	return ret;
+}
+
+/*
+ * Vi r: replace the 'count' grapheme clusters under and after the cursor
+ * with the next character typed, and leave the cursor on the last one.
+ * Nothing is replaced if the line has fewer than 'count' left.
+ */
+static int
+jot_vi_change_char(int count, int key)
+{
+	if (!vi_redoing) {
+		mbstate_t state;
+		int len = 0;
+
+		memset(&state, 0, sizeof(state));
+		do {
+			int c = rl_read_key();
+			if (c < 0 || c == ESC || c == CTRL('C')) {
+				return 0;
+			}
+			vi_replacement[len++] = c;
+		} while (len < MB_LEN_MAX &&
+				 mbrtowc(NULL, vi_replacement + len - 1, 1, &state) == (size_t)-2);
+		vi_replacement[len] = '\0';
+	}
+	int line_stop = line_end(rl_point);
+	int end = rl_point;
+	int n = 0;
+	while (n < count && end < line_stop) {
+		end = grapheme_next(rl_line_buffer, line_stop, end);
+		n++;
+	}
+	if (vi_replacement[0] == '\0' || n == 0 || n < count) {
+		rl_ding();
+		return 0;
+	}
+
+	rl_begin_undo_group();
+	for (int i = 0; i < count; i++) {
+		rl_delete_text(rl_point, grapheme_next(rl_line_buffer, rl_end, rl_point));
+		rl_insert_text(vi_replacement);
+	}
+	rl_point = grapheme_prev(rl_line_buffer, rl_point);
+	rl_end_undo_group();
+	return 0;
+}
+
+static int
+jot_beginning_of_line(int count, int key)
+{
+	rl_point = line_begin(rl_point);
+	jot_redisplay();
+	return 0;
+}
+
+static int
+jot_end_of_line(int count, int key)
+{
+	rl_point = line_end(rl_point);
+	jot_redisplay();
+	return 0;
+}
+
+static int
+jot_kill_line(int count, int key)
+{
+	int start = rl_point;
+	int end = line_end(rl_point);
+
+	/* Delete text from start to end */
+	rl_delete_text(start, end);
+	rl_point = start; /* Set cursor position back to start */
+	jot_redisplay();   /* Update the display */
+
+	return 0;
+}
+
+
+/*
+ * Open the terminal, unless it is open already, and return its file
+ * descriptor or -1. A session started by the daemon has no controlling
+ * terminal and is given the terminal passed by the client instead.
+ */
+static int
+tty_open(void)
+{
+	if (tty.fd == -1) {
+		tty.fd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+		if (tty.fd == -1) {
+			perror("open /dev/tty");
+		}
+	}
+	return tty.fd;
+}
+
+/* Save the terminal settings, to be restored by tty_restore() */
+static int
+tty_save(void)
+{
+	if (tty_open() == -1) {
+		return -1;
+	}
+	if (tcgetattr(tty.fd, &tty.original) == -1) {
+		perror("tcgetattr");
+		return -1;
+	}
+
+	/*
+	 * Ctrl+U is jot-kill-backward-line, not the terminal's line-kill, and
+	 * the erase character must not be bound to readline's rubout over
+	 * jot-backward-delete-char
+	 */
+	tty.editing = tty.original;
+	tty.editing.c_cc[VKILL] = _POSIX_VDISABLE;
+	tty.editing.c_cc[VERASE] = _POSIX_VDISABLE;
+	tty.saved = 1;
+	return 0;
+}
+
+/* Apply the settings jot edits with, before readline adds its own */
+static void
+tty_set_editing(void)
+{
+	if (tty.saved && tcsetattr(tty.fd, TCSANOW, &tty.editing) == -1) {
+		perror("tcsetattr");
+	}
+}
+
+/*
+ * Restore the saved terminal settings. Only calls tcsetattr(), so that it
+ * is safe to call from a signal handler.
+ */
+static int
+tty_restore(void)
+{
+	if (!tty.saved || tty.suspended) {
+		return 0;
+	}
+	return tcsetattr(tty.fd, TCSANOW, &tty.original);
+}
+
+/* Get the window size, reading it only when it may have changed */
+static int
+tty_get_size(int *rows, int *cols)
+{
+	if (tty.rows == 0 || tty.resized) {
+		struct winsize ws;
+		tty.resized = 0;
+		if (tty.fd == -1 || ioctl(tty.fd, TIOCGWINSZ, &ws) != 0 ||
+			ws.ws_row == 0 || ws.ws_col == 0) {
+			return -1;
+		}
+		tty.rows = ws.ws_row;
+		tty.cols = ws.ws_col;
+	}
+	*rows = tty.rows;
+	*cols = tty.cols;
+	return 0;
+}
+
+/* Wake up tty_getc(); safe to call from a signal handler */
+static void
+tty_wake(void)
+{
+	int saved_errno = errno;
+
+	if (tty.resize_pipe[1] != -1 && write(tty.resize_pipe[1], "", 1) == -1) {
+		/* The pipe is full: a wakeup is pending already */
+	}
+	errno = saved_errno;
+}
+
+static void
+tty_sigwinch_handler(int signum)
+{
+	tty.resized = 1;
+	tty_wake();
+}
+
+/* Suspending is left to tty_getc(), where the display can be finished */
+static void
+tty_sigtstp_handler(int signum)
+{
+	tty.suspend_requested = 1;
+	tty_wake();
+}
+
+static void
+tty_sigcont_handler(int signum)
+{
+	/* The window may have been resized while jot was stopped */
+	tty.resized = 1;
+	tty.continued = 1;
+	tty_wake();
+}
+
+/* Signal handler to catch signals and restore terminal settings */
+static void
+signal_handler(int signum)
+{
+	tty_restore();
+
+	/* Restore default signal handler and re-raise the signal */
+	signal(signum, SIG_DFL);
+	raise(signum);
+}
+
+/* 
+ * Function to redirect stdio to /dev/tty and save original stdin and stdout.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+redirect_stdio_to_tty(FILE **orig_stdout, FILE **orig_stdin)
+{
+	/* Save the original stdout */
+	int orig_stdout_fd = dup(STDOUT_FILENO);
+	if (orig_stdout_fd == -1) {
+		perror("dup STDOUT_FILENO");
+		return -1;
+	}
+
+	*orig_stdout = fdopen(orig_stdout_fd, "w");
+	if (*orig_stdout == NULL) {
+		perror("fdopen orig_stdout_fd");
+		close(orig_stdout_fd);
+		return -1;
+	}
+
+	/* Save the original stdin */
+	int orig_stdin_fd = dup(STDIN_FILENO);
+	if (orig_stdin_fd == -1) {
+		perror("dup STDIN_FILENO");
+		fclose(*orig_stdout);
+		return -1;
+	}
+
+	*orig_stdin = fdopen(orig_stdin_fd, "r");
+	if (*orig_stdin == NULL) {
+		perror("fdopen orig_stdin_fd");
+		close(orig_stdin_fd);
+		fclose(*orig_stdout);
+		return -1;
+	}
+
+	/* Use the terminal for input and output */
+	int fd = tty_open();
+	if (fd == -1) {
+		fclose(*orig_stdout);
+		fclose(*orig_stdin);
+		return -1;
+	}
+
+	/* Duplicate the terminal to stdin, stdout, stderr */
+	if (dup2(fd, STDIN_FILENO) == -1) {
+		perror("dup2 stdin");
+		fclose(*orig_stdout);
+		fclose(*orig_stdin);
+		return -1;
+	}
+	if (dup2(fd, STDOUT_FILENO) == -1) {
+		perror("dup2 stdout");
+		fclose(*orig_stdout);
+		fclose(*orig_stdin);
+		return -1;
+	}
+	if (dup2(fd, STDERR_FILENO) == -1) {
+		perror("dup2 stderr");
+		fclose(*orig_stdout);
+		fclose(*orig_stdin);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+jot_kill_backward_line(int count, int key)
+{
+	int start = rl_point;
+	int end = rl_point;
+	/* Find the start of the current line */
+	while (start > 0 && rl_line_buffer[start - 1] != '\n') {
+		start--;
+	}
+	/* Kill text from start to end */
+	rl_kill_text(start, end);
+	rl_point = start;
+	jot_redisplay();
+	return 0;
+}
+
+static int
+jot_kill_whole_line(int count, int key)
+{
+	int buffer_len = strlen(rl_line_buffer);
+	int start = rl_point;
+	int end = rl_point;
+
+	/* Find the start of the current line */
+	while (start > 0 && rl_line_buffer[start - 1] != '\n') {
+		start--;
+	}
+
+	/* Find the end of the current line */
+	while (end < buffer_len && rl_line_buffer[end] != '\n') {
+		end++;
+	}
+	/* Include the newline character if present */
+	if (end < buffer_len && rl_line_buffer[end] == '\n') {
+		end++;
+	}
+
+	/* Kill text from start to end */
+	rl_kill_text(start, end);
+	rl_point = start;
+	jot_redisplay();
+	return 0;
+}
+
+static int
+jot_custom_ctrl_d(int count, int key)
+{
+	if (count <= 0) {
+		return 0;
+	}
+	if (rl_point < rl_end) {
+		/* Delete the character under the cursor */
+		return jot_delete_char(count, key);
+	} else {
+		return rl_named_function("accept-line")(count, key);
+	}
+}
+
+/* Function to move the cursor up 'count' lines */
+static int
+jot_move_cursor_up(int count, int key)
+{
+	while (count-- > 0) {
+		fold_move_point(0);
+		int line_start = line_begin(rl_point);
+
+		/* If we're on the first line, ring bell */
+		if (line_start == 0) {
+			rl_ding();
+			break;
+		}
+
+		/* Move to the same character column in the previous line */
+		int line_col = grapheme_count(line_start, rl_point);
+		rl_point = grapheme_skip(line_begin(line_start - 1), line_col);
+	}
+	fold_move_point(0);
+	jot_redisplay();
 	return 0;
 }
 
 /* Function to move the cursor down count lines */
 static int
-jot_move_cursor_down(int count, int key)
+jot_move_cursor_down(int count, int key)
+{
+	while (count-- > 0) {
+		fold_move_point(1);
+		int end = line_end(rl_point);
+
+		/* Check if we're at the last line */
+		if (end >= rl_end) {
+			rl_ding();  /* Beep to indicate no more lines below */
+			break;
+		}
+
+		/* Move to the same character column in the next line, or its end */
+		int line_col = grapheme_count(line_begin(rl_point), rl_point);
+		rl_point = grapheme_skip(end + 1, line_col);
+	}
+	fold_move_point(0);
+	jot_redisplay();
+	return 0;
+}
+
+/* Custom function to insert a newline character */
+static int
+jot_insert_newline(int count, int key)
+{
+	/* Insert a newline character into the input buffer */
+	rl_insert_text("\n");
+	/* Redisplay the input line with the new content */
+	jot_redisplay();
+	return 0; /* Return 0 to indicate the key has been handled */
+}
+
+static int
+jot_move_to_first_nonblank_next_line(int count, int key)
+{
+	while (count-- > 0) {
+		/* Find the end of the current line */
+		int end = line_end(rl_point);
+
+		/* If we're at the last line, do nothing */
+		if (end >= rl_end) {
+			rl_ding();
+			break;
+		}
+
+		/* Move to the first non-blank character in the next line */
+		rl_point = skip_blanks(end + 1);
+	}
+	jot_redisplay();
+	return 0;
+}
+
+/*
+ * Vi command to delete 'count' lines ('dd').
+ * It behaves slightly differently from jot_kill_line()
+ */
+static int
+jot_vi_delete_current_line(int count, int key)
+{
+	int buffer_len = strlen(rl_line_buffer);
+	int start = rl_point;
+	int end = rl_point;
+
+	/* Find the start of the current line */
+	while (start > 0 && rl_line_buffer[start - 1] != '\n') {
+		start--;
+	}
+
+	/* Delete 'count' lines */
+	for (int i = 0; i < count; i++) {
+		/* Find the end of the current line */
+		while (end < buffer_len && rl_line_buffer[end] != '\n') {
+			end++;
+		}
+		/* Include the newline character */
+		if (end < buffer_len && rl_line_buffer[end] == '\n') {
+			end++;
+		}
+	}
+
+	/* Remove the text from start to end */
+	rl_kill_text(start, end);
+	rl_point = start;
+	jot_redisplay();
+	return 0;
+}
+
+/* Vi command to delete to end of line ('D') */
+static int
+jot_vi_delete_to_end_of_line(int count, int key)
+{
+	int buffer_len = strlen(rl_line_buffer);
+	int start = rl_point;
+	int end = rl_point;
+
+	/* Delete to the end of the current line or multiple lines */
+	for (int i = 0; i < count; i++) {
+		while (end < buffer_len && rl_line_buffer[end] != '\n') {
+			end++;
+		}
+		if (i < count - 1 && end < buffer_len && rl_line_buffer[end] == '\n') {
+			end++; /* Include newline if more counts are left */
+		}
+	}
+
+	/* Remove text from cursor to end */
+	rl_kill_text(start, end);
+	rl_point = start;
+	jot_redisplay();
+	return 0;
+}
+
+/* Vi command to join lines ('J') */
+static int
+jot_vi_join_lines(int count, int key)
+{
+	rl_begin_undo_group();
+
+	while (count-- > 0) {
+		int start_pos = rl_point;
+		int end = line_end(rl_point);
+
+		/* Check if we have a newline to join with */
+		if (end >= rl_end) {
+			rl_ding(); /* Beep to indicate no action */
+			break;
+		}
+
+		/* Delete the newline character and the blanks that start the next line */
+		rl_delete_text(end, skip_blanks(end + 1));
+		rl_point = end;
+
+		/* Insert a space unless the join is next to white space or a buffer end */
+		wchar_t before_char = 0, after_char = 0;
+		if (end > 0) {
+			int prev = grapheme_prev(rl_line_buffer, end);
+			char_decode(rl_line_buffer + prev, end - prev, &before_char);
+		}
+		if (end < rl_end) {
+			char_decode(rl_line_buffer + end, rl_end - end, &after_char);
+		}
+		if (end > 0 && end < rl_end && !iswspace(before_char) && !iswspace(after_char)) {
+			rl_insert_text(" ");
+		}
+
+		/* Optionally adjust cursor position */
+		rl_point = start_pos;
+	}
+
+	rl_end_undo_group();
+	jot_redisplay();
+	return 0;
+}
+
+static void
+goto_line(int count)
+{
+	int pos = 0;
+	int current_line = 1;
+	int target_line = count;
+
+	int buffer_len = rl_end;
+
+	/* Move to the desired line number */
+	while (pos < buffer_len && current_line <= target_line) {
+		if (rl_line_buffer[pos++] == '\n') {
+			current_line++;
+		}
+	}
+
+	/* Ensure pos is at the start of the target line */
+
+	/* Move back to the start of the line in case pos overshot due to newline */
+	if (pos > 0 && rl_line_buffer[pos - 1] == '\n') {
+		pos--;
+	}
+	while (pos > 0 && rl_line_buffer[pos - 1] != '\n') {
+		pos--;
+	}
+	/* Now move forward to the first non-blank character */
+	rl_point = skip_blanks(pos);
+
+	/* A line in a fold is shown by the fold's first line */
+	fold_move_point(0);
+}
+
+/* Vi command to go to line 'count' or end ('G') */
+static int
+jot_vi_goto_line(int count, int key)
+{
+	if (rl_explicit_arg) {
+		/* User provided a count, move to that line number */
+		goto_line(count);
+	} else {
+		goto_line(INT_MAX);
+	}
+
+	jot_redisplay();
+	return 0;
+}
+
+/* Vi command to go to first line ('gg') */
+static int
+jot_vi_goto_first_line(int count, int key)
+{
+	if (rl_explicit_arg) {
+		/* User provided a count, move to that line number */
+		goto_line(count);
+	} else {
+		goto_line(1);
+	}
+
+	jot_redisplay();
+	return 0;
+}
+
+/* Vi command to insert a line below current line and enter insert mode ('o') */
+static int
+jot_vi_insert_line_below(int count, int key)
+{
+	/* On a fold, open the new line below the whole fold */
+	fold_move_point(1);
+
+	int buffer_len = strlen(rl_line_buffer);
+	int pos = rl_point;
+
+	/* Find the end of the current line */
+	while (pos < buffer_len && rl_line_buffer[pos] != '\n') {
+		pos++;
+	}
+
+	/* Move after the newline character if there is one */
+	if (pos < buffer_len && rl_line_buffer[pos] == '\n') {
+		pos++; /* Move after newline */
+	}
+	/* Else, pos remains at buffer_len (end of buffer) */
+
+	/* Move rl_point to pos */
+	rl_point = pos;
+
+	/* Insert a newline character */
+	rl_insert_text("\n");
+
+	/* After insertion, rl_point advances by 1 to pos + 1 */
+
+	/* If we are not at the end of the buffer, adjust rl_point back to the start of the new line */
+	if (pos < buffer_len) {
+		rl_point = pos;
+	}
+	/* Otherwise, when at the end of the buffer, rl_point is already correctly placed */
+
+	/* Switch to Vi insert mode */
+	rl_vi_insertion_mode(1, 0);
+
+	jot_redisplay();
+	return 0;
+}
+
+
+/* Vi command to insert a line above current line and enter insert mode ('O') */
+static int
+jot_vi_insert_line_above(int count, int key)
+{
+	int pos = rl_point;
+
+	/* Find the start of the current line */
+	while (pos > 0 && rl_line_buffer[pos - 1] != '\n') {
+		pos--;
+	}
+
+	rl_point = pos;
+
+	/* Insert a newline character */
+	rl_insert_text("\n");
+
+	/* Move cursor to the beginning of the new line */
+	rl_point = pos;
+
+	/* Switch to Vi insert mode */
+	rl_vi_insertion_mode(1, 0);
+
+	jot_redisplay();
+	return 0;
+}
+
+/*
+ * Line index: the byte offset at which each line of rl_line_buffer starts.
+ * Region commands work on line spans taken from it instead of walking the
+ * buffer one character at a time or copying the lines.
+ *
+ * The index is kept up to date incrementally by line_index_sync(). Every
+ * change to the buffer goes through rl_insert_text() or rl_delete_text(),
+ * which record it in Readline's undo list, so the changed range is found
+ * by replaying the undo entries added, or removed by undo, since the last
+ * sync. Only the lines in that range are rescanned. The starts of the
+ * lines after it are shifted lazily: the lines from line_shift_from on
+ * start line_shift bytes after their entry in line_starts, and the next
+ * change only fixes up the entries between it and the previous one. Each
+ * line has a set of flags that record per-line state; lines that changed
+ * are marked with the LINE_STALE bits so that cached per-line results can
+ * be recomputed.
+ */
+static int *line_starts = NULL;     /* Offset of the first byte of each line, before the shift */
+static unsigned char *line_flags = NULL;  /* LINE_* flags of each line */
+static int line_count = 0;          /* Number of lines in the buffer */
+static int line_starts_size = 0;    /* Allocated entries in line_starts */
+static int line_shift_from = 0;     /* First line whose start is shifted */
+static int line_shift = 0;          /* Bytes the starts of those lines are shifted by */
+
+static int indexed_len = -1;        /* Length of the text the index describes, or -1 if there is no index */
+static int buffer_modified = 0;     /* Whether the text changed since it was loaded */
+
+/* An undo list entry as it was at the last sync */
+struct undo_seen {
+	const UNDO_LIST *entry;
+	enum undo_code what;
+	int start;
+	int end;
+	const char *text;
+};
+static struct undo_seen *undo_seen = NULL;  /* The undo list at the last sync, oldest first */
+static int undo_seen_count = 0;
+static int undo_seen_size = 0;
+
+/* Entries of the undo list looked through for the last one seen */
+#define UNDO_SEARCH_MAX 1024
+
+#define LINE_LINT_DIRTY       0x01   /* Commit mode checks are out of date */
+#define LINE_COMMIT_COMMENT   0x02   /* Commit mode: a comment line */
+#define LINE_COMMIT_SCISSORS  0x04   /* Commit mode: Git's scissors line */
+#define LINE_COMMIT_OVERLONG  0x08   /* Commit mode: wider than the body limit */
+#define LINE_LEX_STATE_MASK   0xf0   /* Syntax highlighting: lexer state at the line start */
+#define LINE_LEX_STATE_SHIFT  4
+
+#define LINE_STALE            (LINE_LINT_DIRTY)
+/* Flags describing the start of a line, which an edit within the line keeps */
+#define LINE_START_FLAGS      (LINE_LEX_STATE_MASK)
+
+/* A line of the buffer, not including its terminating newline */
+struct line_span {
+	int start;
+	int len;
+};
+
+static void line_index_changed(int first, int old_count, int new_count, int pos);
+
+/* Make room for 'count' lines in the index */
+static int
+line_index_reserve(int count)
+{
+	if (count <= line_starts_size) {
+		return 0;
+	}
+
+	int new_size = line_starts_size ? line_starts_size : 1024;
+	while (new_size < count) {
+		new_size *= 2;
+	}
+	int *new_starts = realloc(line_starts, new_size * sizeof(*new_starts));
+	if (!new_starts) {
+		perror("realloc");
+		return -1;
+	}
+	line_starts = new_starts;
+	unsigned char *new_flags = realloc(line_flags, new_size * sizeof(*new_flags));
+	if (!new_flags) {
+		perror("realloc");
+		return -1;
+	}
+	line_flags = new_flags;
+	line_starts_size = new_size;
+	return 0;
+}
+
+/* Return the offset of the first byte of line 'line' */
+static int
+line_start(int line)
+{
+	return line_starts[line] + (line >= line_shift_from ? line_shift : 0);
+}
+
+/* Make room for 'count' entries in undo_seen */
+static int
+undo_seen_reserve(int count)
+{
+	if (count <= undo_seen_size) {
+		return 0;
+	}
+
+	int new_size = undo_seen_size ? undo_seen_size : 256;
+	while (new_size < count) {
+		new_size *= 2;
+	}
+	struct undo_seen *new_seen = realloc(undo_seen, new_size * sizeof(*new_seen));
+	if (!new_seen) {
+		perror("realloc");
+		return -1;
+	}
+	undo_seen = new_seen;
+	undo_seen_size = new_size;
+	return 0;
+}
+
+static void
+undo_seen_set(struct undo_seen *seen, const UNDO_LIST *entry)
+{
+	seen->entry = entry;
+	seen->what = entry->what;
+	seen->start = entry->start;
+	seen->end = entry->end;
+	seen->text = entry->text;
+}
+
+/* Remember the whole undo list as seen */
+static int
+undo_seen_save(void)
+{
+	int count = 0;
+	for (const UNDO_LIST *u = rl_undo_list; u; u = u->next) {
+		count++;
+	}
+	if (undo_seen_reserve(count) != 0) {
+		undo_seen_count = 0;
+		return -1;
+	}
+	undo_seen_count = count;
+	for (const UNDO_LIST *u = rl_undo_list; u; u = u->next) {
+		undo_seen_set(&undo_seen[--count], u);
+	}
+	return 0;
+}
+
+/* Make the index be rebuilt from the text at the next sync */
+static void
+line_index_invalidate(void)
+{
+	indexed_len = -1;
+}
+
+/* Rebuild the line index. Returns 0 on success, -1 on allocation failure. */
+static int
+line_index_build(void)
+{
+	const char *buf = rl_line_buffer;
+	const char *end = buf + rl_end;
+	const char *p = buf;
+	int old_count = line_count;
+
+	line_count = 0;
+	line_shift = 0;
+	for (;;) {
+		if (line_index_reserve(line_count + 1) != 0) {
+			indexed_len = -1;
+			return -1;
+		}
+		line_flags[line_count] = LINE_STALE;
+		line_starts[line_count++] = p - buf;
+
+		const char *nl = memchr(p, '\n', end - p);
+		if (!nl) {
+			break;
+		}
+		p = nl + 1;
+	}
+	if (undo_seen_save() != 0) {
+		indexed_len = -1;
+		return -1;
+	}
+	indexed_len = rl_end;
+	line_index_changed(0, old_count, line_count, 0);
+	return 0;
+}
+
+/* Return the span of line 'line' (0-based) from the line index */
+static struct line_span
+line_index_span(int line)
+{
+	struct line_span span;
+
+	span.start = line_start(line);
+	if (line + 1 < line_count) {
+		span.len = line_start(line + 1) - 1 - span.start;
+	} else {
+		span.len = rl_end - span.start;
+	}
+	return span;
+}
+
+/* Return the 0-based line containing buffer offset 'pos' */
+static int
+line_index_find(int pos)
+{
+	int lo = 0, hi = line_count - 1;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+		if (line_start(mid) <= pos) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+/*
+ * The range of the text changed since the last sync, from 'lo' to 'hi' in
+ * the new text, and the change in the length of the text
+ */
+struct text_change {
+	int lo;
+	int hi;
+	int delta;
+	int len;       /* Length of the text after the changes so far */
+	int failed;    /* Whether a change did not fit the text */
+};
+
+/* Add the insertion of 'count' bytes at 'pos' to the changed range */
+static void
+text_change_insert(struct text_change *change, int pos, int count)
+{
+	if (pos < 0 || count < 0 || pos > change->len) {
+		change->failed = 1;
+		return;
+	}
+	if (change->lo < 0) {
+		change->lo = change->hi = pos;
+	}
+	if (change->lo > pos) {
+		change->lo = pos;
+	}
+	change->hi = (change->hi > pos ? change->hi : pos) + count;
+	change->delta += count;
+	change->len += count;
+}
+
+/* Add the deletion of the bytes from 'from' to 'to' to the changed range */
+static void
+text_change_delete(struct text_change *change, int from, int to)
+{
+	if (from < 0 || to < from || to > change->len) {
+		change->failed = 1;
+		return;
+	}
+	if (change->lo < 0) {
+		change->lo = change->hi = from;
+	}
+	if (change->lo > from) {
+		change->lo = from;
+	}
+	change->hi = change->hi >= to ? change->hi - (to - from) : from;
+	change->delta -= to - from;
+	change->len -= to - from;
+}
+
+/* Add the change made, or undone if 'undone' is set, by an undo list entry */
+static void
+text_change_add(struct text_change *change, enum undo_code what, int start, int end, int undone)
+{
+	if (what == UNDO_INSERT) {
+		if (undone) {
+			text_change_delete(change, start, end);
+		} else {
+			text_change_insert(change, start, end - start);
+		}
+	} else if (what == UNDO_DELETE) {
+		if (undone) {
+			text_change_insert(change, start, end - start);
+		} else {
+			text_change_delete(change, start, end);
+		}
+	}
+}
+
+/*
+ * Find the range changed since the last sync from the undo list, and
+ * update undo_seen to match it. Returns -1 if the changes cannot be told
+ * from the undo list.
+ */
+static int
+line_index_find_change(struct text_change *change)
+{
+	static const UNDO_LIST **added = NULL;
+	static int added_size = 0;
+	int nadded = 0;
+	int kept = -1;
+
+	/*
+	 * The undo list is the entries seen at the last sync less the ones
+	 * undone since, with the new ones on top. Look for the newest entry
+	 * seen, which is among the last ones seen unless most were undone.
+	 */
+	const UNDO_LIST *u = rl_undo_list;
+	for (; u && nadded < UNDO_SEARCH_MAX; u = u->next) {
+		int stop = undo_seen_count > UNDO_SEARCH_MAX ? undo_seen_count - UNDO_SEARCH_MAX : 0;
+		for (int i = undo_seen_count - 1; i >= stop; i--) {
+			if (undo_seen[i].entry == u) {
+				kept = i + 1;
+				break;
+			}
+		}
+		if (kept >= 0) {
+			break;
+		}
+		if (nadded == added_size) {
+			int new_size = added_size ? added_size * 2 : 64;
+			const UNDO_LIST **new_added = realloc(added, new_size * sizeof(*new_added));
+			if (!new_added) {
+				perror("realloc");
+				return -1;
+			}
+			added = new_added;
+			added_size = new_size;
+		}
+		added[nadded++] = u;
+	}
+	if (kept < 0) {
+		if (u || undo_seen_count > UNDO_SEARCH_MAX) {
+			return -1;
+		}
+		kept = 0;   /* Everything seen was undone */
+	}
+
+	/* Replay the undone entries, newest first, and the new ones, oldest first */
+	for (int i = undo_seen_count - 1; i >= kept; i--) {
+		text_change_add(change, undo_seen[i].what, undo_seen[i].start, undo_seen[i].end, 1);
+	}
+	if (kept > 0) {
+		/* Readline grows the newest insertion in place as characters are typed */
+		struct undo_seen *top = &undo_seen[kept - 1];
+		const UNDO_LIST *entry = top->entry;
+		if (entry->what != top->what || entry->start != top->start || entry->text != top->text) {
+			return -1;
+		}
+		if (entry->end != top->end) {
+			if (entry->what != UNDO_INSERT || entry->end < top->end) {
+				return -1;
+			}
+			text_change_insert(change, top->end, entry->end - top->end);
+			top->end = entry->end;
+		}
+	}
+	for (int i = nadded - 1; i >= 0; i--) {
+		text_change_add(change, added[i]->what, added[i]->start, added[i]->end, 0);
+	}
+	if (change->failed || undo_seen_reserve(kept + nadded) != 0) {
+		return -1;
+	}
+	undo_seen_count = kept;
+	for (int i = nadded - 1; i >= 0; i--) {
+		undo_seen_set(&undo_seen[undo_seen_count++], added[i]);
+	}
+	return 0;
+}
+
+/*
+ * Bring the line index up to date with rl_line_buffer. Only the lines
+ * that overlap the changed range are rescanned; the starts of the lines
+ * after it are shifted. Returns 0 on success, -1 on allocation failure.
+ */
+static int
+line_index_sync(void)
+{
+	if (indexed_len < 0) {
+		return line_index_build();
+	}
+	if (rl_undo_list == (undo_seen_count ? undo_seen[undo_seen_count - 1].entry : NULL) &&
+		(!rl_undo_list || rl_undo_list->end == undo_seen[undo_seen_count - 1].end)) {
+		return 0;
+	}
+
+	struct text_change change = { -1, -1, 0, indexed_len, 0 };
+	if (line_index_find_change(&change) != 0 || change.len != rl_end) {
+		/* Changes that were not recorded as undo entries, or too many */
+		buffer_modified = 1;
+		return line_index_build();
+	}
+	if (change.lo < 0) {
+		return 0;
+	}
+
+	const char *buf = rl_line_buffer;
+	int new_len = rl_end;
+	int delta = change.delta;
+
+	/*
+	 * The changed lines run from the line containing the first changed
+	 * byte to the first newline at or after the change, which is at the
+	 * same distance from the end of both texts.
+	 */
+	int first = line_index_find(change.lo);
+	int first_start = line_start(first);
+	const char *nl = memchr(buf + change.hi, '\n', new_len - change.hi);
+	int new_stop = nl ? nl - buf : new_len;
+	int old_stop = new_stop - delta;
+	int last = line_index_find(old_stop);
+	int old_count = last - first + 1;
+
+	int new_count = 1;
+	for (const char *p = buf + first_start;
+		 (p = memchr(p, '\n', buf + new_stop - p)) != NULL; p++) {
+		new_count++;
+	}
+
+	if (line_index_reserve(line_count - old_count + new_count) != 0) {
+		indexed_len = -1;
+		return -1;
+	}
+
+	/*
+	 * Fix up the starts between this change and the last one, so that the
+	 * lines after this change are the ones shifted
+	 */
+	if (line_shift != 0) {
+		for (int i = line_shift_from; i < first; i++) {
+			line_starts[i] += line_shift;
+		}
+		for (int i = last + 1; i < line_shift_from && i < line_count; i++) {
+			line_starts[i] -= line_shift;
+		}
+	}
+
+	/* Move the lines after the change */
+	if (new_count != old_count) {
+		int tail = line_count - (last + 1);
+		memmove(&line_starts[first + new_count], &line_starts[last + 1], tail * sizeof(*line_starts));
+		memmove(&line_flags[first + new_count], &line_flags[last + 1], tail * sizeof(*line_flags));
+		line_count += new_count - old_count;
+	}
+	line_shift_from = first + new_count;
+	line_shift += delta;
+
+	/* Rescan the changed lines */
+	unsigned char start_flags = line_flags[first] & LINE_START_FLAGS;
+	const char *p = buf + first_start;
+	for (int i = first; i < first + new_count; i++) {
+		line_starts[i] = p - buf;
+		line_flags[i] = LINE_STALE;
+		nl = memchr(p, '\n', buf + new_stop - p);
+		p = nl ? nl + 1 : buf + new_stop;
+	}
+	line_flags[first] |= start_flags;
+
+	indexed_len = new_len;
+	buffer_modified = 1;
+	line_index_changed(first, old_count, new_count, change.lo);
+	return 0;
+}
+
+/* Clear Readline's undo list, once the index has seen the changes in it */
+static void
+line_index_free_undo_list(void)
+{
+	line_index_sync();
+	rl_free_undo_list();
+	undo_seen_count = 0;
+}
+
+/*
+ * Find the lines covered by the region between rl_mark and rl_point.
+ * A region that ends at the start of a line does not include that line.
+ * If the mark and point coincide, the region is the whole buffer.
+ * Builds the line index as a side effect. Returns -1 on failure.
+ */
+static int
+get_region_lines(int *first_line, int *last_line)
+{
+	if (line_index_sync() != 0) {
+		return -1;
+	}
+
+	int mark = rl_mark < rl_end ? rl_mark : rl_end;
+	if (mark == rl_point) {
+		*first_line = 0;
+		*last_line = line_count - 1;
+	} else {
+		int start = mark < rl_point ? mark : rl_point;
+		int end = mark < rl_point ? rl_point : mark;
+
+		*first_line = line_index_find(start);
+		*last_line = line_index_find(end);
+		if (*last_line > *first_line && line_start(*last_line) == end) {
+			(*last_line)--;
+		}
+	}
+
+	/* The empty line after a final newline is not part of the region */
+	if (*last_line > *first_line && line_start(*last_line) == rl_end) {
+		(*last_line)--;
+	}
+	return 0;
+}
+
+/*
+ * Replace the text between start and end with 'text' as a single undo
+ * group, so that a region command can be undone in one step.
+ */
+static void
+replace_text(int start, int end, const char *text)
+{
+	rl_begin_undo_group();
+	if (end > start) {
+		rl_delete_text(start, end);
+	}
+	rl_point = start;
+	if (text[0] != '\0') {
+		rl_insert_text(text);
+	}
+	rl_end_undo_group();
+}
+
+/*
+ * Replace lines first..last with the given spans, joined by newlines, in
+ * one pass. The spans may point anywhere in rl_line_buffer, since the new
+ * region is assembled before the buffer is modified. The final newline of
+ * the region is kept only if the region originally had one.
+ * Returns -1 on allocation failure.
+ */
+static int
+replace_lines_with_spans(int first, int last, const struct line_span *spans, int nspans)
+{
+	int start = line_start(first);
+	int end = (last + 1 < line_count) ? line_start(last + 1) : rl_end;
+	int trailing_newline = (end > start && rl_line_buffer[end - 1] == '\n');
+	size_t size = 1;
+
+	for (int i = 0; i < nspans; i++) {
+		size += spans[i].len + 1;
+	}
+
+	char *text = malloc(size);
+	if (!text) {
+		perror("malloc");
+		return -1;
+	}
+
+	char *out = text;
+	for (int i = 0; i < nspans; i++) {
+		memcpy(out, rl_line_buffer + spans[i].start, spans[i].len);
+		out += spans[i].len;
+		*out++ = '\n';
+	}
+	if (out > text && !trailing_newline) {
+		out--;
+	}
+	*out = '\0';
+
+	int orig_point = rl_point;
+	replace_text(start, end, text);
+	free(text);
+
+	/* Keep the cursor where it was, if it is still inside the buffer */
+	rl_point = orig_point <= rl_end ? orig_point : rl_end;
+	rl_mark = start;
+	return 0;
+}
+
+/*
+ * Folding
+ *
+ * A fold hides a run of lines behind a single display row that shows its
+ * first line. Folds are kept as a sorted array of disjoint line intervals,
+ * so finding the fold around a line is a binary search, and redisplay and
+ * cursor motion step over a fold in one go however many lines it hides.
+ * Edits before a fold or on its first line shift it; an edit to its
+ * hidden lines opens it.
+ */
+struct fold {
+	int first;   /* First line, which stays visible */
+	int last;    /* Last hidden line */
+};
+
+static struct fold *folds = NULL;
+static int nfolds = 0;
+static int folds_size = 0;
+
+/* Return the index of the fold containing 'line', or -1 */
+static int
+fold_find(int line)
+{
+	int lo = 0, hi = nfolds;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (folds[mid].last < line) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo < nfolds && folds[lo].first <= line) ? lo : -1;
+}
+
+/* The visible line that shows 'line' */
+static int
+fold_visible_line(int line)
+{
+	int f = nfolds ? fold_find(line) : -1;
+	return f >= 0 ? folds[f].first : line;
+}
+
+/* The next visible line after 'line' */
+static int
+fold_next_line(int line)
+{
+	int f = nfolds ? fold_find(line) : -1;
+	return (f >= 0 ? folds[f].last : line) + 1;
+}
+
+/* The visible line before 'line', which must be greater than 0 */
+static int
+fold_prev_line(int line)
+{
+	return fold_visible_line(line - 1);
+}
+
+/* Fold lines first..last, merging any folds they overlap */
+static int
+fold_add(int first, int last)
+{
+	int lo = 0;
+	while (lo < nfolds && folds[lo].last < first) {
+		lo++;
+	}
+	int hi = lo;
+	while (hi < nfolds && folds[hi].first <= last) {
+		if (folds[hi].first < first) {
+			first = folds[hi].first;
+		}
+		if (folds[hi].last > last) {
+			last = folds[hi].last;
+		}
+		hi++;
+	}
+
+	if (hi == lo) {
+		if (nfolds == folds_size) {
+			int new_size = folds_size ? folds_size * 2 : 16;
+			struct fold *new_folds = realloc(folds, new_size * sizeof(*new_folds));
+			if (!new_folds) {
+				perror("realloc");
+				return -1;
+			}
+			folds = new_folds;
+			folds_size = new_size;
+		}
+		memmove(&folds[lo + 1], &folds[lo], (nfolds - lo) * sizeof(*folds));
+		nfolds++;
+	} else {
+		/* Replace the merged folds with one */
+		memmove(&folds[lo + 1], &folds[hi], (nfolds - hi) * sizeof(*folds));
+		nfolds -= hi - lo - 1;
+	}
+	folds[lo].first = first;
+	folds[lo].last = last;
+	return 0;
+}
+
+static void
+fold_remove(int f)
+{
+	memmove(&folds[f], &folds[f + 1], (nfolds - f - 1) * sizeof(*folds));
+	nfolds--;
+}
+
+/* Update the folds after lines first..first + old_count - 1 were replaced */
+static void
+fold_lines_changed(int first, int old_count, int new_count)
+{
+	int delta = new_count - old_count;
+	int end = first + old_count - 1;
+
+	for (int f = 0; f < nfolds; f++) {
+		if (folds[f].first > end) {
+			folds[f].first += delta;
+			folds[f].last += delta;
+		} else if (folds[f].first == end) {
+			/* Only the first line changed, so the hidden lines follow the last new line */
+			folds[f].first = first + new_count - 1;
+			folds[f].last += delta;
+		} else if (folds[f].last >= first) {
+			fold_remove(f--);
+		}
+	}
+}
+
+/*
+ * If the cursor is in a fold, move it to the same column of the fold's
+ * last line if 'to_last' is set, or else of its first line
+ */
+static void
+fold_move_point(int to_last)
+{
+	if (nfolds == 0 || line_index_sync() != 0) {
+		return;
+	}
+
+	int line = line_index_find(rl_point);
+	int f = fold_find(line);
+	int target = f < 0 ? line : to_last ? folds[f].last : folds[f].first;
+	if (target == line) {
+		return;
+	}
+
+	rl_point = grapheme_skip(line_start(target), grapheme_count(line_start(line), rl_point));
+}
+
+/* Fold the lines of the region */
+static int
+jot_fold_region(int count, int key)
+{
+	int first, last;
+
+	if (get_region_lines(&first, &last) != 0 || first == last || fold_add(first, last) != 0) {
+		rl_ding();
+		return 0;
+	}
+	rl_point = line_start(first);
+	rl_mark = rl_point;
+	jot_redisplay();
+	return 0;
+}
+
+/* Fold 'count' lines starting at the current line, like zF in Vim */
+static int
+jot_vi_fold_lines(int count, int key)
+{
+	if (line_index_sync() != 0) {
+		rl_ding();
+		return 0;
+	}
+
+	int first = line_index_find(rl_point);
+	int last = first + (count > 1 ? count : 2) - 1;
+	if (last >= line_count) {
+		last = line_count - 1;
+	}
+	if (last == first || fold_add(first, last) != 0) {
+		rl_ding();
+		return 0;
+	}
+	jot_redisplay();
+	return 0;
+}
+
+/* Open the fold at the cursor */
+static int
+jot_unfold(int count, int key)
+{
+	int f = -1;
+
+	if (line_index_sync() == 0) {
+		f = fold_find(line_index_find(rl_point));
+	}
+	if (f < 0) {
+		rl_ding();
+		return 0;
+	}
+	fold_remove(f);
+	jot_redisplay();
+	return 0;
+}
+
+/* Open all folds */
+static int
+jot_unfold_all(int count, int key)
+{
+	nfolds = 0;
+	jot_redisplay();
+	return 0;
+}
+
+/*
+ * Line sorting
+ *
+ * The lines of the region are sorted as an array of sort keys that point
+ * into rl_line_buffer. Regions with at least PARALLEL_SORT_MIN_LINES lines
+ * are split between up to PARALLEL_SORT_MAX_THREADS threads, each of which
+ * merge sorts its own run, and the runs are then merged pairwise, also in
+ * parallel. Merge sort is stable, so lines that compare equal keep their
+ * original order.
+ */
+#define PARALLEL_SORT_MIN_LINES 65536
+#define PARALLEL_SORT_MAX_THREADS 8
+#define INSERTION_SORT_RUN 32
+
+#define SORT_NUMERIC  0x01  /* Compare the leading numbers of the lines */
+#define SORT_REVERSE  0x02  /* Sort in descending order */
+#define SORT_UNIQUE   0x04  /* Drop lines equal to the previous line */
+#define SORT_STABLE   0x08  /* Do not break ties by comparing whole lines */
+
+struct sort_line {
+	const char *text;
+	int len;
+	int start;      /* Offset of the line in rl_line_buffer */
+	double key;     /* Leading number, for SORT_NUMERIC */
+};
+
+static int sort_flags;
+
+/* Compare two lines bytewise, like sort(1) in the C locale */
+static int
+compare_line_text(const struct sort_line *a, const struct sort_line *b)
+{
+	int len = a->len < b->len ? a->len : b->len;
+	int cmp = memcmp(a->text, b->text, len);
+
+	if (cmp != 0) {
+		return cmp;
+	}
+	return (a->len > b->len) - (a->len < b->len);
+}
+
+static int
+compare_sort_lines(const struct sort_line *a, const struct sort_line *b)
+{
+	int cmp;
+
+	if (sort_flags & SORT_NUMERIC) {
+		cmp = (a->key > b->key) - (a->key < b->key);
+		if (cmp == 0 && !(sort_flags & SORT_STABLE)) {
+			/* Last-resort comparison, as sort(1) does without -s */
+			cmp = compare_line_text(a, b);
+		}
+	} else {
+		cmp = compare_line_text(a, b);
+	}
+	return (sort_flags & SORT_REVERSE) ? -cmp : cmp;
+}
+
+/*
+ * Parse the number at the start of a line, after optional blanks:
+ * an optional minus sign, digits and an optional fraction. Lines that do
+ * not start with a number sort as zero.
+ */
+static double
+parse_line_number(const char *text, int len)
+{
+	char digits[64];
+	int i = 0, n = 0;
+
+	while (i < len && (text[i] == ' ' || text[i] == '\t')) {
+		i++;
+	}
+	if (i < len && text[i] == '-') {
+		digits[n++] = text[i++];
+	}
+	while (i < len && n < (int)sizeof(digits) - 1 &&
+		   ((text[i] >= '0' && text[i] <= '9') || text[i] == '.')) {
+		if (text[i] == '.' && memchr(digits, '.', n)) {
+			break;
+		}
+		digits[n++] = text[i++];
+	}
+	digits[n] = '\0';
+	return strtod(digits, NULL);
+}
+
+/* Merge the sorted runs src[lo..mid) and src[mid..hi) into dst[lo..hi) */
+static void
+merge_sort_runs(const struct sort_line *src, struct sort_line *dst, size_t lo, size_t mid, size_t hi)
+{
+	size_t i = lo, j = mid, k = lo;
+
+	while (i < mid && j < hi) {
+		/* Take from the left run on ties to keep the sort stable */
+		if (compare_sort_lines(&src[j], &src[i]) < 0) {
+			dst[k++] = src[j++];
+		} else {
+			dst[k++] = src[i++];
+		}
+	}
+	memcpy(&dst[k], &src[i], (mid - i) * sizeof(*dst));
+	k += mid - i;
+	memcpy(&dst[k], &src[j], (hi - j) * sizeof(*dst));
+}
+
+/*
+ * Bottom-up merge sort of lines[lo..hi) using tmp[lo..hi) as scratch.
+ * The sorted result always ends up in lines.
+ */
+static void
+merge_sort_lines(struct sort_line *lines, struct sort_line *tmp, size_t lo, size_t hi)
+{
+	/* Insertion sort short runs */
+	for (size_t run = lo; run < hi; run += INSERTION_SORT_RUN) {
+		size_t run_end = run + INSERTION_SORT_RUN < hi ? run + INSERTION_SORT_RUN : hi;
+		for (size_t i = run + 1; i < run_end; i++) {
+			struct sort_line line = lines[i];
+			size_t j = i;
+			while (j > run && compare_sort_lines(&line, &lines[j - 1]) < 0) {
+				lines[j] = lines[j - 1];
+				j--;
+			}
+			lines[j] = line;
+		}
+	}
+
+	struct sort_line *src = lines, *dst = tmp;
+	for (size_t width = INSERTION_SORT_RUN; width < hi - lo; width *= 2) {
+		for (size_t left = lo; left < hi; left += 2 * width) {
+			size_t mid = left + width < hi ? left + width : hi;
+			size_t right = left + 2 * width < hi ? left + 2 * width : hi;
+			merge_sort_runs(src, dst, left, mid, right);
+		}
+		struct sort_line *swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != lines) {
+		memcpy(&lines[lo], &src[lo], (hi - lo) * sizeof(*lines));
+	}
+}
+
+/* Work item of a parallel sort thread */
+struct sort_job {
+	struct sort_line *lines;
+	struct sort_line *tmp;
+	size_t lo, mid, hi;
+};
+
+static void *
+sort_job_sort(void *arg)
+{
+	struct sort_job *job = arg;
+	merge_sort_lines(job->lines, job->tmp, job->lo, job->hi);
+	return NULL;
+}
+
+static void *
+sort_job_merge(void *arg)
+{
+	struct sort_job *job = arg;
+	merge_sort_runs(job->lines, job->tmp, job->lo, job->mid, job->hi);
+	memcpy(&job->lines[job->lo], &job->tmp[job->lo], (job->hi - job->lo) * sizeof(*job->lines));
+	return NULL;
+}
+
+/*
+ * Run 'func' on each job, in its own thread where possible. Jobs whose
+ * thread cannot be created run in the calling thread instead.
+ */
+static void
+run_sort_jobs(void *(*func)(void *), struct sort_job *jobs, int njobs)
+{
+	pthread_t threads[PARALLEL_SORT_MAX_THREADS];
+	int started[PARALLEL_SORT_MAX_THREADS];
+
+	for (int i = 1; i < njobs; i++) {
+		started[i] = (pthread_create(&threads[i], NULL, func, &jobs[i]) == 0);
+		if (!started[i]) {
+			func(&jobs[i]);
+		}
+	}
+	func(&jobs[0]);
+	for (int i = 1; i < njobs; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+}
+
+static void
+sort_lines_array(struct sort_line *lines, struct sort_line *tmp, size_t n)
+{
+	int nthreads = 1;
+
+	if (n >= PARALLEL_SORT_MIN_LINES) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		while (nthreads * 2 <= ncpus && nthreads * 2 <= PARALLEL_SORT_MAX_THREADS) {
+			nthreads *= 2;
+		}
+	}
+	if (nthreads == 1) {
+		merge_sort_lines(lines, tmp, 0, n);
+		return;
+	}
+
+	/* Sort one run per thread */
+	struct sort_job jobs[PARALLEL_SORT_MAX_THREADS];
+	size_t run = (n + nthreads - 1) / nthreads;
+	for (int i = 0; i < nthreads; i++) {
+		jobs[i].lines = lines;
+		jobs[i].tmp = tmp;
+		jobs[i].lo = i * run < n ? i * run : n;
+		jobs[i].hi = (i + 1) * run < n ? (i + 1) * run : n;
+	}
+	run_sort_jobs(sort_job_sort, jobs, nthreads);
+
+	/* Merge adjacent runs pairwise until one remains */
+	for (size_t width = run; width < n; width *= 2) {
+		int njobs = 0;
+		for (size_t left = 0; left < n; left += 2 * width) {
+			jobs[njobs].lines = lines;
+			jobs[njobs].tmp = tmp;
+			jobs[njobs].lo = left;
+			jobs[njobs].mid = left + width < n ? left + width : n;
+			jobs[njobs].hi = left + 2 * width < n ? left + 2 * width : n;
+			njobs++;
+		}
+		run_sort_jobs(sort_job_merge, jobs, njobs);
+	}
+}
+
+/* Sort the lines of the region according to 'flags' */
+static int
+sort_region_lines(int flags)
+{
+	int first, last;
+
+	if (get_region_lines(&first, &last) != 0) {
+		rl_ding();
+		return 0;
+	}
+
+	size_t n = last - first + 1;
+	struct sort_line *lines = malloc(n * sizeof(*lines));
+	struct sort_line *tmp = malloc(n * sizeof(*tmp));
+	struct line_span *spans = malloc(n * sizeof(*spans));
+	if (!lines || !tmp || !spans) {
+		perror("malloc");
+		free(lines);
+		free(tmp);
+		free(spans);
+		rl_ding();
+		return 0;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		struct line_span span = line_index_span(first + i);
+		lines[i].text = rl_line_buffer + span.start;
+		lines[i].len = span.len;
+		lines[i].start = span.start;
+		lines[i].key = (flags & SORT_NUMERIC) ? parse_line_number(lines[i].text, span.len) : 0;
+	}
+
+	sort_flags = flags;
+	sort_lines_array(lines, tmp, n);
+
+	int nspans = 0;
+	for (size_t i = 0; i < n; i++) {
+		if ((flags & SORT_UNIQUE) && nspans > 0 &&
+			compare_line_text(&lines[i], &lines[i - 1]) == 0) {
+			continue;
+		}
+		spans[nspans].start = lines[i].start;
+		spans[nspans].len = lines[i].len;
+		nspans++;
+	}
+
+	if (replace_lines_with_spans(first, last, spans, nspans) != 0) {
+		rl_ding();
+	}
+
+	free(lines);
+	free(tmp);
+	free(spans);
+	jot_redisplay();
+	return 0;
+}
+
+/* A negative argument sorts in descending order */
+static int
+sort_direction(int count)
+{
+	return count < 0 ? SORT_REVERSE : 0;
+}
+
+/* Sort the lines of the region lexicographically */
+static int
+jot_sort_lines(int count, int key)
+{
+	return sort_region_lines(sort_direction(count));
+}
+
+/* Sort the lines of the region by their leading numbers */
+static int
+jot_sort_lines_numeric(int count, int key)
+{
+	return sort_region_lines(SORT_NUMERIC | sort_direction(count));
+}
+
+/* Sort numerically, keeping lines with equal numbers in their original order */
+static int
+jot_sort_lines_numeric_stable(int count, int key)
+{
+	return sort_region_lines(SORT_NUMERIC | SORT_STABLE | sort_direction(count));
+}
+
+/* Sort the lines of the region, keeping one copy of each distinct line */
+static int
+jot_sort_lines_unique(int count, int key)
+{
+	return sort_region_lines(SORT_UNIQUE | sort_direction(count));
+}
+
+/* Reverse the order of the lines of the region */
+static int
+jot_reverse_lines(int count, int key)
+{
+	int first, last;
+
+	if (get_region_lines(&first, &last) != 0) {
+		rl_ding();
+		return 0;
+	}
+
+	int n = last - first + 1;
+	struct line_span *spans = malloc(n * sizeof(*spans));
+	if (!spans) {
+		perror("malloc");
+		rl_ding();
+		return 0;
+	}
+	for (int i = 0; i < n; i++) {
+		spans[i] = line_index_span(last - i);
+	}
+	if (replace_lines_with_spans(first, last, spans, n) != 0) {
+		rl_ding();
+	}
+	free(spans);
+	jot_redisplay();
+	return 0;
+}
+
+/*
+ * Duplicate line detection
+ *
+ * The distinct lines of a region are collected in an open-addressing hash
+ * table with linear probing. Slots hold the index of the first occurrence
+ * of each line, so the lines themselves are never copied, and the table is
+ * sized to at most half full to keep probe sequences short.
+ */
+struct line_table_slot {
+	uint64_t hash;
+	int line;       /* Index into the region's spans, or -1 if empty */
+	int count;      /* Number of occurrences of the line */
+};
+
+/* 64-bit FNV-1a hash of a line */
+static uint64_t
+hash_line(const char *text, int len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (int i = 0; i < len; i++) {
+		hash ^= (unsigned char)text[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*
+ * Collapse the duplicate lines of the region, keeping the first occurrence
+ * of each line in its original position. If 'count' is set, each kept line
+ * is prefixed with its number of occurrences, like uniq -c.
+ */
+static int
+uniq_region_lines(int count)
+{
+	int first, last;
+
+	if (get_region_lines(&first, &last) != 0) {
+		rl_ding();
+		return 0;
+	}
+
+	int n = last - first + 1;
+	size_t size = 1;
+	while (size < (size_t)n * 2) {
+		size *= 2;
+	}
+
+	struct line_span *spans = malloc(n * sizeof(*spans));
+	int *counts = malloc(n * sizeof(*counts));
+	struct line_table_slot *table = malloc(size * sizeof(*table));
+	if (!spans || !counts || !table) {
+		perror("malloc");
+		free(spans);
+		free(counts);
+		free(table);
+		rl_ding();
+		return 0;
+	}
+	for (size_t i = 0; i < size; i++) {
+		table[i].line = -1;
+	}
+
+	int nspans = 0;
+	for (int i = 0; i < n; i++) {
+		struct line_span span = line_index_span(first + i);
+		const char *text = rl_line_buffer + span.start;
+		uint64_t hash = hash_line(text, span.len);
+		size_t slot = hash & (size - 1);
+
+		while (table[slot].line != -1) {
+			struct line_span *seen = &spans[table[slot].line];
+			if (table[slot].hash == hash && seen->len == span.len &&
+				memcmp(rl_line_buffer + seen->start, text, span.len) == 0) {
+				break;
+			}
+			slot = (slot + 1) & (size - 1);
+		}
+		if (table[slot].line == -1) {
+			table[slot].hash = hash;
+			table[slot].line = nspans;
+			counts[nspans] = 0;
+			spans[nspans++] = span;
+		}
+		counts[table[slot].line]++;
+	}
+	free(table);
+
+	if (!count) {
+		if (replace_lines_with_spans(first, last, spans, nspans) != 0) {
+			rl_ding();
+		}
+	} else {
+		/* Build the annotated region and replace it directly */
+		int start = line_start(first);
+		int end = (last + 1 < line_count) ? line_start(last + 1) : rl_end;
+		int trailing_newline = (end > start && rl_line_buffer[end - 1] == '\n');
+		size_t text_size = 1;
+
+		for (int i = 0; i < nspans; i++) {
+			text_size += spans[i].len + 16;
+		}
+		char *text = malloc(text_size);
+		if (!text) {
+			perror("malloc");
+			rl_ding();
+		} else {
+			char *out = text;
+			for (int i = 0; i < nspans; i++) {
+				out += sprintf(out, "%7d ", counts[i]);
+				memcpy(out, rl_line_buffer + spans[i].start, spans[i].len);
+				out += spans[i].len;
+				*out++ = '\n';
+			}
+			if (out > text && !trailing_newline) {
+				out--;
+			}
+			*out = '\0';
+
+			replace_text(start, end, text);
+			rl_point = start;
+			rl_mark = start;
+			free(text);
+		}
+	}
+
+	free(spans);
+	free(counts);
+	jot_redisplay();
+	return 0;
+}
+
+/* Delete repeated lines of the region, keeping first occurrences in place */
+static int
+jot_delete_duplicate_lines(int count, int key)
+{
+	return uniq_region_lines(0);
+}
+
+/* Keep the first occurrence of each line, prefixed by its number of occurrences */
+static int
+jot_count_duplicate_lines(int count, int key)
+{
+	return uniq_region_lines(1);
+}
+
+/*
+ * Indentation and comments
+ *
+ * Region-wide line prefix edits compute the start of every line from the
+ * line index and assemble the new region in a single pass, which is then
+ * swapped in as one undo group. Lines are indented by a tab, dedented by a
+ * tab or up to INDENT_WIDTH spaces, and commented with the Readline
+ * comment-begin string.
+ */
+#define INDENT_WIDTH 8
+
+enum line_prefix_op {
+	LINE_INDENT,
+	LINE_DEDENT,
+	LINE_COMMENT,
+	LINE_UNCOMMENT
+};
+
+/* The string used to comment out lines, from the comment-begin variable */
+static const char *
+comment_prefix(void)
+{
+	const char *prefix = rl_variable_value("comment-begin");
+	return (prefix && prefix[0] != '\0') ? prefix : "#";
+}
+
+/* Return the number of leading bytes removed when dedenting a line once */
+static int
+dedent_length(const char *text, int len)
+{
+	if (len > 0 && text[0] == '\t') {
+		return 1;
+	}
+	int n = 0;
+	while (n < len && n < INDENT_WIDTH && text[n] == ' ') {
+		n++;
+	}
+	/* A tab after the spaces completes the indentation level */
+	if (n < len && n < INDENT_WIDTH && text[n] == '\t') {
+		n++;
+	}
+	return n;
+}
+
+/* Whether every non-empty line from first to last starts with 'prefix' */
+static int
+lines_have_prefix(int first, int last, const char *prefix)
+{
+	int prefix_len = strlen(prefix);
+
+	for (int line = first; line <= last; line++) {
+		struct line_span span = line_index_span(line);
+		if (span.len == 0) {
+			continue;
+		}
+		if (span.len < prefix_len ||
+			memcmp(rl_line_buffer + span.start, prefix, prefix_len) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Apply 'op' 'levels' times to the lines first..last. Empty lines are
+ * left alone. The cursor stays at the same text on its line.
+ */
+static int
+edit_line_prefixes(int first, int last, enum line_prefix_op op, int levels)
+{
+	const char *prefix = (op == LINE_INDENT) ? "\t" : comment_prefix();
+	int prefix_len = strlen(prefix);
+	int start = line_start(first);
+	int end = (last + 1 < line_count) ? line_start(last + 1) : rl_end;
+	int point_line = line_index_find(rl_point);
+	int point_col = rl_point - line_start(point_line);
+	int new_point = rl_point;
+
+	if (op == LINE_COMMENT || op == LINE_UNCOMMENT) {
+		levels = 1;
+	}
+
+	size_t size = end - start + 1;
+	if (op == LINE_INDENT || op == LINE_COMMENT) {
+		size += (size_t)(last - first + 1) * prefix_len * levels;
+	}
+	char *text = malloc(size);
+	if (!text) {
+		perror("malloc");
+		return -1;
+	}
+
+	char *out = text;
+	for (int line = first; line <= last; line++) {
+		struct line_span span = line_index_span(line);
+		const char *src = rl_line_buffer + span.start;
+		int len = span.len;
+		int line_out = out - text;
+		int added = 0, removed = 0;
+
+		if (len > 0) {
+			for (int i = 0; i < levels; i++) {
+				if (op == LINE_INDENT || op == LINE_COMMENT) {
+					memcpy(out, prefix, prefix_len);
+					out += prefix_len;
+					added += prefix_len;
+				} else if (op == LINE_DEDENT) {
+					removed += dedent_length(src + removed, len - removed);
+				} else if (len >= prefix_len && memcmp(src, prefix, prefix_len) == 0) {
+					removed += prefix_len;
+				}
+			}
+		}
+		if (line == point_line) {
+			int col = point_col > removed ? point_col - removed : 0;
+			new_point = start + line_out + added + col;
+		}
+		memcpy(out, src + removed, len - removed);
+		out += len - removed;
+		if (span.start + span.len < end) {
+			*out++ = '\n';
+		}
+	}
+	*out = '\0';
+
+	int delta = (int)(out - text) - (end - start);
+	replace_text(start, end, text);
+	free(text);
+
+	if (point_line > last) {
+		new_point += delta;
+	}
+	rl_point = new_point <= rl_end ? new_point : rl_end;
+	return 0;
+}
+
+/* Apply a prefix operation to the lines of the region */
+static int
+edit_region_prefixes(enum line_prefix_op op, int levels)
+{
+	int first, last;
+
+	if (get_region_lines(&first, &last) != 0 ||
+		edit_line_prefixes(first, last, op, levels) != 0) {
+		rl_ding();
+	}
+	jot_redisplay();
+	return 0;
+}
+
+/* Find the 'count' lines first..last starting at the current line */
+static int
+get_count_lines(int count, int *first, int *last)
+{
+	if (line_index_sync() != 0) {
+		return -1;
+	}
+
+	*first = line_index_find(rl_point);
+	*last = *first + (count > 0 ? count : 1) - 1;
+	if (*last >= line_count) {
+		*last = line_count - 1;
+	}
+	return 0;
+}
+
+/* Apply a prefix operation to 'count' lines starting at the current line */
+static int
+edit_count_prefixes(enum line_prefix_op op, int count)
+{
+	int first, last;
+
+	if (get_count_lines(count, &first, &last) != 0 ||
+		edit_line_prefixes(first, last, op, 1) != 0) {
+		rl_ding();
+	}
+	jot_redisplay();
+	return 0;
+}
+
+/*
+ * Keys of the motions a vi operator accepts: those of rl_vi_domove(), and
+ * jot's line motions. VI_MOTION_G_KEYS are the motions prefixed by 'g'.
+ */
+#define VI_MOTION_KEYS " hl^$0ftFT;,%wbeWBE|`jkG"
+#define VI_MOTION_G_KEYS "gjk"
+
+/*
+ * Read the motion of a vi operator and find the lines first..last that it
+ * moves over. The motion is an optional count and one of the motions in
+ * VI_MOTION_KEYS, run through its binding in the vi movement keymap, or
+ * 'line_key', the last key of the operator, for 'count' whole lines as in
+ * '>>'. The point is left on the first of the lines. Returns -1 if the
+ * motion is cancelled or not a motion, without changing the text.
+ */
+static int
+get_vi_motion_lines(int count, int line_key, int *first, int *last)
+{
+	Keymap map = vi_movement_keymap;
+	const char *motions = VI_MOTION_KEYS;
+	int motion_count = 0;
+	int key = rl_read_key();
+
+	while (key >= '0' && key <= '9' && (key != '0' || motion_count > 0)) {
+		motion_count = motion_count * 10 + key - '0';
+		key = rl_read_key();
+	}
+	if (motion_count > 0) {
+		count = (count > 0 ? count : 1) * motion_count;
+		rl_explicit_arg = 1;
+	}
+	if (key == line_key) {
+		return get_count_lines(count, first, last);
+	}
+
+	if (key == 'g' && map[key].type == ISKMAP) {
+		map = (Keymap)map[key].function;
+		motions = VI_MOTION_G_KEYS;
+		key = rl_read_key();
+	}
+	if (key <= 0 || key >= KEYMAP_SIZE || !strchr(motions, key) ||
+		map[key].type != ISFUNC || !map[key].function) {
+		return -1;
+	}
+
+	int point = rl_point;
+	map[key].function(count, key);
+	if (line_index_sync() != 0) {
+		return -1;
+	}
+	*first = line_index_find(point < rl_point ? point : rl_point);
+	*last = line_index_find(point < rl_point ? rl_point : point);
+	if (rl_point > point) {
+		rl_point = point;
+	}
+	return 0;
+}
+
+/* Choose between commenting and uncommenting lines first..last */
+static enum line_prefix_op
+comment_toggle_op(int first, int last)
+{
+	return lines_have_prefix(first, last, comment_prefix()) ? LINE_UNCOMMENT : LINE_COMMENT;
+}
+
+/* Indent the lines of the region by 'count' tabs */
+static int
+jot_indent_region(int count, int key)
+{
+	return edit_region_prefixes(LINE_INDENT, count > 0 ? count : 1);
+}
+
+/* Remove 'count' levels of indentation from the lines of the region */
+static int
+jot_dedent_region(int count, int key)
+{
+	return edit_region_prefixes(LINE_DEDENT, count > 0 ? count : 1);
+}
+
+/* Comment out the lines of the region, or uncomment them if all are commented */
+static int
+jot_toggle_comment_region(int count, int key)
+{
+	int first, last;
+
+	if (get_region_lines(&first, &last) != 0) {
+		rl_ding();
+		return 0;
+	}
+	return edit_region_prefixes(comment_toggle_op(first, last), 1);
+}
+
+/* Vi command to indent 'count' lines ('>>') */
+static int
+jot_vi_indent_lines(int count, int key)
+{
+	return edit_count_prefixes(LINE_INDENT, count);
+}
+
+/* Vi command to dedent 'count' lines ('<<') */
+static int
+jot_vi_dedent_lines(int count, int key)
+{
+	return edit_count_prefixes(LINE_DEDENT, count);
+}
+
+/* Vi command to toggle the comment on 'count' lines ('gcc') */
+static int
+jot_vi_toggle_comment_lines(int count, int key)
+{
+	int first, last;
+
+	if (get_count_lines(count, &first, &last) != 0 ||
+		edit_line_prefixes(first, last, comment_toggle_op(first, last), 1) != 0) {
+		rl_ding();
+	}
+	jot_redisplay();
+	return 0;
+}
+
+/* Vi operator to indent the lines a motion moves over ('>') */
+static int
+jot_vi_indent(int count, int key)
+{
+	int first, last;
+
+	if (get_vi_motion_lines(count, '>', &first, &last) != 0 ||
+		edit_line_prefixes(first, last, LINE_INDENT, 1) != 0) {
+		rl_ding();
+	}
+	jot_redisplay();
+	return 0;
+}
+
+/* Vi operator to dedent the lines a motion moves over ('<') */
+static int
+jot_vi_dedent(int count, int key)
+{
+	int first, last;
+
+	if (get_vi_motion_lines(count, '<', &first, &last) != 0 ||
+		edit_line_prefixes(first, last, LINE_DEDENT, 1) != 0) {
+		rl_ding();
+	}
+	jot_redisplay();
+	return 0;
+}
+
+/* Vi operator to toggle the comment on the lines a motion moves over ('gc') */
+static int
+jot_vi_toggle_comment(int count, int key)
+{
+	int first, last;
+
+	if (get_vi_motion_lines(count, 'c', &first, &last) != 0 ||
+		edit_line_prefixes(first, last, comment_toggle_op(first, last), 1) != 0) {
+		rl_ding();
+	}
+	jot_redisplay();
+	return 0;
+}
+
+/*
+ * Display columns
+ *
+ * Columns are counted the way Readline displays the text: tabs advance
+ * to the next multiple of TAB_WIDTH, control characters take two columns
+ * (^X) and other characters take their width from unicode_tables.h in
+ * UTF-8 locales, or their wcwidth() otherwise. Runs of printable ASCII
+ * take the fast path and never call into the multibyte functions.
+ */
+#define TAB_WIDTH 8
+
+/*
+ * Return the number of columns the non-ASCII character at text[0..len)
+ * takes and set *nbytes to its length. An invalid or truncated sequence
+ * takes one column per byte.
+ */
+static int
+mb_char_width(const char *text, int len, mbstate_t *state, int *nbytes)
+{
+	if (utf8_locale) {
+		uint32_t c;
+		*nbytes = utf8_decode(text, len, &c);
+		return *nbytes == 1 ? 1 : UNICODE_WIDTH(unicode_props(c));
+	}
+
+	wchar_t wc;
+	size_t n = mbrtowc(&wc, text, len, state);
+	if (n == (size_t)-1 || n == (size_t)-2 || n == 0) {
+		memset(state, 0, sizeof(*state));
+		*nbytes = 1;
+		return 1;
+	}
+	*nbytes = n;
+	int width = wcwidth(wc);
+	return width >= 0 ? width : 1;
+}
+
+/*
+ * Scan 'len' bytes of 'text' starting at column *col, stopping before the
+ * first character that would start at or after 'target'. Updates *col to
+ * the column reached and returns the number of bytes scanned.
+ */
+static int
+scan_columns(const char *text, int len, int target, int *col)
+{
+	mbstate_t state;
+	int i = 0;
+	int c = *col;
+
+	memset(&state, 0, sizeof(state));
+	while (i < len && c < target) {
+		unsigned char ch = text[i];
+
+		if (ch >= 0x20 && ch < 0x7f) {
+			c++;
+			i++;
+			continue;
+		}
+		if (ch == '\t') {
+			c += TAB_WIDTH - c % TAB_WIDTH;
+			i++;
+			continue;
+		}
+		if (ch < 0x20 || ch == 0x7f) {
+			c += 2;
+			i++;
+			continue;
+		}
+
+		int n;
+		c += mb_char_width(text + i, len - i, &state, &n);
+		i += n;
+	}
+	*col = c;
+	return i;
+}
+
+/* Return the display column of buffer offset 'pos' within its line */
+static int
+offset_column(int line, int pos)
+{
+	int col = 0;
+	scan_columns(rl_line_buffer + line_start(line), pos - line_start(line), INT_MAX, &col);
+	return col;
+}
+
+/*
+ * Rectangles
+ *
+ * A rectangle is the block of text between the display columns of the
+ * mark and the point, on the lines from the mark to the point. Each
+ * rectangle command finds the column offsets of every line with
+ * scan_columns() and rebuilds the affected lines in one pass, so the
+ * whole rectangle is applied as a single mutation and undo group.
+ */
+static char **killed_rectangle = NULL;   /* Lines of the last killed rectangle */
+static int killed_rectangle_lines = 0;
+
+static void
+free_killed_rectangle(void)
+{
+	for (int i = 0; i < killed_rectangle_lines; i++) {
+		free(killed_rectangle[i]);
+	}
+	free(killed_rectangle);
+	killed_rectangle = NULL;
+	killed_rectangle_lines = 0;
+}
+
+/* Find the lines and columns of the rectangle between mark and point */
+static int
+get_rectangle(int *first, int *last, int *left, int *right)
+{
+	if (line_index_sync() != 0) {
+		return -1;
+	}
+
+	int mark = rl_mark < rl_end ? rl_mark : rl_end;
+	int mark_line = line_index_find(mark);
+	int point_line = line_index_find(rl_point);
+	int mark_col = offset_column(mark_line, mark);
+	int point_col = offset_column(point_line, rl_point);
+
+	*first = mark_line < point_line ? mark_line : point_line;
+	*last = mark_line < point_line ? point_line : mark_line;
+	*left = mark_col < point_col ? mark_col : point_col;
+	*right = mark_col < point_col ? point_col : mark_col;
+	return 0;
+}
+
+/* Append 'n' spaces to 'out' and return the new end */
+static char *
+append_spaces(char *out, int n)
+{
+	memset(out, ' ', n);
+	return out + n;
+}
+
+#define RECTANGLE_KILL  0x01   /* Delete the rectangle from the buffer */
+#define RECTANGLE_SAVE  0x02   /* Save the rectangle for yanking */
+#define RECTANGLE_OPEN  0x04   /* Insert blank space in the rectangle */
+
+/*
+ * Kill, save or open the rectangle between mark and point according to
+ * 'flags'. Killed and saved lines are padded to the rectangle width.
+ */
+static int
+edit_rectangle(int flags)
+{
+	int first, last, left, right;
+
+	if (get_rectangle(&first, &last, &left, &right) != 0) {
+		return -1;
+	}
+
+	int nlines = last - first + 1;
+	int width = right - left;
+	char **saved = NULL;
+
+	if (flags & RECTANGLE_SAVE) {
+		saved = calloc(nlines, sizeof(*saved));
+		if (!saved) {
+			perror("calloc");
+			return -1;
+		}
+	}
+
+	int start = line_start(first);
+	int end = (last + 1 < line_count) ? line_start(last + 1) : rl_end;
+	size_t size = end - start + 1;
+	if (flags & RECTANGLE_OPEN) {
+		size += (size_t)nlines * (right + TAB_WIDTH);
+	}
+	char *text = (flags & (RECTANGLE_KILL | RECTANGLE_OPEN)) ? malloc(size) : NULL;
+	if ((flags & (RECTANGLE_KILL | RECTANGLE_OPEN)) && !text) {
+		perror("malloc");
+		free(saved);
+		return -1;
+	}
+
+	char *out = text;
+	for (int i = 0; i < nlines; i++) {
+		struct line_span span = line_index_span(first + i);
+		const char *src = rl_line_buffer + span.start;
+		int left_col = 0, right_col;
+		int left_off = scan_columns(src, span.len, left, &left_col);
+		right_col = left_col;
+		int right_off = left_off + scan_columns(src + left_off, span.len - left_off, right, &right_col);
+
+		if (saved) {
+			int len = right_off - left_off;
+			int pad = right_col < right ? right - right_col : 0;
+			saved[i] = malloc(len + pad + 1);
+			if (!saved[i]) {
+				perror("malloc");
+				for (int j = 0; j < i; j++) {
+					free(saved[j]);
+				}
+				free(saved);
+				free(text);
+				return -1;
+			}
+			memcpy(saved[i], src + left_off, len);
+			memset(saved[i] + len, ' ', pad);
+			saved[i][len + pad] = '\0';
+		}
+		if (flags & RECTANGLE_KILL) {
+			memcpy(out, src, left_off);
+			out += left_off;
+			memcpy(out, src + right_off, span.len - right_off);
+			out += span.len - right_off;
+		} else if (flags & RECTANGLE_OPEN) {
+			memcpy(out, src, left_off);
+			out += left_off;
+			/* Lines that end before the rectangle are not padded */
+			if (left_off < span.len) {
+				out = append_spaces(out, width);
+				memcpy(out, src + left_off, span.len - left_off);
+				out += span.len - left_off;
+			}
+		}
+		if (text && span.start + span.len < end) {
+			*out++ = '\n';
+		}
+	}
+
+	if (saved) {
+		free_killed_rectangle();
+		killed_rectangle = saved;
+		killed_rectangle_lines = nlines;
+	}
+	if (text) {
+		*out = '\0';
+		replace_text(start, end, text);
+		free(text);
+
+		/* Leave the cursor at the top left corner of the rectangle */
+		line_index_sync();
+		int col = 0;
+		struct line_span span = line_index_span(first);
+		rl_point = span.start + scan_columns(rl_line_buffer + span.start, span.len, left, &col);
+		rl_mark = rl_point;
+	}
+	return 0;
+}
+
+/*
+ * Insert the last killed rectangle with its top left corner at the
+ * cursor, padding short lines with spaces and adding lines at the end of
+ * the buffer as needed.
+ */
+static int
+yank_rectangle(void)
+{
+	if (killed_rectangle_lines == 0 || line_index_sync() != 0) {
+		return -1;
+	}
+
+	int first = line_index_find(rl_point);
+	int col = offset_column(first, rl_point);
+	int last = first + killed_rectangle_lines - 1;
+	int existing_last = last < line_count ? last : line_count - 1;
+	int start = line_start(first);
+	int end = (existing_last + 1 < line_count) ? line_start(existing_last + 1) : rl_end;
+	size_t size = end - start + 1;
+
+	for (int i = 0; i < killed_rectangle_lines; i++) {
+		size += strlen(killed_rectangle[i]) + col + 1;
+	}
+	char *text = malloc(size);
+	if (!text) {
+		perror("malloc");
+		return -1;
+	}
+
+	char *out = text;
+	int corner = 0;
+	for (int i = 0; i < killed_rectangle_lines; i++) {
+		const char *src = "";
+		int len = 0, has_newline = 0;
+
+		if (first + i <= existing_last) {
+			struct line_span span = line_index_span(first + i);
+			src = rl_line_buffer + span.start;
+			len = span.len;
+			has_newline = span.start + span.len < end;
+		} else {
+			/* Past the end of the buffer: start a new line */
+			*out++ = '\n';
+		}
+
+		int reached = 0;
+		int off = scan_columns(src, len, col, &reached);
+		memcpy(out, src, off);
+		out += off;
+		if (reached < col) {
+			out = append_spaces(out, col - reached);
+		}
+		size_t rect_len = strlen(killed_rectangle[i]);
+		memcpy(out, killed_rectangle[i], rect_len);
+		out += rect_len;
+		corner = out - text;
+		memcpy(out, src + off, len - off);
+		out += len - off;
+		if (has_newline) {
+			*out++ = '\n';
+		}
+	}
+	*out = '\0';
+
+	/* Leave the mark at the top left and the cursor at the bottom right */
+	rl_mark = rl_point;
+	replace_text(start, end, text);
+	free(text);
+	rl_point = start + corner;
+	return 0;
+}
+
+/* Delete the rectangle between mark and point, saving it for yanking */
+static int
+jot_kill_rectangle(int count, int key)
+{
+	if (edit_rectangle(RECTANGLE_KILL | RECTANGLE_SAVE) != 0) {
+		rl_ding();
+	}
+	jot_redisplay();
+	return 0;
+}
+
+/* Save the rectangle between mark and point for yanking */
+static int
+jot_copy_rectangle(int count, int key)
+{
+	if (edit_rectangle(RECTANGLE_SAVE) != 0) {
+		rl_ding();
+	}
+	return 0;
+}
+
+/* Insert the last killed rectangle at the cursor */
+static int
+jot_yank_rectangle(int count, int key)
+{
+	if (yank_rectangle() != 0) {
+		rl_ding();
+	}
+	jot_redisplay();
+	return 0;
+}
+
+/* Insert blank space filling the rectangle between mark and point */
+static int
+jot_open_rectangle(int count, int key)
+{
+	if (edit_rectangle(RECTANGLE_OPEN) != 0) {
+		rl_ding();
+	}
+	jot_redisplay();
+	return 0;
+}
+
+/*
+ * Paragraph filling
+ *
+ * A paragraph is a run of non-blank lines. Filling splits it into words
+ * and breaks them into lines of at most fill_column display columns, each
+ * starting with the indentation of the paragraph's first line. The greedy
+ * mode puts as many words as fit on each line. The optimal mode minimizes
+ * the sum of the squared trailing space of all lines but the last. Since a
+ * line can only hold the words that fit in fill_column, each break point
+ * considers a bounded number of predecessors, and both modes run in time
+ * linear in the number of words.
+ */
+#define DEFAULT_FILL_COLUMN 72
+
+static int fill_column = DEFAULT_FILL_COLUMN;
+
+struct fill_word {
+	int start;   /* Offset of the word in rl_line_buffer */
+	int len;
+	int width;   /* Display width */
+};
+
+struct fill_state {
+	struct fill_word *words;
+	int nwords;
+	int words_size;
+	long long *cost;    /* Optimal mode: cost of filling words[0..i) */
+	int *breaks;        /* Index of the first word of each output line */
+};
+
+static void
+free_fill_state(struct fill_state *fs)
+{
+	free(fs->words);
+	free(fs->cost);
+	free(fs->breaks);
+}
+
+static int
+is_blank_span(struct line_span span)
+{
+	for (int i = 0; i < span.len; i++) {
+		char c = rl_line_buffer[span.start + i];
+		if (c != ' ' && c != '\t') {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Split lines first..last into words. Returns -1 on allocation failure. */
+static int
+collect_fill_words(struct fill_state *fs, int first, int last)
+{
+	fs->nwords = 0;
+	for (int line = first; line <= last; line++) {
+		struct line_span span = line_index_span(line);
+		int i = 0;
+
+		while (i < span.len) {
+			while (i < span.len && (rl_line_buffer[span.start + i] == ' ' ||
+									rl_line_buffer[span.start + i] == '\t')) {
+				i++;
+			}
+			if (i == span.len) {
+				break;
+			}
+			int word_start = i;
+			while (i < span.len && rl_line_buffer[span.start + i] != ' ' &&
+				   rl_line_buffer[span.start + i] != '\t') {
+				i++;
+			}
+
+			if (fs->nwords == fs->words_size) {
+				int new_size = fs->words_size ? fs->words_size * 2 : 256;
+				struct fill_word *new_words = realloc(fs->words, new_size * sizeof(*new_words));
+				if (!new_words) {
+					perror("realloc");
+					return -1;
+				}
+				fs->words = new_words;
+				fs->words_size = new_size;
+			}
+			struct fill_word *word = &fs->words[fs->nwords++];
+			word->start = span.start + word_start;
+			word->len = i - word_start;
+			word->width = 0;
+			scan_columns(rl_line_buffer + word->start, word->len, INT_MAX, &word->width);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Choose the line breaks for the collected words, filling fs->breaks
+ * with the first word of each line. Returns the number of lines, or -1 on
+ * allocation failure.
+ */
+static int
+break_fill_lines(struct fill_state *fs, int width, int optimal)
+{
+	int n = fs->nwords;
+	int nlines = 0;
+
+	free(fs->breaks);
+	fs->breaks = malloc((n + 1) * sizeof(*fs->breaks));
+	if (!fs->breaks) {
+		perror("malloc");
+		return -1;
+	}
+
+	if (!optimal) {
+		int line_width = 0;
+		for (int i = 0; i < n; i++) {
+			int w = fs->words[i].width;
+			if (i == 0 || line_width + 1 + w > width) {
+				fs->breaks[nlines++] = i;
+				line_width = w;
+			} else {
+				line_width += 1 + w;
+			}
+		}
+		return nlines;
+	}
+
+	/*
+	 * cost[j] is the least cost of breaking words[0..j) into lines, and
+	 * from[j] the first word of the last of those lines.
+	 */
+	free(fs->cost);
+	fs->cost = malloc((n + 1) * sizeof(*fs->cost));
+	int *from = malloc((n + 1) * sizeof(*from));
+	if (!fs->cost || !from) {
+		perror("malloc");
+		free(from);
+		return -1;
+	}
+
+	fs->cost[0] = 0;
+	for (int j = 1; j <= n; j++) {
+		int line_width = -1;
+
+		fs->cost[j] = LLONG_MAX;
+		from[j] = j - 1;
+		for (int i = j - 1; i >= 0; i--) {
+			line_width += 1 + fs->words[i].width;
+			if (line_width > width && i < j - 1) {
+				break;
+			}
+			long long slack = width - line_width;
+			long long cost = fs->cost[i];
+			if (j < n) {
+				/* Overlong single words cost nothing beyond their own line */
+				cost += slack > 0 ? slack * slack : 0;
+			}
+			if (cost < fs->cost[j]) {
+				fs->cost[j] = cost;
+				from[j] = i;
+			}
+		}
+	}
+
+	/* Walk the chosen breaks back from the end */
+	for (int j = n; j > 0; j = from[j]) {
+		nlines++;
+	}
+	int k = nlines;
+	for (int j = n; j > 0; j = from[j]) {
+		fs->breaks[--k] = from[j];
+	}
+	free(from);
+	return nlines;
+}
+
+/* Make room for 'need' bytes in a growing text buffer */
+static int
+reserve_text(char **text, size_t *size, size_t need)
+{
+	if (need <= *size) {
+		return 0;
+	}
+	size_t new_size = *size ? *size : 4096;
+	while (new_size < need) {
+		new_size *= 2;
+	}
+	char *new_text = realloc(*text, new_size);
+	if (!new_text) {
+		perror("realloc");
+		return -1;
+	}
+	*text = new_text;
+	*size = new_size;
+	return 0;
+}
+
+/*
+ * Fill the paragraphs of lines first..last in one pass and replace them
+ * as a single undo group. Blank lines are kept as they are. The cursor
+ * stays on the same non-blank character.
+ */
+static int
+fill_lines(int first, int last, int optimal)
+{
+	struct fill_state fs = { 0 };
+	int start = line_start(first);
+	int end = (last + 1 < line_count) ? line_start(last + 1) : rl_end;
+	int point_chars = -1;
+	char *text = NULL;
+	size_t size = 0, used = 0;
+
+	if (rl_point >= start && rl_point <= end) {
+		point_chars = 0;
+		for (int i = start; i < rl_point; i++) {
+			char c = rl_line_buffer[i];
+			point_chars += (c != ' ' && c != '\t' && c != '\n');
+		}
+	}
+
+	for (int line = first; line <= last; ) {
+		struct line_span span = line_index_span(line);
+
+		if (is_blank_span(span)) {
+			if (reserve_text(&text, &size, used + span.len + 2) != 0) {
+				goto fail;
+			}
+			memcpy(text + used, rl_line_buffer + span.start, span.len);
+			used += span.len;
+			if (span.start + span.len < end) {
+				text[used++] = '\n';
+			}
+			line++;
+			continue;
+		}
+
+		/* Find the end of the paragraph and its indentation */
+		int para_last = line;
+		while (para_last < last && !is_blank_span(line_index_span(para_last + 1))) {
+			para_last++;
+		}
+		int indent = 0;
+		while (indent < span.len && (rl_line_buffer[span.start + indent] == ' ' ||
+									 rl_line_buffer[span.start + indent] == '\t')) {
+			indent++;
+		}
+		int indent_width = 0;
+		scan_columns(rl_line_buffer + span.start, indent, INT_MAX, &indent_width);
+
+		if (collect_fill_words(&fs, line, para_last) != 0) {
+			goto fail;
+		}
+		int nlines = break_fill_lines(&fs, fill_column - indent_width, optimal);
+		if (nlines < 0) {
+			goto fail;
+		}
+
+		/* Each word is followed by a space or newline, and may start a line */
+		size_t need = used + 2;
+		for (int i = 0; i < fs.nwords; i++) {
+			need += fs.words[i].len + indent + 1;
+		}
+		if (reserve_text(&text, &size, need) != 0) {
+			goto fail;
+		}
+
+		for (int l = 0; l < nlines; l++) {
+			int word_end = (l + 1 < nlines) ? fs.breaks[l + 1] : fs.nwords;
+			memcpy(text + used, rl_line_buffer + span.start, indent);
+			used += indent;
+			for (int w = fs.breaks[l]; w < word_end; w++) {
+				if (w > fs.breaks[l]) {
+					text[used++] = ' ';
+				}
+				memcpy(text + used, rl_line_buffer + fs.words[w].start, fs.words[w].len);
+				used += fs.words[w].len;
+			}
+			if (l + 1 < nlines) {
+				text[used++] = '\n';
+			}
+		}
+		struct line_span last_span = line_index_span(para_last);
+		if (last_span.start + last_span.len < end) {
+			text[used++] = '\n';
+		}
+		line = para_last + 1;
+	}
+
+	if (reserve_text(&text, &size, used + 1) != 0) {
+		goto fail;
+	}
+	text[used] = '\0';
+	replace_text(start, end, text);
+
+	if (point_chars >= 0) {
+		int pos = start;
+		while (pos < rl_end) {
+			char c = rl_line_buffer[pos];
+			if (c != ' ' && c != '\t' && c != '\n' && point_chars-- == 0) {
+				break;
+			}
+			pos++;
+		}
+		rl_point = pos;
+	}
+	free(text);
+	free_fill_state(&fs);
+	return 0;
+
+fail:
+	free(text);
+	free_fill_state(&fs);
+	return -1;
+}
+
+/* Find the paragraph around the cursor. Returns -1 on a blank line. */
+static int
+get_paragraph_lines(int *first, int *last)
+{
+	if (line_index_sync() != 0) {
+		return -1;
+	}
+
+	int line = line_index_find(rl_point);
+	if (is_blank_span(line_index_span(line))) {
+		return -1;
+	}
+	*first = line;
+	while (*first > 0 && !is_blank_span(line_index_span(*first - 1))) {
+		(*first)--;
+	}
+	*last = line;
+	while (*last + 1 < line_count && !is_blank_span(line_index_span(*last + 1))) {
+		(*last)++;
+	}
+	return 0;
+}
+
+static int
+fill_paragraph(int optimal)
+{
+	int first, last;
+
+	if (get_paragraph_lines(&first, &last) != 0 || fill_lines(first, last, optimal) != 0) {
+		rl_ding();
+	}
+	jot_redisplay();
+	return 0;
+}
+
+static int
+fill_region(int optimal)
+{
+	int first, last;
+
+	if (get_region_lines(&first, &last) != 0 || fill_lines(first, last, optimal) != 0) {
+		rl_ding();
+	}
+	jot_redisplay();
+	return 0;
+}
+
+/* Fill the paragraph around the cursor, putting as many words as fit on each line */
+static int
+jot_fill_paragraph(int count, int key)
+{
+	return fill_paragraph(0);
+}
+
+/* Fill the paragraph around the cursor with the least ragged right margin */
+static int
+jot_fill_paragraph_optimal(int count, int key)
+{
+	return fill_paragraph(1);
+}
+
+/* Fill each paragraph of the region */
+static int
+jot_fill_region(int count, int key)
+{
+	return fill_region(0);
+}
+
+/* Fill each paragraph of the region with the least ragged right margin */
+static int
+jot_fill_region_optimal(int count, int key)
+{
+	return fill_region(1);
+}
+
+/* Set the fill column to the argument, or to the cursor's column without one */
+static int
+jot_set_fill_column(int count, int key)
+{
+	if (rl_explicit_arg) {
+		fill_column = count > 0 ? count : DEFAULT_FILL_COLUMN;
+	} else if (line_index_sync() == 0) {
+		int line = line_index_find(rl_point);
+		fill_column = offset_column(line, rl_point);
+		if (fill_column <= 0) {
+			fill_column = DEFAULT_FILL_COLUMN;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Display
+ *
+ * jot draws the buffer itself instead of using Readline's redisplay, so
+ * that it can decorate lines and keep large buffers within the terminal.
+ * The display area starts at the line where editing began and grows down
+ * to at most the height of the terminal. When the buffer does not fit,
+ * the area shows a window of the buffer around the cursor. Each frame is
+ * assembled in memory and written at once, and rows that show the same
+ * contents as in the previous frame are not redrawn.
+ */
+enum style {
+	STYLE_NORMAL,
+	STYLE_COMMENT,
+	STYLE_WARNING,
+	STYLE_ERROR,
+	STYLE_RULER,
+	STYLE_IGNORED,
+	STYLE_KEYWORD,
+	STYLE_STRING,
+	STYLE_NUMBER,
+	STYLE_KEY,
+	STYLE_VARIABLE,
+	STYLE_MATCH,
+	STYLE_FOLD,
+	STYLE_ADDED,
+	STYLE_REMOVED,
+	STYLE_LINE_NUMBER,
+	STYLE_STATUS,
+	NSTYLES
+};
+
+static const char *color_styles[NSTYLES] = {
+	"\033[m",
+	"\033[36m",
+	"\033[33m",
+	"\033[31m",
+	"\033[2;7m",
+	"\033[2m",
+	"\033[35m",
+	"\033[32m",
+	"\033[34m",
+	"\033[1;34m",
+	"\033[1;32m",
+	"\033[7m",
+	"\033[1;36m",
+	"\033[32m",
+	"\033[31m",
+	"\033[2m",
+	"\033[7m"
+};
+
+/* Styles for terminals where NO_COLOR is set */
+static const char *mono_styles[NSTYLES] = {
+	"\033[m",
+	"\033[m",
+	"\033[4m",
+	"\033[7m",
+	"\033[7m",
+	"\033[m",
+	"\033[1m",
+	"\033[m",
+	"\033[m",
+	"\033[1m",
+	"\033[m",
+	"\033[7m",
+	"\033[1m",
+	"\033[1m",
+	"\033[4m",
+	"\033[m",
+	"\033[7m"
+};
+
+static const char **style_sgr = color_styles;
+
+/* A growing text buffer */
+struct textbuf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static int
+textbuf_append(struct textbuf *tb, const char *text, size_t len)
+{
+	if (len == 0) {
+		return 0;
+	}
+	if (tb->len + len > tb->size) {
+		size_t new_size = tb->size ? tb->size : 16384;
+		while (new_size < tb->len + len) {
+			new_size *= 2;
+		}
+		char *new_data = realloc(tb->data, new_size);
+		if (!new_data) {
+			return -1;
+		}
+		tb->data = new_data;
+		tb->size = new_size;
+	}
+	memcpy(tb->data + tb->len, text, len);
+	tb->len += len;
+	return 0;
+}
+
+static int
+textbuf_puts(struct textbuf *tb, const char *text)
+{
+	return textbuf_append(tb, text, strlen(text));
+}
+
+static struct {
+	int rows;           /* Terminal rows owned by the display area */
+	int cursor_row;     /* Row of the terminal cursor within the area */
+	int top_line;       /* First buffer line shown */
+	int top_row;        /* First row of top_line shown */
+	int left_col;       /* First column shown when lines do not wrap */
+	int screen_cols;    /* Terminal width at the last frame */
+	uint64_t *row_hash; /* What each row shows, 0 if unknown */
+	uint64_t *gutter_hash;  /* What the gutter of each row shows, 0 if unknown */
+	int row_hash_size;
+	int status;         /* Whether the last row of the area is the status line */
+	struct textbuf frame;       /* Output of the frame being drawn */
+	struct textbuf line_text;   /* Rows of the line being laid out */
+	struct textbuf gutter_text; /* Gutter of the row being drawn */
+	int match[2];       /* Offsets of the highlighted bracket pair, or -1 */
+	int paging;         /* A pager owns the area: resizes do not redraw the buffer */
+	int deferred;       /* A frame was skipped while the terminal was behind */
+} display = { .match = { -1, -1 } };
+
+/* Forget what the rows show, so that the next frame redraws them all */
+static void
+display_invalidate(void)
+{
+	if (display.row_hash) {
+		memset(display.row_hash, 0, display.row_hash_size * sizeof(*display.row_hash));
+		memset(display.gutter_hash, 0, display.row_hash_size * sizeof(*display.gutter_hash));
+	}
+}
+
+static void
+frame_append(const char *text, size_t len)
+{
+	if (textbuf_append(&display.frame, text, len) != 0) {
+		/* Output was lost: redraw everything next time */
+		display_invalidate();
+	}
+}
+
+static void
+frame_puts(const char *text)
+{
+	frame_append(text, strlen(text));
+}
+
+static void
+frame_printf(const char *fmt, int n)
+{
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), fmt, n);
+	frame_append(buf, len);
+}
+
+/*
+ * Output statistics for --stats. A frame is what is written at once:
+ * everything drawn since jot last waited for a key.
+ */
+static struct {
+	unsigned long frames;
+	unsigned long writes;     /* write() calls, more than frames if some were partial */
+	unsigned long bytes;
+	unsigned long max_bytes;  /* Size of the largest frame */
+	unsigned long skipped;    /* Redisplays skipped while the terminal was behind */
+} frame_stats;
+
+/*
+ * Output throttling for slow links. The terminal's output queue
+ * (TIOCOUTQ) shows how far behind the link is, and how fast it drains
+ * between frames gives its speed. Frames are skipped while the queue
+ * holds more than the link sends in FRAME_INTERVAL_MS.
+ */
+#define FRAME_INTERVAL_MS 50
+
+static struct {
+	double rate;            /* Bytes per second the link drains, or 0 if not known */
+	int queued;             /* Bytes in the output queue when last looked at */
+	struct timespec when;   /* When that was */
+} throttle;
+
+/* Frames drawn while keys are waiting are held back, up to this size */
+#define FRAME_BATCH_MAX 16384
+
+/* Frames this large are shown at once where the terminal can, instead of as they arrive */
+#define FRAME_SYNC_MIN 256
+
+/* What the terminal can do beyond the sequences every frame uses */
+static struct {
+	int loaded;         /* Whether the capabilities below were looked up */
+	int insert_delete;  /* Inserting and deleting lines (IL, DL) */
+	int scroll_region;  /* Setting the scrolling region (DECSTBM) */
+	int sync;           /* Synchronized output (DEC mode 2026) */
+} term_caps;
+
+/*
+ * Terminals known to support synchronized output. Termcap has no name
+ * for it, and unknown terminals are not asked, since the answer would
+ * arrive as typed keys.
+ */
+static const char *const sync_terms[] = {
+	"xterm-kitty", "foot", "wezterm", "alacritty", "contour", "xterm-ghostty"
+};
+static const char *const sync_term_programs[] = {
+	"iTerm.app", "WezTerm", "ghostty"
+};
+
+/*
+ * Look up the terminal's capabilities. Readline does not load the
+ * terminal description when the application draws the text itself.
+ */
+static void
+term_caps_init(void)
+{
+	static char entry[2048], buf[256];
+	char *area = buf;
+	const char *term = getenv("TERM");
+
+	if (term_caps.loaded) {
+		return;
+	}
+	term_caps.loaded = 1;
+	if (!term || tgetent(entry, term) <= 0) {
+		return;
+	}
+	term_caps.insert_delete = (tgetstr("AL", &area) || tgetstr("al", &area)) &&
+		(tgetstr("DL", &area) || tgetstr("dl", &area));
+	term_caps.scroll_region = tgetstr("cs", &area) != NULL;
+
+	const char *program = getenv("TERM_PROGRAM");
+	for (size_t i = 0; term && i < sizeof(sync_terms) / sizeof(sync_terms[0]); i++) {
+		if (strncmp(term, sync_terms[i], strlen(sync_terms[i])) == 0) {
+			term_caps.sync = 1;
+		}
+	}
+	for (size_t i = 0; program && i < sizeof(sync_term_programs) / sizeof(sync_term_programs[0]); i++) {
+		if (strcmp(program, sync_term_programs[i]) == 0) {
+			term_caps.sync = 1;
+		}
+	}
+}
+
+/* Write the frame to the terminal, with readline's output in it */
+static void
+frame_flush(void)
+{
+	fflush(rl_outstream);
+
+	char *p = display.frame.data;
+	size_t left = display.frame.len;
+
+	if (left == 0) {
+		return;
+	}
+	frame_stats.frames++;
+	frame_stats.bytes += left;
+	if (left > frame_stats.max_bytes) {
+		frame_stats.max_bytes = left;
+	}
+
+	/* A large frame is shown at once, without the rows changing one by one */
+	static const char sync_begin[] = "\033[?2026h", sync_end[] = "\033[?2026l";
+	struct iovec iov[3] = {
+		{ (void *)sync_begin, sizeof(sync_begin) - 1 },
+		{ (void *)p, left },
+		{ (void *)sync_end, sizeof(sync_end) - 1 },
+	};
+	struct iovec *next = iov;
+	int count = 3;
+	if (!term_caps.sync || left < FRAME_SYNC_MIN) {
+		next = &iov[1];
+		count = 1;
+	}
+	while (count > 0) {
+		ssize_t n = writev(tty.fd, next, count);
+		frame_stats.writes++;
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		while (count > 0 && (size_t)n >= next->iov_len) {
+			n -= next->iov_len;
+			next++;
+			count--;
+		}
+		if (count > 0) {
+			next->iov_base = (char *)next->iov_base + n;
+			next->iov_len -= n;
+		}
+	}
+	display.frame.len = 0;
+	startup_mark(STARTUP_FIRST_PAINT);
+
+	if (ioctl(tty.fd, TIOCOUTQ, &throttle.queued) == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &throttle.when);
+	}
+}
+
+/*
+ * Whether the terminal is too far behind for another frame. If it is and
+ * 'wait_ms' is not NULL, set it to how long the link needs to catch up.
+ */
+static int
+frame_link_behind(int *wait_ms)
+{
+	int queued;
+
+	if (tty.fd == -1 || ioctl(tty.fd, TIOCOUTQ, &queued) != 0 || queued == 0) {
+		return 0;
+	}
+
+	/* Measure how fast the queue drained since it was last looked at */
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - throttle.when.tv_sec) +
+		(now.tv_nsec - throttle.when.tv_nsec) / 1e9;
+	if (queued < throttle.queued && elapsed > 0) {
+		double rate = (throttle.queued - queued) / elapsed;
+		throttle.rate = throttle.rate > 0 ? (throttle.rate + rate) / 2 : rate;
+		throttle.queued = queued;
+		throttle.when = now;
+	}
+
+	double sendable = throttle.rate * FRAME_INTERVAL_MS / 1000;
+	if (queued <= sendable) {
+		return 0;
+	}
+	if (wait_ms) {
+		double ms = throttle.rate > 0 ? (queued - sendable) * 1000 / throttle.rate : 10;
+		*wait_ms = ms < 1 ? 1 : ms > 1000 ? 1000 : (int)ms;
+	}
+	return 1;
+}
+
+/* Write function of the terminal stream: readline's output joins the frame */
+static ssize_t
+frame_stream_write(void *cookie, const char *buf, size_t size)
+{
+	frame_append(buf, size);
+	return size;
+}
+
+static void
+frame_stats_report(FILE *fp)
+{
+	fprintf(fp, "%-12s %8lu\n", "frames", frame_stats.frames);
+	fprintf(fp, "%-12s %8lu\n", "writes", frame_stats.writes);
+	fprintf(fp, "%-12s %8lu\n", "bytes", frame_stats.bytes);
+	fprintf(fp, "%-12s %8.1f\n", "bytes/frame",
+		frame_stats.frames ? (double)frame_stats.bytes / frame_stats.frames : 0.0);
+	fprintf(fp, "%-12s %8lu\n", "max frame", frame_stats.max_bytes);
+	fprintf(fp, "%-12s %8lu\n", "skipped", frame_stats.skipped);
+}
+
+/* Move the terminal cursor to the start of 'row' of the display area */
+static void
+frame_goto_row(int row)
+{
+	if (row < display.cursor_row) {
+		frame_printf("\033[%dA", display.cursor_row - row);
+	} else if (row > display.cursor_row) {
+		frame_printf("\033[%dB", row - display.cursor_row);
+	}
+	frame_puts("\r");
+	display.cursor_row = row;
+}
+
+/*
+ * Return the number of cells the character at text[0..len) takes when it
+ * starts at column 'col', and set *nbytes to its length. The caller
+ * handles printable ASCII itself.
+ */
+static int
+char_cells(const char *text, int len, int col, mbstate_t *state, int *nbytes)
+{
+	unsigned char ch = text[0];
+
+	*nbytes = 1;
+	if (ch == '\t') {
+		return TAB_WIDTH - col % TAB_WIDTH;
+	}
+	if (ch < 0x20 || ch == 0x7f) {
+		return 2;
+	}
+	return mb_char_width(text, len, state, nbytes);
+}
+
+/* Where layout_line() draws the rows of a line */
+struct layout_out {
+	struct textbuf *text;       /* Receives the rows */
+	int first_row;              /* First row to draw */
+	int nrows;                  /* Number of rows to draw */
+	const unsigned char *styles;    /* Style of each byte, or NULL */
+	const int *rulers;          /* Ruler columns ending in -1, or NULL */
+	size_t *row_end;            /* End of each row in text */
+	int *row_cells;             /* Cells used by each row */
+	int style;                  /* Style in effect */
+};
+
+static int
+layout_visible(const struct layout_out *lo, int row)
+{
+	return lo && row >= lo->first_row && row < lo->first_row + lo->nrows;
+}
+
+static void
+layout_set_style(struct layout_out *lo, int style)
+{
+	if (style != lo->style) {
+		if (lo->style != STYLE_NORMAL) {
+			textbuf_puts(lo->text, style_sgr[STYLE_NORMAL]);
+		}
+		if (style != STYLE_NORMAL) {
+			textbuf_puts(lo->text, style_sgr[style]);
+		}
+		lo->style = style;
+	}
+}
+
+static void
+layout_end_row(struct layout_out *lo, int row, int x)
+{
+	if (layout_visible(lo, row)) {
+		layout_set_style(lo, STYLE_NORMAL);
+		lo->row_end[row - lo->first_row] = lo->text->len;
+		lo->row_cells[row - lo->first_row] = x;
+	}
+}
+
+/*
+ * Where a row after the first of a wrapped line starts: the offset of the
+ * first character that starts on it, with its column and cell. The
+ * character is not at cell 0 if the row starts with the end of a tab.
+ */
+struct row_mark {
+	int off;
+	int col;
+	int x;
+};
+
+/*
+ * Lay out a line in rows of 'cols' cells. Characters that do not fit at
+ * the end of a row move to the next one. Returns the number of rows the
+ * line takes. If point_off is within the line, the row and cell of that
+ * offset are stored in *point_row and *point_x. If 'lo' is set, the rows
+ * it asks for are drawn into lo->text. If 'row_marks' is set, a struct
+ * row_mark for each row after the first is appended to it.
+ */
+static int
+layout_line(int line, int cols, int point_off, int *point_row, int *point_x,
+			struct layout_out *lo, struct textbuf *row_marks)
+{
+	struct line_span span = line_index_span(line);
+	const char *text = rl_line_buffer + span.start;
+	mbstate_t state;
+	int row = 0, x = 0, col = 0;
+	int marked = 0;
+
+	memset(&state, 0, sizeof(state));
+	for (int i = 0; ; ) {
+		if (x == cols) {
+			layout_end_row(lo, row, x);
+			row++;
+			x = 0;
+			if (lo && row >= lo->first_row + lo->nrows) {
+				return row;
+			}
+		}
+		if (row_marks && row > marked) {
+			/* Rows that only hold the end of a tab start where the next one does */
+			struct row_mark mark = { i, col, x };
+			for (; marked < row; marked++) {
+				textbuf_append(row_marks, (const char *)&mark, sizeof(mark));
+			}
+		}
+		if (i == point_off) {
+			*point_row = row;
+			*point_x = x;
+		}
+		if (i == span.len) {
+			break;
+		}
+
+		unsigned char ch = text[i];
+		int nbytes = 1;
+		int cells = (ch >= 0x20 && ch < 0x7f) ? 1 : char_cells(text + i, span.len - i, col, &state, &nbytes);
+
+		if (ch != '\t' && x + cells > cols && x > 0) {
+			/* A wide character that does not fit: pad and wrap */
+			if (layout_visible(lo, row)) {
+				layout_set_style(lo, STYLE_NORMAL);
+				for (; x < cols; x++) {
+					textbuf_append(lo->text, " ", 1);
+				}
+			}
+			x = cols;
+			continue;
+		}
+		if (layout_visible(lo, row)) {
+			layout_set_style(lo, lo->styles ? lo->styles[i] : STYLE_NORMAL);
+		}
+
+		if (ch == '\t') {
+			/* Expand tabs a cell at a time so that they wrap like spaces */
+			for (int c = 0; c < cells; c++) {
+				if (x == cols) {
+					layout_end_row(lo, row, x);
+					row++;
+					x = 0;
+					if (layout_visible(lo, row)) {
+						layout_set_style(lo, lo->styles ? lo->styles[i] : STYLE_NORMAL);
+					}
+				}
+				if (layout_visible(lo, row)) {
+					textbuf_append(lo->text, " ", 1);
+				}
+				x++;
+			}
+		} else {
+			if (layout_visible(lo, row)) {
+				if (ch >= 0x20 && ch < 0x7f) {
+					textbuf_append(lo->text, text + i, 1);
+				} else if (ch < 0x20 || ch == 0x7f) {
+					char caret[2] = { '^', ch == 0x7f ? '?' : ch + '@' };
+					textbuf_append(lo->text, caret, 2);
+				} else if (nbytes == 1) {
+					/* Not a valid character in the current locale */
+					textbuf_append(lo->text, "?", 1);
+				} else {
+					textbuf_append(lo->text, text + i, nbytes);
+				}
+			}
+			x += cells;
+		}
+		col += cells;
+		i += nbytes;
+	}
+
+	/* Rulers past the end of a single-row line */
+	if (lo && lo->rulers && row == 0 && layout_visible(lo, row)) {
+		for (int r = 0; lo->rulers[r] >= 0; r++) {
+			if (lo->rulers[r] >= x && lo->rulers[r] < cols) {
+				layout_set_style(lo, STYLE_NORMAL);
+				for (; x < lo->rulers[r]; x++) {
+					textbuf_append(lo->text, " ", 1);
+				}
+				layout_set_style(lo, STYLE_RULER);
+				textbuf_append(lo->text, " ", 1);
+				x++;
+			}
+		}
+	}
+	layout_end_row(lo, row, x);
+	return row + 1;
+}
+
+/*
+ * Column marks of a long line: character boundaries about every
+ * COLUMN_MARK_STEP bytes, with their columns, recorded as the line is
+ * scanned. The character at a column or offset is found by a binary
+ * search and a scan of at most one step, so that showing part of a long
+ * line that does not wrap costs the width of the screen, not the length
+ * of the line. An edit drops only the marks after it.
+ *
+ * With syntax highlighting, a mark also holds the lexer state at the
+ * first token boundary at or after it, so that the visible part of the
+ * line can be lexed from the nearest mark. An edit drops the states that
+ * were found by looking at the edited bytes.
+ */
+#define COLUMN_MARK_STEP 256
+
+struct column_mark {
+	int off;
+	int col;
+	int lex_off;     /* Token boundary at or after 'off' */
+	int lex_reach;   /* Offset past the last byte looked at to lex up to it */
+	int lex_state;   /* Lexer state there */
+};
+
+struct column_marks {
+	int count;
+	int size;
+	int lexed;                          /* Leading marks whose lexer state is known */
+	const struct syntax *lex_syntax;    /* Syntax they were lexed with */
+	int lex_state;                      /* State at the start of the line they were lexed from */
+	struct column_mark mark[];
+};
+
+/*
+ * The number of rows each line takes, with the width it was laid out for.
+ * Entries of changed lines are cleared by the line index, and a resize
+ * changes the width, so entries are redone only for the lines that are
+ * laid out again: those in view.
+ */
+struct wrap_entry {
+	int cols;   /* Width the rows were counted for, or 0 */
+	int rows;
+	struct column_marks *marks;   /* Column marks of a long line, or NULL */
+	struct row_mark *row_marks;   /* Marks of the rows after the first, or NULL */
+};
+static struct wrap_entry *wrap_cache = NULL;
+static int wrap_cache_size = 0;
+static int wrap_cache_failed = 0;   /* Allocation failed: do not cache */
+
+static int line_wrap = 1;   /* Whether long lines wrap, instead of scrolling sideways */
+
+/*
+ * Called by the line index after lines first..first + old_count - 1 were
+ * replaced. The text before offset 'pos' did not change.
+ */
+static void
+wrap_lines_changed(int first, int old_count, int new_count, int pos)
+{
+	int old_total = line_count - new_count + old_count;
+
+	if (wrap_cache_failed) {
+		return;
+	}
+	if (line_count > wrap_cache_size) {
+		int new_size = wrap_cache_size ? wrap_cache_size : 1024;
+		while (new_size < line_count) {
+			new_size *= 2;
+		}
+		struct wrap_entry *new_cache = realloc(wrap_cache, new_size * sizeof(*new_cache));
+		if (!new_cache) {
+			perror("realloc");
+			wrap_cache_failed = 1;
+			return;
+		}
+		wrap_cache = new_cache;
+		wrap_cache_size = new_size;
+	}
+
+	/*
+	 * The first line keeps its marks before the change. The character
+	 * before a mark may have been decoded from bytes up to MB_LEN_MAX
+	 * past it.
+	 */
+	struct column_marks *kept = NULL;
+	if (old_count > 0) {
+		kept = wrap_cache[first].marks;
+		while (kept && kept->count > 1 &&
+			   kept->mark[kept->count - 1].off + MB_LEN_MAX > pos - line_start(first)) {
+			kept->count--;
+		}
+		while (kept && kept->lexed > 0 &&
+			   (kept->lexed > kept->count || kept->mark[kept->lexed - 1].lex_reach >= pos - line_start(first))) {
+			kept->lexed--;
+		}
+		for (int line = first; line < first + old_count; line++) {
+			if (line > first) {
+				free(wrap_cache[line].marks);
+			}
+			free(wrap_cache[line].row_marks);
+		}
+	}
+	if (new_count != old_count) {
+		memmove(&wrap_cache[first + new_count], &wrap_cache[first + old_count],
+				(old_total - first - old_count) * sizeof(*wrap_cache));
+	}
+	for (int line = first; line < first + new_count; line++) {
+		wrap_cache[line].cols = 0;
+		wrap_cache[line].marks = NULL;
+		wrap_cache[line].row_marks = NULL;
+	}
+	wrap_cache[first].marks = kept;
+}
+
+/* Number of rows line 'line' takes */
+static int
+line_rows(int line, int cols)
+{
+	if (!line_wrap || (nfolds && fold_find(line) >= 0)) {
+		return 1;
+	}
+	if (wrap_cache_failed) {
+		return layout_line(line, cols, -1, NULL, NULL, NULL, NULL);
+	}
+	if (wrap_cache[line].cols != cols) {
+		static struct textbuf marks_text;
+		struct wrap_entry *entry = &wrap_cache[line];
+
+		marks_text.len = 0;
+		entry->rows = layout_line(line, cols, -1, NULL, NULL, NULL, &marks_text);
+		entry->cols = cols;
+		free(entry->row_marks);
+		entry->row_marks = NULL;
+		if (entry->rows > 1 && marks_text.len == (entry->rows - 1) * sizeof(struct row_mark)) {
+			entry->row_marks = malloc(marks_text.len);
+			if (entry->row_marks) {
+				memcpy(entry->row_marks, marks_text.data, marks_text.len);
+			}
+		}
+	}
+	return wrap_cache[line].rows;
+}
+
+/*
+ * Find the row and cell where offset 'off' of line 'line' is shown when
+ * the line wraps at 'cols', starting from the mark of its row. Returns -1
+ * if the marks are not known.
+ */
+static int
+row_find(int line, int cols, int off, int *row, int *x)
+{
+	int rows = line_rows(line, cols);
+	const struct row_mark *marks = wrap_cache_failed ? NULL : wrap_cache[line].row_marks;
+	struct row_mark m = { 0, 0, 0 };
+
+	if (rows > 1 && !marks) {
+		return -1;
+	}
+	int lo = 0, hi = rows - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (marks[mid - 1].off <= off) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	if (lo > 0) {
+		m = marks[lo - 1];
+	}
+
+	struct line_span span = line_index_span(line);
+	const char *text = rl_line_buffer + span.start;
+	mbstate_t state;
+	memset(&state, 0, sizeof(state));
+	while (m.off < off && m.off < span.len) {
+		unsigned char ch = text[m.off];
+		int nbytes = 1;
+		int cells = (ch >= 0x20 && ch < 0x7f) ? 1 : char_cells(text + m.off, span.len - m.off, m.col, &state, &nbytes);
+		m.off += nbytes;
+		m.col += cells;
+		m.x += cells;
+	}
+	*row = lo;
+	*x = m.x;
+	return 0;
+}
+
+/*
+ * Find the character of line 'line' shown at cell 'goal_x' of row 'row'
+ * when the line wraps at 'cols', or the last one on the row if the row
+ * ends before that cell. Returns the offset of the grapheme cluster it is
+ * in, or -1 if the marks are not known.
+ */
+static int
+row_offset_at(int line, int cols, int row, int goal_x)
+{
+	int rows = line_rows(line, cols);
+	const struct row_mark *marks = wrap_cache_failed ? NULL : wrap_cache[line].row_marks;
+	struct line_span span = line_index_span(line);
+
+	if (rows > 1 && !marks) {
+		return -1;
+	}
+	struct row_mark m = row > 0 ? marks[row - 1] : (struct row_mark){ 0, 0, 0 };
+	int row_start = m.off;
+	int end = row + 1 < rows ? marks[row].off : span.len;
+	int last = m.off;
+	int off = -1;
+
+	const char *text = rl_line_buffer + span.start;
+	mbstate_t state;
+	memset(&state, 0, sizeof(state));
+	while (m.off < end) {
+		unsigned char ch = text[m.off];
+		int nbytes = 1;
+		int cells = (ch >= 0x20 && ch < 0x7f) ? 1 : char_cells(text + m.off, span.len - m.off, m.col, &state, &nbytes);
+		if (m.x + cells > goal_x) {
+			off = m.off;
+			break;
+		}
+		last = m.off;
+		m.off += nbytes;
+		m.col += cells;
+		m.x += cells;
+	}
+	if (off < 0) {
+		/* The cursor can be past the end of the last row only */
+		off = row + 1 < rows ? last : end;
+	}
+	if (off == span.len) {
+		return off;
+	}
+
+	/*
+	 * Rows break between characters, which can be inside a cluster. Go to
+	 * its start, or to its end if it starts on an earlier row.
+	 */
+	int cluster_end = grapheme_next(text, span.len, off);
+	int cluster_start = grapheme_prev(text, cluster_end);
+	if (cluster_start >= row_start || cluster_end >= span.len) {
+		return cluster_start;
+	}
+	return cluster_end;
+}
+
+/*
+ * Record that the character at offset 'off' of line 'line' starts at
+ * column 'col'. Returns the marks of the line, which stay as they were
+ * if there is no memory for another.
+ */
+static struct column_marks *
+column_marks_add(int line, int off, int col)
+{
+	struct column_marks *marks = wrap_cache[line].marks;
+
+	if (!marks || marks->count == marks->size) {
+		int size = marks ? 2 * marks->size : 16;
+		struct column_marks *new_marks = realloc(marks, sizeof(*marks) + size * sizeof(marks->mark[0]));
+		if (!new_marks) {
+			return marks;
+		}
+		if (!marks) {
+			new_marks->count = 0;
+			new_marks->lexed = 0;
+			new_marks->lex_syntax = NULL;
+		}
+		new_marks->size = size;
+		marks = wrap_cache[line].marks = new_marks;
+	}
+	marks->mark[marks->count++] = (struct column_mark){ off, col, 0, 0, 0 };
+	return marks;
+}
+
+/*
+ * Find the first character of line 'line' that starts at or after offset
+ * 'max_off' or ends past column 'max_col'. Returns its offset, or the
+ * length of the line if there is none, and stores its column in *col.
+ */
+static int
+column_seek(int line, int max_off, int max_col, int *col)
+{
+	struct line_span span = line_index_span(line);
+	const char *text = rl_line_buffer + span.start;
+	struct column_marks *marks = NULL;
+	mbstate_t state;
+	int off = 0;
+
+	*col = 0;
+	if (span.len > COLUMN_MARK_STEP && !wrap_cache_failed) {
+		marks = wrap_cache[line].marks;
+		if (!marks) {
+			marks = column_marks_add(line, 0, 0);
+		}
+	}
+	if (marks) {
+		/* Start from the last mark before the character */
+		int lo = 0, hi = marks->count - 1;
+		while (lo < hi) {
+			int mid = (lo + hi + 1) / 2;
+			if (marks->mark[mid].off <= max_off && marks->mark[mid].col <= max_col) {
+				lo = mid;
+			} else {
+				hi = mid - 1;
+			}
+		}
+		off = marks->mark[lo].off;
+		*col = marks->mark[lo].col;
+	}
+
+	memset(&state, 0, sizeof(state));
+	while (off < span.len && off < max_off) {
+		unsigned char ch = text[off];
+		int nbytes = 1;
+		int cells = (ch >= 0x20 && ch < 0x7f) ? 1 : char_cells(text + off, span.len - off, *col, &state, &nbytes);
+
+		if (*col + cells > max_col) {
+			break;
+		}
+		off += nbytes;
+		*col += cells;
+		if (marks && off >= marks->mark[marks->count - 1].off + COLUMN_MARK_STEP) {
+			marks = column_marks_add(line, off, *col);
+		}
+	}
+	return off;
+}
+
+/*
+ * Find the bytes of line 'line' that layout_slice() shows: from the
+ * character at column 'left_col' to the one cut by the right edge 'cols'
+ * cells on, with the zero-width characters after it.
+ */
+static void
+slice_range(int line, int cols, int left_col, int *from, int *to)
+{
+	struct line_span span = line_index_span(line);
+	const char *text = rl_line_buffer + span.start;
+	mbstate_t state;
+	int col;
+	int end;
+
+	*from = column_seek(line, span.len, left_col, &col);
+	end = column_seek(line, span.len, left_col + cols, &col);
+	memset(&state, 0, sizeof(state));
+	for (int cut = 1; end < span.len; cut = 0) {
+		int nbytes = 1;
+		int cells = char_cells(text + end, span.len - end, col, &state, &nbytes);
+
+		if (cells > 0 && !cut) {
+			break;
+		}
+		end += nbytes;
+		col += cells;
+	}
+	*to = end;
+}
+
+/*
+ * Lay out the cells of line 'line' from column 'left_col' on, in a row of
+ * 'cols' cells, for when lines do not wrap. Tabs and characters cut by
+ * either edge show as spaces. The row is drawn into lo->text.
+ */
+static void
+layout_slice(int line, int cols, int left_col, struct layout_out *lo)
+{
+	struct line_span span = line_index_span(line);
+	const char *text = rl_line_buffer + span.start;
+	mbstate_t state;
+	int col;
+	int i = column_seek(line, span.len, left_col, &col);
+	int x = 0;
+
+	memset(&state, 0, sizeof(state));
+	while (i < span.len) {
+		unsigned char ch = text[i];
+		int nbytes = 1;
+		int cells = (ch >= 0x20 && ch < 0x7f) ? 1 : char_cells(text + i, span.len - i, col, &state, &nbytes);
+
+		if (x == cols && cells > 0) {
+			break;
+		}
+		layout_set_style(lo, lo->styles ? lo->styles[i] : STYLE_NORMAL);
+		if (ch == '\t' || col < left_col || x + cells > cols) {
+			int end = col + cells - left_col;
+			for (; x < end && x < cols; x++) {
+				textbuf_append(lo->text, " ", 1);
+			}
+		} else {
+			if (ch >= 0x20 && ch < 0x7f) {
+				textbuf_append(lo->text, text + i, 1);
+			} else if (ch < 0x20 || ch == 0x7f) {
+				char caret[2] = { '^', ch == 0x7f ? '?' : ch + '@' };
+				textbuf_append(lo->text, caret, 2);
+			} else if (nbytes == 1) {
+				/* Not a valid character in the current locale */
+				textbuf_append(lo->text, "?", 1);
+			} else {
+				textbuf_append(lo->text, text + i, nbytes);
+			}
+			x += cells;
+		}
+		col += cells;
+		i += nbytes;
+	}
+
+	/* Rulers past the end of the line */
+	if (lo->rulers && i == span.len) {
+		for (int r = 0; lo->rulers[r] >= 0; r++) {
+			int ruler_x = lo->rulers[r] - left_col;
+			if (ruler_x >= x && ruler_x < cols) {
+				layout_set_style(lo, STYLE_NORMAL);
+				for (; x < ruler_x; x++) {
+					textbuf_append(lo->text, " ", 1);
+				}
+				layout_set_style(lo, STYLE_RULER);
+				textbuf_append(lo->text, " ", 1);
+				x++;
+			}
+		}
+	}
+	layout_end_row(lo, 0, x);
+}
+
+/* Marker shown after the first line of a fold, with the number of hidden lines */
+#define FOLD_MARKER " [+%d lines]"
+
+/* Columns left for the text on the row of a fold */
+static int
+fold_text_cols(int cols)
+{
+	int marker_cols = 24;   /* Enough for FOLD_MARKER with any count */
+
+	return cols > 2 * marker_cols ? cols - marker_cols : cols;
+}
+
+/*
+ * Git commit message mode
+ *
+ * When editing COMMIT_EDITMSG, the subject line has rulers at
+ * COMMIT_SUBJECT_WIDTH and COMMIT_BODY_WIDTH, text past those columns is
+ * highlighted, and comment lines are dimmed. Everything from Git's
+ * scissors line on is shown as ignored. The checks are cached in the line
+ * flags and redone only for lines marked LINE_LINT_DIRTY by the line
+ * index, so the cost per keystroke does not grow with the buffer.
+ */
+#define COMMIT_SUBJECT_WIDTH 50
+#define COMMIT_BODY_WIDTH 72
+#define COMMIT_SCISSORS "# ------------------------ >8 ------------------------"
+
+static int commit_mode = 0;
+static int scissors_line = -1;   /* First scissors line, or -1 */
+
+static void
+commit_lint_line(int line)
+{
+	struct line_span span = line_index_span(line);
+	const char *text = rl_line_buffer + span.start;
+	unsigned char flags = line_flags[line] & ~(LINE_LINT_DIRTY | LINE_COMMIT_COMMENT | LINE_COMMIT_SCISSORS | LINE_COMMIT_OVERLONG);
+
+	if (span.len > 0 && text[0] == '#') {
+		flags |= LINE_COMMIT_COMMENT;
+		if (span.len == (int)strlen(COMMIT_SCISSORS) &&
+			memcmp(text, COMMIT_SCISSORS, span.len) == 0) {
+			flags |= LINE_COMMIT_SCISSORS;
+		}
+	}
+	/* No byte takes more cells than a tab at the start of a line */
+	if (span.len * TAB_WIDTH > COMMIT_BODY_WIDTH) {
+		int col = 0;
+		scan_columns(text, span.len, COMMIT_BODY_WIDTH + 1, &col);
+		if (col > COMMIT_BODY_WIDTH) {
+			flags |= LINE_COMMIT_OVERLONG;
+		}
+	}
+	line_flags[line] = flags;
+}
+
+/* Find the first scissors line at or after 'from' */
+static void
+commit_find_scissors(int from)
+{
+	scissors_line = -1;
+	for (int i = from; i < line_count; i++) {
+		if (line_flags[i] & LINE_COMMIT_SCISSORS) {
+			scissors_line = i;
+			break;
+		}
+	}
+}
+
+/* Recheck the dirty lines first..first + count - 1 */
+static void
+commit_lint_update(int first, int old_count, int new_count)
+{
+	int scissors_changed = 0;
+
+	for (int i = first; i < first + new_count; i++) {
+		if (line_flags[i] & LINE_LINT_DIRTY) {
+			commit_lint_line(i);
+			scissors_changed |= (line_flags[i] & LINE_COMMIT_SCISSORS);
+		}
+	}
+
+	if (scissors_line >= first + old_count) {
+		scissors_line += new_count - old_count;
+	} else if (scissors_line >= first) {
+		/* The scissors line itself changed */
+		scissors_changed = 1;
+	}
+	if (scissors_changed) {
+		commit_find_scissors(scissors_line >= 0 && scissors_line < first ? scissors_line : 0);
+	}
+}
+
+static void
+set_commit_mode(int on)
+{
+	commit_mode = on;
+	scissors_line = -1;
+	if (on && indexed_len >= 0) {
+		for (int i = 0; i < line_count; i++) {
+			line_flags[i] |= LINE_LINT_DIRTY;
+		}
+		commit_lint_update(0, line_count, line_count);
+		commit_find_scissors(0);
+	}
+	display_invalidate();
+}
+
+/*
+ * Syntax highlighting
+ *
+ * Each syntax is a table of lexer rules. The lexer is a state machine:
+ * at each position, the first rule for the current state that matches
+ * gives the style of the matched bytes and the next state. Only the state
+ * at the start of each line is cached, in the LINE_LEX_STATE bits of the
+ * line flags, so a line can be lexed on its own when it is drawn. Long
+ * lines also cache the state at their column marks, so that only the part
+ * in view is lexed when lines do not wrap.
+ *
+ * The cache is filled lazily, up to the last line drawn. After an edit,
+ * lines are relexed from the edit on until the state at the start of a
+ * line matches the cached one again, since the states from there on are
+ * unchanged. The lexing done per redisplay is thus bounded by the
+ * visible lines and the extent of the edit.
+ */
+
+/* How a lexer rule matches */
+enum lex_match {
+	LEX_END,          /* End of the rule table */
+	LEX_TEXT,         /* The string 'arg' */
+	LEX_SPAN,         /* One or more bytes not in 'arg' */
+	LEX_ESCAPE,       /* A backslash and the next byte */
+	LEX_REST,         /* The rest of the line, if it starts with 'arg' */
+	LEX_NUMBER,       /* A decimal number */
+	LEX_WORD,         /* One of the space-separated words in 'arg' */
+	LEX_SIGIL,        /* A byte in 'arg' followed by a name, like &anchor */
+	LEX_VARIABLE,     /* A shell parameter: $name, ${name}, $1 or $? */
+	LEX_QUOTED_KEY,   /* A quoted mapping key followed by ':' */
+	LEX_PLAIN_KEY     /* An unquoted mapping key followed by ': ' */
+};
+
+#define LEX_TOKEN_START 0x01   /* Only at the start of a token */
+#define LEX_LINE_START  0x02   /* Only at the start of a line */
+
+struct lex_rule {
+	unsigned char state;   /* State in which the rule applies */
+	unsigned char match;   /* LEX_* match type */
+	unsigned char flags;   /* LEX_TOKEN_START, LEX_LINE_START */
+	unsigned char style;   /* Style of the matched bytes */
+	unsigned char next;    /* State after the match */
+	const char *arg;
+};
+
+struct syntax {
+	const char *name;
+	const char *names;                 /* Extensions and interpreters, space-separated */
+	const struct lex_rule *rules;
+	const unsigned char *state_styles; /* Style of bytes no rule matches, by state */
+	const unsigned char *eol_states;   /* State at the start of the next line, by state */
+};
+
+enum { JSON_NORMAL, JSON_STRING };
+
+static const struct lex_rule json_rules[] = {
+	{ JSON_NORMAL, LEX_QUOTED_KEY, 0, STYLE_KEY, JSON_NORMAL, NULL },
+	{ JSON_NORMAL, LEX_TEXT, 0, STYLE_STRING, JSON_STRING, "\"" },
+	{ JSON_NORMAL, LEX_NUMBER, 0, STYLE_NUMBER, JSON_NORMAL, NULL },
+	{ JSON_NORMAL, LEX_WORD, 0, STYLE_KEYWORD, JSON_NORMAL, "true false null" },
+	{ JSON_STRING, LEX_ESCAPE, 0, STYLE_STRING, JSON_STRING, NULL },
+	{ JSON_STRING, LEX_TEXT, 0, STYLE_STRING, JSON_NORMAL, "\"" },
+	{ JSON_STRING, LEX_SPAN, 0, STYLE_STRING, JSON_STRING, "\"\\" },
+	{ 0, LEX_END, 0, 0, 0, NULL }
+};
+static const unsigned char json_styles[] = { STYLE_NORMAL, STYLE_STRING };
+static const unsigned char json_eol[] = { JSON_NORMAL, JSON_NORMAL };
+
+enum { YAML_NORMAL, YAML_DOUBLE, YAML_SINGLE };
+
+static const struct lex_rule yaml_rules[] = {
+	{ YAML_NORMAL, LEX_REST, LEX_TOKEN_START, STYLE_COMMENT, YAML_NORMAL, "#" },
+	{ YAML_NORMAL, LEX_TEXT, LEX_LINE_START, STYLE_KEYWORD, YAML_NORMAL, "---" },
+	{ YAML_NORMAL, LEX_TEXT, LEX_LINE_START, STYLE_KEYWORD, YAML_NORMAL, "..." },
+	{ YAML_NORMAL, LEX_QUOTED_KEY, LEX_TOKEN_START, STYLE_KEY, YAML_NORMAL, NULL },
+	{ YAML_NORMAL, LEX_PLAIN_KEY, LEX_TOKEN_START, STYLE_KEY, YAML_NORMAL, NULL },
+	{ YAML_NORMAL, LEX_TEXT, LEX_TOKEN_START, STYLE_STRING, YAML_DOUBLE, "\"" },
+	{ YAML_NORMAL, LEX_TEXT, LEX_TOKEN_START, STYLE_STRING, YAML_SINGLE, "'" },
+	{ YAML_NORMAL, LEX_NUMBER, LEX_TOKEN_START, STYLE_NUMBER, YAML_NORMAL, NULL },
+	{ YAML_NORMAL, LEX_WORD, LEX_TOKEN_START, STYLE_KEYWORD, YAML_NORMAL,
+	  "true false null yes no on off True False Null TRUE FALSE NULL" },
+	{ YAML_NORMAL, LEX_SIGIL, LEX_TOKEN_START, STYLE_VARIABLE, YAML_NORMAL, "&*" },
+	{ YAML_NORMAL, LEX_SIGIL, LEX_TOKEN_START, STYLE_KEYWORD, YAML_NORMAL, "!" },
+	{ YAML_DOUBLE, LEX_ESCAPE, 0, STYLE_STRING, YAML_DOUBLE, NULL },
+	{ YAML_DOUBLE, LEX_TEXT, 0, STYLE_STRING, YAML_NORMAL, "\"" },
+	{ YAML_DOUBLE, LEX_SPAN, 0, STYLE_STRING, YAML_DOUBLE, "\"\\" },
+	{ YAML_SINGLE, LEX_TEXT, 0, STYLE_STRING, YAML_SINGLE, "''" },
+	{ YAML_SINGLE, LEX_TEXT, 0, STYLE_STRING, YAML_NORMAL, "'" },
+	{ YAML_SINGLE, LEX_SPAN, 0, STYLE_STRING, YAML_SINGLE, "'" },
+	{ 0, LEX_END, 0, 0, 0, NULL }
+};
+static const unsigned char yaml_styles[] = { STYLE_NORMAL, STYLE_STRING, STYLE_STRING };
+static const unsigned char yaml_eol[] = { YAML_NORMAL, YAML_DOUBLE, YAML_SINGLE };
+
+enum { SH_NORMAL, SH_DOUBLE, SH_SINGLE };
+
+static const struct lex_rule sh_rules[] = {
+	{ SH_NORMAL, LEX_REST, LEX_TOKEN_START, STYLE_COMMENT, SH_NORMAL, "#" },
+	{ SH_NORMAL, LEX_ESCAPE, 0, STYLE_NORMAL, SH_NORMAL, NULL },
+	{ SH_NORMAL, LEX_TEXT, 0, STYLE_STRING, SH_SINGLE, "'" },
+	{ SH_NORMAL, LEX_TEXT, 0, STYLE_STRING, SH_DOUBLE, "\"" },
+	{ SH_NORMAL, LEX_VARIABLE, 0, STYLE_VARIABLE, SH_NORMAL, NULL },
+	{ SH_NORMAL, LEX_WORD, 0, STYLE_KEYWORD, SH_NORMAL,
+	  "if then else elif fi for while until do done case esac in function select "
+	  "time return local export readonly declare break continue exit" },
+	{ SH_DOUBLE, LEX_ESCAPE, 0, STYLE_STRING, SH_DOUBLE, NULL },
+	{ SH_DOUBLE, LEX_VARIABLE, 0, STYLE_VARIABLE, SH_DOUBLE, NULL },
+	{ SH_DOUBLE, LEX_TEXT, 0, STYLE_STRING, SH_NORMAL, "\"" },
+	{ SH_DOUBLE, LEX_SPAN, 0, STYLE_STRING, SH_DOUBLE, "\"\\$" },
+	{ SH_SINGLE, LEX_TEXT, 0, STYLE_STRING, SH_NORMAL, "'" },
+	{ SH_SINGLE, LEX_SPAN, 0, STYLE_STRING, SH_SINGLE, "'" },
+	{ 0, LEX_END, 0, 0, 0, NULL }
+};
+static const unsigned char sh_styles[] = { STYLE_NORMAL, STYLE_STRING, STYLE_STRING };
+static const unsigned char sh_eol[] = { SH_NORMAL, SH_DOUBLE, SH_SINGLE };
+
+static const struct syntax syntaxes[] = {
+	{ "json", "json", json_rules, json_styles, json_eol },
+	{ "yaml", "yaml yml", yaml_rules, yaml_styles, yaml_eol },
+	{ "sh", "sh bash zsh ksh dash", sh_rules, sh_styles, sh_eol }
+};
+#define NSYNTAXES (sizeof(syntaxes) / sizeof(syntaxes[0]))
+
+static const struct syntax *current_syntax = NULL;
+static int lex_valid_lines = 0;   /* Lines whose cached start state is known to be right */
+static int lex_lexed_lines = 0;   /* Lines whose cached start state was computed at some point */
+static int lex_settled_from = 0;  /* First line after the last change not yet relexed */
+
+#define LINE_LEX_STATE(line) (line_flags[line] >> LINE_LEX_STATE_SHIFT)
+
+static int
+is_word_byte(unsigned char c)
+{
+	return isalnum(c) || c == '_';
+}
+
+/* Whether 'word' is one of the space-separated words in 'list' */
+static int
+word_in_list(const char *word, int len, const char *list)
+{
+	const char *p = list;
+
+	while (*p) {
+		int n = strcspn(p, " ");
+		if (n == len && memcmp(p, word, len) == 0) {
+			return 1;
+		}
+		p += n;
+		p += strspn(p, " ");
+	}
+	return 0;
+}
+
+/* Length of a quoted string starting at text[pos], or 0 if it is not closed */
+static int
+quoted_length(const char *text, int len, int pos)
+{
+	char quote = text[pos];
+
+	for (int i = pos + 1; i < len; i++) {
+		if (text[i] == '\\' && quote == '"') {
+			i++;
+		} else if (text[i] == quote) {
+			return i + 1 - pos;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Return the number of bytes 'rule' matches at text[pos], or 0. A span
+ * stops at 'limit': a span can be split anywhere, as the rules that end it
+ * match at the bytes it stops at. Raises *reach to the offset past the
+ * last byte looked at.
+ */
+static int
+lex_match(const struct lex_rule *rule, const char *text, int len, int pos, int limit, int *reach)
+{
+	const char *p = text + pos;
+	int left = len - pos;
+	int n = 0;
+	int match = 0;
+	int seen = 1;   /* Bytes looked at */
+
+	switch (rule->match) {
+	case LEX_TEXT:
+		n = strlen(rule->arg);
+		match = (n <= left && memcmp(p, rule->arg, n) == 0) ? n : 0;
+		seen = n;
+		break;
+	case LEX_SPAN:
+		while (n < limit - pos && !memchr(rule->arg, p[n], strlen(rule->arg))) {
+			n++;
+		}
+		match = n;
+		seen = n + 1;
+		break;
+	case LEX_ESCAPE:
+		match = p[0] == '\\' ? (left > 1 ? 2 : 1) : 0;
+		seen = 2;
+		break;
+	case LEX_REST:
+		n = rule->arg ? strlen(rule->arg) : 0;
+		match = (n <= left && memcmp(p, rule->arg, n) == 0) ? left : 0;
+		seen = n;
+		break;
+	case LEX_NUMBER:
+		if (n < left && p[n] == '-') {
+			n++;
+		}
+		if (n == left || !isdigit((unsigned char)p[n])) {
+			seen = n + 1;
+			break;
+		}
+		while (n < left && isdigit((unsigned char)p[n])) {
+			n++;
+		}
+		if (n + 1 < left && p[n] == '.' && isdigit((unsigned char)p[n + 1])) {
+			for (n++; n < left && isdigit((unsigned char)p[n]); n++) {
+			}
+		}
+		seen = n + 2;
+		if (n + 1 < left && (p[n] == 'e' || p[n] == 'E')) {
+			int e = n + 1;
+			if (e < left && (p[e] == '+' || p[e] == '-')) {
+				e++;
+			}
+			seen = e + 1;
+			if (e < left && isdigit((unsigned char)p[e])) {
+				for (n = e; n < left && isdigit((unsigned char)p[n]); n++) {
+				}
+				seen = n + 1;
+			}
+		}
+		match = (n < left && (is_word_byte(p[n]) || p[n] == '.')) ? 0 : n;
+		break;
+	case LEX_WORD:
+		while (n < left && is_word_byte(p[n])) {
+			n++;
+		}
+		match = (n > 0 && word_in_list(p, n, rule->arg)) ? n : 0;
+		seen = n + 1;
+		break;
+	case LEX_SIGIL:
+		if (!memchr(rule->arg, p[0], strlen(rule->arg))) {
+			break;
+		}
+		for (n = 1; n < left && !memchr(" \t,[]{}", p[n], 7); n++) {
+		}
+		match = n > 1 ? n : 0;
+		seen = n + 1;
+		break;
+	case LEX_VARIABLE:
+		seen = 2;
+		if (p[0] != '$' || left < 2) {
+			break;
+		}
+		if (p[1] == '{') {
+			const char *close = memchr(p, '}', left);
+			match = seen = close ? close + 1 - p : left;
+		} else if (strchr("?#@*!$-", p[1]) || isdigit((unsigned char)p[1])) {
+			match = 2;
+		} else {
+			for (n = 1; n < left && is_word_byte(p[n]); n++) {
+			}
+			match = n > 1 ? n : 0;
+			seen = n + 1;
+		}
+		break;
+	case LEX_QUOTED_KEY:
+		if (p[0] != '"' && p[0] != '\'') {
+			break;
+		}
+		n = quoted_length(text, len, pos);
+		seen = left;
+		if (n == 0) {
+			break;
+		}
+		for (int i = n; i < left; i++) {
+			seen = i + 1;
+			if (p[i] == ':') {
+				match = n;
+				break;
+			} else if (p[i] != ' ' && p[i] != '\t') {
+				break;
+			}
+		}
+		break;
+	case LEX_PLAIN_KEY:
+		if (strchr(" \t\"'{}[],#&*!|>%@`", p[0])) {
+			break;
+		}
+		while (n < left && p[n] != ':' && !(p[n] == '#' && (p[n - 1] == ' ' || p[n - 1] == '\t'))) {
+			n++;
+		}
+		seen = n + 2;
+		if (n == left || p[n] != ':' || (n + 1 < left && p[n + 1] != ' ' && p[n + 1] != '\t')) {
+			break;
+		}
+		while (n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\t')) {
+			n--;
+		}
+		match = n;
+		break;
+	}
+	if (pos + seen > *reach) {
+		*reach = pos + seen;
+	}
+	return match;
+}
+
+/*
+ * Lex the token at text[pos] of a line of 'len' bytes in 'state', with
+ * spans stopping at 'limit'. Returns its length, and sets *style and
+ * *state to its style and the state after it.
+ */
+static int
+lex_token(const char *text, int len, int pos, int limit, int *state, int *style, int *reach)
+{
+	int token_start = pos == 0 || strchr(" \t,[{(;|&", text[pos - 1]);
+	int n = 0;
+
+	*style = current_syntax->state_styles[*state];
+	for (const struct lex_rule *rule = current_syntax->rules; rule->match != LEX_END; rule++) {
+		if (rule->state != *state ||
+			((rule->flags & LEX_TOKEN_START) && !token_start) ||
+			((rule->flags & LEX_LINE_START) && pos > 0)) {
+			continue;
+		}
+		n = lex_match(rule, text, len, pos, limit, reach);
+		if (n > 0) {
+			*style = rule->style;
+			*state = rule->next;
+			return n;
+		}
+	}
+
+	/* Skip a whole word, so that rules only match at word starts */
+	n = 1;
+	if (is_word_byte(text[pos])) {
+		while (pos + n < len && is_word_byte(text[pos + n])) {
+			n++;
+		}
+	}
+	if (pos + n + 1 > *reach) {
+		*reach = pos + n + 1;
+	}
+	return n;
+}
+
+/*
+ * Lex line 'line' from its cached start state up to offset 'to', storing
+ * the style of each byte from 'from' on in 'styles' if it is not NULL.
+ * Returns the state at 'to'. A long line is lexed from the column mark
+ * before 'from' whose lexer state is known, and the states at the marks
+ * passed on the way are recorded.
+ */
+static int
+lex_slice(int line, int from, int to, unsigned char *styles)
+{
+	struct line_span span = line_index_span(line);
+	const char *text = rl_line_buffer + span.start;
+	struct column_marks *marks = NULL;
+	int state = LINE_LEX_STATE(line);
+	int pos = 0;
+	int reach = 0;
+	int k = 0;   /* Next mark to pass */
+
+	if (span.len > COLUMN_MARK_STEP && !wrap_cache_failed) {
+		marks = wrap_cache[line].marks;
+	}
+	if (marks) {
+		if (marks->lex_syntax != current_syntax || marks->lex_state != state) {
+			marks->lex_syntax = current_syntax;
+			marks->lex_state = state;
+			marks->lexed = 0;
+		}
+		int lo = 0, hi = marks->lexed;
+		while (lo < hi) {
+			int mid = lo + (hi - lo) / 2;
+			if (marks->mark[mid].lex_off <= from) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo > 0) {
+			const struct column_mark *m = &marks->mark[lo - 1];
+			pos = m->lex_off;
+			state = m->lex_state;
+			reach = m->lex_reach;
+		}
+		k = lo;
+	}
+
+	while (pos < to) {
+		int limit = to;
+		if (marks) {
+			for (; k < marks->count && marks->mark[k].off <= pos; k++) {
+				if (k == marks->lexed) {
+					struct column_mark *m = &marks->mark[k];
+					m->lex_off = pos;
+					m->lex_state = state;
+					m->lex_reach = reach;
+					marks->lexed++;
+				}
+			}
+			if (k < marks->count && marks->mark[k].off < limit) {
+				limit = marks->mark[k].off;
+			}
+		}
+
+		int style;
+		int n = lex_token(text, span.len, pos, limit, &state, &style, &reach);
+		if (styles) {
+			memset(styles + pos, style, (pos + n < to ? pos + n : to) - pos);
+		}
+		pos += n;
+	}
+	return state;
+}
+
+/* Make sure the cached start state of 'line' is right */
+static void
+lex_update(int line)
+{
+	while (lex_valid_lines <= line) {
+		int prev = lex_valid_lines - 1;
+		int len = line_index_span(prev).len;
+		int state = current_syntax->eol_states[lex_slice(prev, len, len, NULL)];
+
+		/*
+		 * Past the changed lines, a line whose computed state matches the
+		 * one cached before the change starts an unchanged run of lines.
+		 */
+		if (lex_valid_lines >= lex_settled_from && lex_valid_lines < lex_lexed_lines &&
+			state == LINE_LEX_STATE(lex_valid_lines)) {
+			lex_valid_lines = lex_lexed_lines;
+			break;
+		}
+		line_flags[lex_valid_lines] = (line_flags[lex_valid_lines] & ~LINE_LEX_STATE_MASK) |
+			(state << LINE_LEX_STATE_SHIFT);
+		lex_valid_lines++;
+	}
+	if (lex_lexed_lines < lex_valid_lines) {
+		lex_lexed_lines = lex_valid_lines;
+	}
+	if (lex_valid_lines >= lex_settled_from) {
+		lex_settled_from = 0;
+	}
+}
+
+/* Update the lexer cache after lines first..first + old_count - 1 were replaced */
+static void
+lex_lines_changed(int first, int old_count, int new_count)
+{
+	if (lex_settled_from >= first + old_count) {
+		lex_settled_from += new_count - old_count;
+	}
+	/* The line after the change may now start in a different state */
+	if (lex_settled_from < first + new_count) {
+		lex_settled_from = first + new_count;
+	}
+	/* The states cached for the replaced lines are gone */
+	if (lex_lexed_lines >= first + old_count) {
+		lex_lexed_lines += new_count - old_count;
+	} else if (lex_lexed_lines > first + 1) {
+		lex_lexed_lines = first + 1;
+	}
+	if (lex_valid_lines > first + 1) {
+		lex_valid_lines = first + 1;
+	}
+	if (first == 0) {
+		line_flags[0] &= ~LINE_LEX_STATE_MASK;
+	}
+}
+
+static void bracket_index_truncate(int pos);
+
+static void
+set_syntax(const struct syntax *syntax)
+{
+	current_syntax = syntax;
+	lex_valid_lines = 1;
+	lex_lexed_lines = 1;
+	lex_settled_from = 0;
+	if (indexed_len >= 0) {
+		line_flags[0] &= ~LINE_LEX_STATE_MASK;
+	}
+	bracket_index_truncate(0);
+	display_invalidate();
+}
+
+static const struct syntax *
+find_syntax(const char *name, int len)
+{
+	for (size_t i = 0; i < NSYNTAXES; i++) {
+		if (word_in_list(name, len, syntaxes[i].names)) {
+			return &syntaxes[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Choose the syntax for a file from its extension, or from the
+ * interpreter named on its #! line
+ */
+static const struct syntax *
+detect_syntax(const char *path, const char *contents)
+{
+	if (path) {
+		const char *base = strrchr(path, '/');
+		const char *ext = strrchr(base ? base + 1 : path, '.');
+		if (ext && ext[1] != '\0') {
+			return find_syntax(ext + 1, strlen(ext + 1));
+		}
+	}
+	if (contents && strncmp(contents, "#!", 2) == 0) {
+		const char *p = contents + 2;
+		for (int i = 0; i < 2; i++) {
+			p += strspn(p, " \t");
+			int n = strcspn(p, " \t\n");
+			const char *name = p;
+			for (const char *s = p; s < p + n; s++) {
+				if (*s == '/') {
+					name = s + 1;
+				}
+			}
+			if (p + n - name == 3 && memcmp(name, "env", 3) == 0) {
+				/* #!/usr/bin/env bash */
+				p += n;
+				continue;
+			}
+			return find_syntax(name, p + n - name);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Bracket pair index
+ *
+ * The positions of the brackets in the buffer, each with the index of
+ * its partner and of the innermost open bracket around it. The index is
+ * built lazily, only as far into the buffer as needed, and an edit
+ * discards it from the changed line onward. Once a bracket is indexed,
+ * finding its partner is a binary search. With a syntax, brackets in
+ * strings and comments are left out; the lines they are on are lexed
+ * from the first bracket found on them.
+ */
+struct bracket {
+	int pos;      /* Offset in the buffer */
+	int match;    /* Index of the partner, or -1 if unknown or unmatched */
+	int parent;   /* Index of the innermost enclosing open bracket, or -1 */
+};
+
+static struct bracket *brackets = NULL;
+static int nbrackets = 0;
+static int brackets_size = 0;
+static int bracket_scanned = 0;   /* Bytes of the buffer indexed */
+static int bracket_open = -1;     /* Innermost bracket open at bracket_scanned, or -1 */
+static int bracket_highlight = 0; /* Whether to highlight the bracket pair at the cursor */
+static unsigned char *bracket_styles = NULL;   /* Styles of the line being indexed */
+static int bracket_styles_size = 0;
+
+static int
+is_open_bracket(char c)
+{
+	return c == '(' || c == '[' || c == '{';
+}
+
+static int
+is_close_bracket(char c)
+{
+	return c == ')' || c == ']' || c == '}';
+}
+
+/* The closing bracket of 'open' */
+static char
+closing_bracket(char open)
+{
+	return open == '(' ? ')' : open == '[' ? ']' : '}';
+}
+
+/* Discard the index from buffer offset 'pos' on */
+static void
+bracket_index_truncate(int pos)
+{
+	if (pos >= bracket_scanned) {
+		return;
+	}
+
+	int lo = 0, hi = nbrackets;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (brackets[mid].pos < pos) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	nbrackets = lo;
+	bracket_scanned = pos;
+
+	/* The brackets open at 'pos' lose their partners */
+	bracket_open = -1;
+	if (nbrackets > 0) {
+		const struct bracket *last = &brackets[nbrackets - 1];
+		bracket_open = is_open_bracket(rl_line_buffer[last->pos]) ? nbrackets - 1 : last->parent;
+	}
+	for (int i = bracket_open; i >= 0; i = brackets[i].parent) {
+		brackets[i].match = -1;
+	}
+}
+
+/*
+ * Index brackets until offset 'until' is passed and, if 'open' is not -1,
+ * until that open bracket is closed. Returns -1 on allocation failure.
+ */
+static int
+bracket_index_scan(int until, int open)
+{
+	const char *buf = rl_line_buffer;
+	int pos = bracket_scanned;
+	int styled_start = 0;   /* Offset of bracket_styles[0] in the buffer */
+	int styled_end = -1;    /* End of the styled part of the line */
+
+	for (; pos < rl_end; pos++) {
+		if (pos >= until && (open < 0 || brackets[open].match >= 0)) {
+			break;
+		}
+
+		char c = buf[pos];
+		if (!is_open_bracket(c) && !is_close_bracket(c)) {
+			continue;
+		}
+		if (current_syntax) {
+			if (pos >= styled_end) {
+				int line = line_index_find(pos);
+				struct line_span span = line_index_span(line);
+				if (span.len > bracket_styles_size) {
+					unsigned char *new_styles = realloc(bracket_styles, span.len);
+					if (!new_styles) {
+						perror("realloc");
+						bracket_scanned = pos;
+						return -1;
+					}
+					bracket_styles = new_styles;
+					bracket_styles_size = span.len;
+				}
+				lex_update(line);
+				lex_slice(line, pos - span.start, span.len, bracket_styles);
+				styled_start = span.start;
+				styled_end = span.start + span.len;
+			}
+			int style = bracket_styles[pos - styled_start];
+			if (style == STYLE_STRING || style == STYLE_COMMENT) {
+				continue;
+			}
+		}
+		if (nbrackets == brackets_size) {
+			int new_size = brackets_size ? brackets_size * 2 : 1024;
+			struct bracket *new_brackets = realloc(brackets, new_size * sizeof(*new_brackets));
+			if (!new_brackets) {
+				perror("realloc");
+				bracket_scanned = pos;
+				return -1;
+			}
+			brackets = new_brackets;
+			brackets_size = new_size;
+		}
+
+		struct bracket *b = &brackets[nbrackets];
+		b->pos = pos;
+		b->match = -1;
+		b->parent = bracket_open;
+		if (is_open_bracket(c)) {
+			bracket_open = nbrackets;
+		} else if (bracket_open >= 0 && c == closing_bracket(buf[brackets[bracket_open].pos])) {
+			/* A mismatched closing bracket is left unmatched */
+			b->match = bracket_open;
+			b->parent = brackets[bracket_open].parent;
+			brackets[bracket_open].match = nbrackets;
+			bracket_open = b->parent;
+		}
+		nbrackets++;
+	}
+	bracket_scanned = pos;
+	return 0;
+}
+
+/* Return the index of the bracket at buffer offset 'pos', or -1 */
+static int
+bracket_at(int pos)
+{
+	if (pos < 0 || pos >= rl_end) {
+		return -1;
+	}
+	if (pos >= bracket_scanned && bracket_index_scan(pos + 1, -1) != 0) {
+		return -1;
+	}
+
+	int lo = 0, hi = nbrackets;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (brackets[mid].pos < pos) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo < nbrackets && brackets[lo].pos == pos) ? lo : -1;
+}
+
+/* Return the partner of bracket 'i', or -1 if it has none */
+static int
+bracket_partner(int i)
+{
+	if (brackets[i].match < 0 && is_open_bracket(rl_line_buffer[brackets[i].pos])) {
+		if (bracket_index_scan(bracket_scanned, i) != 0) {
+			return -1;
+		}
+	}
+	return brackets[i].match;
+}
+
+/*
+ * Diff against the original text
+ *
+ * The buffer is compared line by line with file_contents, the text jot
+ * started with. diff_match[] maps each line of the buffer to the original
+ * line it matches, or -1 if it was added or changed. Lines are compared
+ * by hash first, and a Myers diff aligns them. After an edit, only the
+ * window between the nearest matched lines around the change is diffed
+ * again, so the cost of keeping the diff up to date depends on the size
+ * of the edited hunk, not of the file. The diff is only kept while the
+ * gutter is shown, once a diff was requested, or once progressive mode
+ * emitted lines.
+ */
+#define DIFF_MAX_EDITS 1000   /* Larger windows are shown as changed in full */
+#define DIFF_CONTEXT 3        /* Context lines around a hunk */
+
+static int diff_active = 0;
+static int diff_gutter = 0;       /* Whether to show the modified lines gutter */
+static int *diff_match = NULL;    /* Original line matched by each line, or -1 */
+static int diff_match_size = 0;
+static int orig_count = 0;        /* Lines in the original text */
+static int *orig_starts = NULL;   /* Offset of each original line in file_contents */
+static uint64_t *orig_hashes = NULL;
+
+/* Return the span of original line 'line' */
+static struct line_span
+orig_span(int line)
+{
+	struct line_span span;
+
+	span.start = orig_starts[line];
+	if (line + 1 < orig_count) {
+		span.len = orig_starts[line + 1] - 1 - span.start;
+	} else {
+		span.len = strlen(file_contents + span.start);
+	}
+	return span;
+}
+
+/* Split the original text into lines and hash them */
+static int
+diff_load_original(void)
+{
+	const char *text = file_contents ? file_contents : "";
+	int count = 1;
+
+	for (const char *p = text; (p = strchr(p, '\n')) != NULL; p++) {
+		count++;
+	}
+	orig_starts = malloc(count * sizeof(*orig_starts));
+	orig_hashes = malloc(count * sizeof(*orig_hashes));
+	if (!orig_starts || !orig_hashes) {
+		perror("malloc");
+		free(orig_starts);
+		free(orig_hashes);
+		orig_starts = NULL;
+		orig_hashes = NULL;
+		return -1;
+	}
+
+	const char *p = text;
+	for (orig_count = 0; orig_count < count; orig_count++) {
+		const char *nl = strchr(p, '\n');
+		int len = nl ? nl - p : (int)strlen(p);
+		orig_starts[orig_count] = p - text;
+		orig_hashes[orig_count] = hash_line(p, len);
+		p += len + 1;
+	}
+	return 0;
+}
+
+/* Whether original line 'a' and buffer line 'b' are equal */
+static int
+diff_lines_equal(int a, uint64_t b_hash, int b)
+{
+	if (orig_hashes[a] != b_hash) {
+		return 0;
+	}
+
+	struct line_span sa = orig_span(a);
+	struct line_span sb = line_index_span(b);
+	return sa.len == sb.len && memcmp(file_contents + sa.start, rl_line_buffer + sb.start, sa.len) == 0;
+}
+
+/*
+ * Align original lines a0..a0 + n - 1 with buffer lines b0..b0 + m - 1
+ * using Myers' algorithm, setting diff_match for the matched lines.
+ * 'hashes' holds the hashes of the buffer lines. Returns -1 if the lines
+ * differ in more than DIFF_MAX_EDITS places.
+ */
+static int
+diff_myers(int a0, int n, int b0, int m, const uint64_t *hashes)
+{
+	int max = n + m < DIFF_MAX_EDITS ? n + m : DIFF_MAX_EDITS;
+	/*
+	 * V for edit count d is stored at v + d * d, indexed by k + d. It is
+	 * grown as d goes up, so a window with few edits takes little memory
+	 * however many lines it has.
+	 */
+	int *v = NULL;
+	size_t v_size = 0;
+
+	int d, x = 0, y = 0;
+	for (d = 0; d <= max; d++) {
+		size_t need = (size_t)(d + 1) * (d + 1);
+		if (need > v_size) {
+			size_t new_size = v_size ? v_size * 2 : 256;
+			while (new_size < need) {
+				new_size *= 2;
+			}
+			int *new_v = realloc(v, new_size * sizeof(*new_v));
+			if (!new_v) {
+				perror("realloc");
+				free(v);
+				return -1;
+			}
+			v = new_v;
+			v_size = new_size;
+		}
+
+		int *vd = v + d * d;
+		int *vp = v + (d - 1) * (d - 1);
+		int done = 0;
+
+		for (int k = -d; k <= d; k += 2) {
+			if (d == 0) {
+				x = 0;
+			} else if (k == -d || (k != d && vp[k - 1 + d - 1] < vp[k + 1 + d - 1])) {
+				x = vp[k + 1 + d - 1];
+			} else {
+				x = vp[k - 1 + d - 1] + 1;
+			}
+			y = x - k;
+			while (x < n && y < m && diff_lines_equal(a0 + x, hashes[y], b0 + y)) {
+				x++;
+				y++;
+			}
+			vd[k + d] = x;
+			if (x >= n && y >= m) {
+				done = 1;
+				break;
+			}
+		}
+		if (done) {
+			break;
+		}
+	}
+	if (d > max) {
+		free(v);
+		return -1;
+	}
+
+	/* Walk back through the edits, recording the diagonals as matches */
+	for (; d >= 0; d--) {
+		int k = x - y;
+		int start_x = 0, start_y = 0;
+		int prev_x = 0, prev_y = 0;
+
+		if (d > 0) {
+			int *vp = v + (d - 1) * (d - 1);
+			int prev_k = (k == -d || (k != d && vp[k - 1 + d - 1] < vp[k + 1 + d - 1])) ? k + 1 : k - 1;
+			prev_x = vp[prev_k + d - 1];
+			prev_y = prev_x - prev_k;
+			start_x = prev_k == k + 1 ? prev_x : prev_x + 1;
+			start_y = start_x - k;
+		}
+		while (x > start_x && y > start_y) {
+			x--;
+			y--;
+			diff_match[b0 + y] = a0 + x;
+		}
+		x = prev_x;
+		y = prev_y;
+	}
+	free(v);
+	return 0;
+}
+
+/* Diff original lines a_lo..a_hi - 1 against buffer lines b_lo..b_hi - 1 */
+static void
+diff_window(int a_lo, int a_hi, int b_lo, int b_hi)
+{
+	for (int i = b_lo; i < b_hi; i++) {
+		diff_match[i] = -1;
+	}
+
+	/* Match the common leading and trailing lines directly */
+	while (a_lo < a_hi && b_lo < b_hi) {
+		struct line_span span = line_index_span(b_lo);
+		if (!diff_lines_equal(a_lo, hash_line(rl_line_buffer + span.start, span.len), b_lo)) {
+			break;
+		}
+		diff_match[b_lo++] = a_lo++;
+	}
+	while (a_lo < a_hi && b_lo < b_hi) {
+		struct line_span span = line_index_span(b_hi - 1);
+		if (!diff_lines_equal(a_hi - 1, hash_line(rl_line_buffer + span.start, span.len), b_hi - 1)) {
+			break;
+		}
+		diff_match[--b_hi] = --a_hi;
+	}
+	if (a_lo == a_hi || b_lo == b_hi) {
+		return;
+	}
+
+	uint64_t *hashes = malloc((b_hi - b_lo) * sizeof(*hashes));
+	if (!hashes) {
+		perror("malloc");
+		return;
+	}
+	for (int i = b_lo; i < b_hi; i++) {
+		struct line_span span = line_index_span(i);
+		hashes[i - b_lo] = hash_line(rl_line_buffer + span.start, span.len);
+	}
+	diff_myers(a_lo, a_hi - a_lo, b_lo, b_hi - b_lo, hashes);
+	free(hashes);
+}
+
+static int
+diff_reserve(int count)
+{
+	if (count <= diff_match_size) {
+		return 0;
+	}
+
+	int new_size = diff_match_size ? diff_match_size : 1024;
+	while (new_size < count) {
+		new_size *= 2;
+	}
+	int *new_match = realloc(diff_match, new_size * sizeof(*new_match));
+	if (!new_match) {
+		perror("realloc");
+		return -1;
+	}
+	diff_match = new_match;
+	diff_match_size = new_size;
+	return 0;
+}
+
+/* Start keeping the diff up to date. Returns -1 on failure. */
+static int
+diff_start(void)
+{
+	if (diff_active) {
+		return 0;
+	}
+	if (line_index_sync() != 0 || diff_reserve(line_count) != 0) {
+		return -1;
+	}
+	if (!orig_starts && diff_load_original() != 0) {
+		return -1;
+	}
+	diff_window(0, orig_count, 0, line_count);
+	diff_active = 1;
+	return 0;
+}
+
+/* Forget the original text, before file_contents is replaced */
+static void
+diff_reset(void)
+{
+	free(orig_starts);
+	free(orig_hashes);
+	orig_starts = NULL;
+	orig_hashes = NULL;
+	orig_count = 0;
+	diff_active = 0;
+}
+
+/* Update the diff after lines first..first + old_count - 1 were replaced */
+static void
+diff_lines_changed(int first, int old_count, int new_count)
+{
+	int old_total = line_count - new_count + old_count;
+
+	if (diff_reserve(line_count) != 0) {
+		diff_active = 0;
+		return;
+	}
+	if (new_count != old_count) {
+		memmove(&diff_match[first + new_count], &diff_match[first + old_count],
+				(old_total - first - old_count) * sizeof(*diff_match));
+	}
+
+	/* Rediff between the nearest matched lines around the change */
+	int before = first - 1;
+	while (before >= 0 && diff_match[before] < 0) {
+		before--;
+	}
+	int after = first + new_count;
+	while (after < line_count && diff_match[after] < 0) {
+		after++;
+	}
+	diff_window(before >= 0 ? diff_match[before] + 1 : 0,
+				after < line_count ? diff_match[after] : orig_count,
+				before + 1, after);
+}
+
+static int line_numbers = 0;      /* Whether to show line numbers in the gutter */
+static int status_line = 0;       /* Whether to show the status line below the text */
+
+/* Digits of the line numbers: enough for the last line, and at least 3 */
+static int
+line_number_width(void)
+{
+	int width = 3;
+
+	for (long n = 1000; n <= line_count; n *= 10) {
+		width++;
+	}
+	return width;
+}
+
+/* Width of the gutter left of the text */
+static int
+gutter_width(void)
+{
+	return (line_numbers ? line_number_width() + 1 : 0) + (diff_gutter ? 2 : 0);
+}
+
+/*
+ * Append the gutter of row 'row' of line 'line' to 'tb': the line number
+ * on its first row, then '+' for an added or changed line, and '-' for a
+ * line that follows deleted lines
+ */
+static void
+gutter_append(struct textbuf *tb, int line, int row)
+{
+	int mark = ' ';
+	int style = STYLE_NORMAL;
+
+	if (line_numbers) {
+		char number[16];
+		int width = line_number_width();
+		int len = row == 0 ? snprintf(number, sizeof(number), "%*d ", width, line + 1)
+						   : snprintf(number, sizeof(number), "%*s ", width, "");
+		textbuf_puts(tb, style_sgr[STYLE_LINE_NUMBER]);
+		textbuf_append(tb, number, len);
+		textbuf_puts(tb, style_sgr[STYLE_NORMAL]);
+	}
+
+	if (diff_gutter && diff_active && row == 0 && line < line_count) {
+		int prev = line > 0 ? diff_match[line - 1] : -1;
+		if (diff_match[line] < 0) {
+			mark = '+';
+			style = STYLE_ADDED;
+		} else if ((line == 0 || prev >= 0) && diff_match[line] > prev + 1) {
+			mark = '-';
+			style = STYLE_REMOVED;
+		}
+	}
+	if (diff_gutter) {
+		char text[2] = { mark, ' ' };
+		if (style != STYLE_NORMAL) {
+			textbuf_puts(tb, style_sgr[style]);
+		}
+		textbuf_append(tb, text, 1);
+		if (style != STYLE_NORMAL) {
+			textbuf_puts(tb, style_sgr[STYLE_NORMAL]);
+		}
+		textbuf_append(tb, text + 1, 1);
+	}
+}
+
+/*
+ * Called by the line index after lines first..first + old_count - 1 were
+ * replaced. The text before offset 'pos' did not change.
+ */
+static void
+line_index_changed(int first, int old_count, int new_count, int pos)
+{
+	if (commit_mode) {
+		commit_lint_update(first, old_count, new_count);
+	}
+	if (current_syntax) {
+		lex_lines_changed(first, old_count, new_count);
+	}
+	bracket_index_truncate(line_start(first));
+	wrap_lines_changed(first, old_count, new_count, pos);
+	if (nfolds) {
+		fold_lines_changed(first, old_count, new_count);
+	}
+	if (diff_active) {
+		diff_lines_changed(first, old_count, new_count);
+	}
+	if (display.top_line >= first + old_count) {
+		display.top_line += new_count - old_count;
+	} else if (display.top_line >= first) {
+		display.top_line = first;
+		display.top_row = 0;
+	}
+}
+
+/* Set the style of the bytes from 'start' to 'end' that lie between 'from' and 'to' */
+static void
+style_range(unsigned char *styles, int start, int end, int style, int from, int to)
+{
+	if (start < from) {
+		start = from;
+	}
+	if (end > to) {
+		end = to;
+	}
+	if (start < end) {
+		memset(styles + start, style, end - start);
+	}
+}
+
+/* Style the bytes from 'from' to 'to' of a line of a commit message */
+static void
+commit_decorate_line(int line, struct line_span span, int from, int to, unsigned char *styles, const int **rulers)
+{
+	static const int subject_rulers[] = { COMMIT_SUBJECT_WIDTH, COMMIT_BODY_WIDTH, -1 };
+	const char *text = rl_line_buffer + span.start;
+	int whole = STYLE_NORMAL;
+
+	if (scissors_line >= 0 && line >= scissors_line) {
+		whole = STYLE_IGNORED;
+	} else if (line_flags[line] & LINE_COMMIT_COMMENT) {
+		whole = STYLE_COMMENT;
+	} else if (line == 1 && span.len != 0) {
+		whole = STYLE_ERROR;   /* The subject must be followed by a blank line */
+	}
+	style_range(styles, 0, span.len, whole, from, to);
+	if (whole != STYLE_NORMAL) {
+		return;
+	}
+
+	if (line == 0) {
+		int col = 0;
+		int warn = scan_columns(text, span.len, COMMIT_SUBJECT_WIDTH, &col);
+		int err = warn + scan_columns(text + warn, span.len - warn, COMMIT_BODY_WIDTH, &col);
+		style_range(styles, warn, err, STYLE_WARNING, from, to);
+		style_range(styles, err, span.len, STYLE_ERROR, from, to);
+		*rulers = subject_rulers;
+	} else if (line_flags[line] & LINE_COMMIT_OVERLONG) {
+		int col = 0;
+		int err = scan_columns(text, span.len, COMMIT_BODY_WIDTH, &col);
+		style_range(styles, err, span.len, STYLE_ERROR, from, to);
+	}
+}
+
+/*
+ * Compute the styles of the bytes of a line from 'from' to 'to' for the
+ * current modes. Returns the styles array, indexed by offset in the line,
+ * or NULL if the line is unstyled, and sets *rulers to the ruler columns
+ * to draw, if any.
+ */
+static const unsigned char *
+decorate_line(int line, int from, int to, const int **rulers)
+{
+	static unsigned char *styles = NULL;
+	static int styles_size = 0;
+	struct line_span span = line_index_span(line);
+	int matches = 0;
+
+	for (int i = 0; i < 2; i++) {
+		if (display.match[i] >= span.start && display.match[i] < span.start + span.len) {
+			matches++;
+		}
+	}
+
+	*rulers = NULL;
+	if (!commit_mode && !current_syntax && !matches) {
+		return NULL;
+	}
+
+	if (span.len + 1 > styles_size) {
+		unsigned char *new_styles = realloc(styles, span.len + 1);
+		if (!new_styles) {
+			return NULL;
+		}
+		styles = new_styles;
+		styles_size = span.len + 1;
+	}
+
+	if (commit_mode) {
+		commit_decorate_line(line, span, from, to, styles, rulers);
+	} else if (current_syntax) {
+		lex_update(line);
+		lex_slice(line, from, to, styles);
+	} else {
+		memset(styles + from, STYLE_NORMAL, to - from);
+	}
+
+	for (int i = 0; i < 2 && matches; i++) {
+		if (display.match[i] >= span.start && display.match[i] < span.start + span.len) {
+			styles[display.match[i] - span.start] = STYLE_MATCH;
+		}
+	}
+	return styles;
+}
+
+/* Make sure the row cache holds 'rows' entries */
+static int
+display_reserve_rows(int rows)
+{
+	if (rows <= display.row_hash_size) {
+		return 0;
+	}
+	uint64_t *new_hash = realloc(display.row_hash, rows * sizeof(*new_hash));
+	if (!new_hash) {
+		return -1;
+	}
+	memset(new_hash + display.row_hash_size, 0, (rows - display.row_hash_size) * sizeof(*new_hash));
+	display.row_hash = new_hash;
+
+	new_hash = realloc(display.gutter_hash, rows * sizeof(*new_hash));
+	if (!new_hash) {
+		return -1;
+	}
+	memset(new_hash + display.row_hash_size, 0, (rows - display.row_hash_size) * sizeof(*new_hash));
+	display.gutter_hash = new_hash;
+	display.row_hash_size = rows;
+	return 0;
+}
+
+/*
+ * Choose the first line and row shown so that the cursor, at row
+ * point_row of line point_line, is within an area of 'height' rows, and
+ * the area is full if the buffer is long enough.
+ */
+static void
+display_scroll(int point_line, int point_row, int height, int cols)
+{
+	if (display.top_line >= line_count) {
+		display.top_line = line_count - 1;
+		display.top_row = 0;
+	}
+	display.top_line = fold_visible_line(display.top_line);
+	if (display.top_row >= line_rows(display.top_line, cols)) {
+		display.top_row = 0;
+	}
+
+	if (point_line < display.top_line ||
+		(point_line == display.top_line && point_row < display.top_row)) {
+		display.top_line = point_line;
+		display.top_row = point_row;
+	} else {
+		/* Count the rows from the top to the cursor, up to the area height */
+		int rows = -display.top_row;
+		for (int line = display.top_line; line < point_line && rows < height; line = fold_next_line(line)) {
+			rows += line_rows(line, cols);
+		}
+		if (rows + point_row >= height) {
+			/* Put the cursor on the last row */
+			int line = point_line, row = point_row;
+			for (int left = height - 1; left > 0; left--) {
+				if (row > 0) {
+					row--;
+				} else if (line > 0) {
+					line = fold_prev_line(line);
+					row = line_rows(line, cols) - 1;
+				} else {
+					break;
+				}
+			}
+			display.top_line = line;
+			display.top_row = row;
+		}
+	}
+
+	/* Fill the area if the end of the buffer is in view */
+	int rows = -display.top_row;
+	for (int line = display.top_line; line < line_count && rows < height; line = fold_next_line(line)) {
+		rows += line_rows(line, cols);
+	}
+	while (rows < height && (display.top_line > 0 || display.top_row > 0)) {
+		if (display.top_row > 0) {
+			display.top_row--;
+		} else {
+			display.top_line = fold_prev_line(display.top_line);
+			display.top_row = line_rows(display.top_line, cols) - 1;
+		}
+		rows++;
+	}
+}
+
+/*
+ * Get the terminal size. Readline treats the terminal as dumb when the
+ * application supplies its own redisplay function, so ask the terminal.
+ */
+static void
+display_get_size(int *rows, int *cols)
+{
+	if (tty_get_size(rows, cols) != 0) {
+		rl_get_screen_size(rows, cols);
+		if (*rows < 1) {
+			*rows = 24;
+		}
+		if (*cols < 1) {
+			*cols = 80;
+		}
+	}
+}
+
+/*
+ * Count the rows from row 'row' of 'line' down to row 'end_row' of
+ * 'end_line', or return 'limit' if there are at least that many
+ */
+static int
+display_rows_between(int line, int row, int end_line, int end_row, int cols, int limit)
+{
+	int rows = -row;
+
+	while (line < end_line && rows < limit) {
+		rows += line_rows(line, cols);
+		line = fold_next_line(line);
+	}
+	if (line != end_line || rows + end_row >= limit) {
+		return limit;
+	}
+	return rows + end_row;
+}
+
+/*
+ * Move what rows first..first+count-1 of the area show up by 'shift'
+ * rows, or down if it is negative, so that only the rows scrolled into
+ * view are drawn. The area must fill the screen, since a scrolling
+ * region is given in screen rows.
+ */
+static void
+display_shift_rows(int first, int count, int shift, int screen_rows)
+{
+	int n = shift > 0 ? shift : -shift;
+	int region = first > 0 || first + count < screen_rows;
+
+	if (region) {
+		/* Setting the region moves the cursor to the top of the screen */
+		frame_printf("\033[%d;", first + 1);
+		frame_printf("%dr", first + count);
+		display.cursor_row = 0;
+	}
+	frame_goto_row(first);
+	frame_printf(shift > 0 ? "\033[%dM" : "\033[%dL", n);
+	if (region) {
+		frame_puts("\033[r");
+		display.cursor_row = 0;
+	}
+
+	uint64_t *hashes[2] = { display.row_hash + first, display.gutter_hash + first };
+	for (int i = 0; i < 2; i++) {
+		uint64_t *hash = hashes[i];
+		if (shift > 0) {
+			memmove(hash, hash + n, (count - n) * sizeof(*hash));
+			memset(hash + count - n, 0, n * sizeof(*hash));
+		} else {
+			memmove(hash + n, hash, (count - n) * sizeof(*hash));
+			memset(hash, 0, n * sizeof(*hash));
+		}
+	}
+}
+
+/* Width of the gutter on a screen 'screen_cols' wide, if there is room for it */
+static int
+display_gutter(int screen_cols)
+{
+	int gutter = gutter_width();
+
+	return gutter < screen_cols ? gutter : 0;
+}
+
+/* Grow the area downwards to 'height' rows, scrolling the terminal if needed */
+static void
+display_grow(int height)
+{
+	if (height > display.rows) {
+		frame_goto_row(display.rows - 1);
+		for (int row = display.rows; row < height; row++) {
+			frame_puts("\n");
+			display.row_hash[row] = 0;
+		}
+		display.cursor_row = height - 1;
+		display.rows = height;
+	}
+}
+
+/*
+ * Draw the status line in row 'row', if it changed: the line and column
+ * of the cursor, its offset, the size of the buffer, and "[+]" if the
+ * text was modified. The line comes from the line index and the column
+ * from the column marks, so the cost does not grow with the buffer.
+ */
+static void
+display_status(int row, int screen_cols, int point)
+{
+	char text[128];
+	int line = line_index_find(point);
+	int col;
+
+	column_seek(line, point - line_start(line), INT_MAX, &col);
+	int len = snprintf(text, sizeof(text), " %d:%d  byte %d/%d%s", line + 1, col + 1, point, rl_end,
+					   buffer_modified ? "  [+]" : "");
+	if (len >= (int)sizeof(text)) {
+		len = sizeof(text) - 1;
+	}
+	if (len > screen_cols) {
+		len = screen_cols;
+	}
+
+	uint64_t hash = hash_line(text, len) + screen_cols;
+	if (hash <= 1) {
+		hash += 2;
+	}
+	if (display.row_hash[row] != hash) {
+		frame_goto_row(row);
+		frame_puts(style_sgr[STYLE_STATUS]);
+		frame_append(text, len);
+		for (int x = len; x < screen_cols; x++) {
+			frame_append(" ", 1);
+		}
+		frame_puts(style_sgr[STYLE_NORMAL]);
+		display.row_hash[row] = hash;
+	}
+}
+
+/* Draw the buffer, changing only the rows that show something else */
+static void
+display_draw(void)
+{
+	int screen_rows, screen_cols;
+
+	display.deferred = 0;
+
+	if (line_index_sync() != 0) {
+		return;
+	}
+	display_get_size(&screen_rows, &screen_cols);
+	if (display_reserve_rows(screen_rows) != 0) {
+		return;
+	}
+
+	if (display.rows == 0) {
+		/* The first frame starts on the current terminal line */
+		display.rows = 1;
+		display.cursor_row = 0;
+		display.screen_cols = screen_cols;
+		display.row_hash[0] = 0;
+	} else if (screen_cols != display.screen_cols || screen_rows < display.rows) {
+		/*
+		 * The terminal reflowed or scrolled the old rows, so where the
+		 * area starts is not known: redraw it at the top of the screen
+		 */
+		frame_puts("\033[H\033[J");
+		display.rows = 1;
+		display.cursor_row = 0;
+		display.screen_cols = screen_cols;
+		display_invalidate();
+	}
+
+	/* The text is laid out in the columns right of the gutter */
+	int gutter = display_gutter(screen_cols);
+	int cols = screen_cols - gutter;
+
+	/* Find the cursor and the height of the area */
+	int point = rl_point < rl_end ? rl_point : rl_end;
+	int point_line = line_index_find(point);
+	int point_row = 0, point_x = 0;
+	int point_fold = nfolds ? fold_find(point_line) : -1;
+	if (!line_wrap && (point_fold < 0 || point_line == folds[point_fold].first)) {
+		/* Scroll sideways to keep the cursor in view, in the middle if it moved out */
+		int text_cols = point_fold < 0 ? cols : fold_text_cols(cols);
+		int point_col;
+		column_seek(point_line, point - line_start(point_line), INT_MAX, &point_col);
+		if (point_col < display.left_col || point_col >= display.left_col + text_cols) {
+			display.left_col = point_col > text_cols / 2 ? point_col - text_cols / 2 : 0;
+		}
+		point_x = point_col - display.left_col;
+	} else if (point_fold < 0) {
+		if (row_find(point_line, cols, point - line_start(point_line), &point_row, &point_x) != 0) {
+			layout_line(point_line, cols, point - line_start(point_line), &point_row, &point_x, NULL, NULL);
+		}
+	} else if (point_line == folds[point_fold].first) {
+		/* The cursor is on the row of the fold if it fits there */
+		layout_line(point_line, fold_text_cols(cols), point - line_start(point_line), &point_row, &point_x, NULL, NULL);
+		if (point_row > 0) {
+			point_row = point_x = 0;
+		}
+	} else {
+		point_line = folds[point_fold].first;
+	}
+
+	/* Find the bracket pair to highlight, at or just before the cursor */
+	display.match[0] = display.match[1] = -1;
+	if (bracket_highlight) {
+		int i = bracket_at(point);
+		if (i < 0) {
+			i = bracket_at(point - 1);
+		}
+		int partner = i >= 0 ? bracket_partner(i) : -1;
+		if (partner >= 0) {
+			display.match[0] = brackets[i].pos;
+			display.match[1] = brackets[partner].pos;
+		}
+	}
+
+	/* The text takes 'height' rows, and the status line the one below */
+	int status = status_line && screen_rows > 1;
+	int text_rows = screen_rows - status;
+	int height = text_rows;
+	if (line_count < text_rows) {
+		height = 0;
+		for (int line = 0; line < line_count && height < text_rows; line = fold_next_line(line)) {
+			height += line_rows(line, cols);
+		}
+		if (height > text_rows) {
+			height = text_rows;
+		}
+	}
+	int old_top_line = display.top_line, old_top_row = display.top_row;
+	display_scroll(point_line, point_row, height, cols);
+
+	/*
+	 * When the view scrolled by less than the area, move the rows that
+	 * stay in view with the terminal's own line insertion or deletion
+	 */
+	if (term_caps.insert_delete && height == text_rows && display.rows == screen_rows &&
+		display.status == status && (!status || term_caps.scroll_region) &&
+		old_top_line < line_count && fold_visible_line(old_top_line) == old_top_line &&
+		old_top_row < line_rows(old_top_line, cols)) {
+		int shift = 0;
+		if (old_top_line < display.top_line ||
+			(old_top_line == display.top_line && old_top_row < display.top_row)) {
+			shift = display_rows_between(old_top_line, old_top_row,
+				display.top_line, display.top_row, cols, height);
+		} else {
+			shift = -display_rows_between(display.top_line, display.top_row,
+				old_top_line, old_top_row, cols, height);
+		}
+		if (shift != 0 && shift != height && shift != -height) {
+			display_shift_rows(0, height, shift, screen_rows);
+		}
+	}
+
+	display_grow(height + status);
+
+	/* Draw the rows that changed */
+	int row = 0;
+	int cursor_area_row = -1;
+	for (int line = display.top_line; row < height; line = fold_next_line(line)) {
+		if (line >= line_count) {
+			/* Past the end of the buffer */
+			if (display.row_hash[row] != 1) {
+				frame_goto_row(row);
+				frame_puts("\033[K");
+				display.row_hash[row] = 1;
+			}
+			row++;
+			continue;
+		}
+
+		/* A fold shows the first row of its first line and a marker */
+		int fold = nfolds ? fold_find(line) : -1;
+		int text_cols = fold < 0 ? cols : fold_text_cols(cols);
+		int from = 0, to = line_index_span(line).len;
+		if (!line_wrap) {
+			slice_range(line, text_cols, display.left_col, &from, &to);
+		}
+		const int *rulers;
+		const unsigned char *styles = decorate_line(line, from, to, &rulers);
+		int first_row = (line == display.top_line) ? display.top_row : 0;
+		int nrows = line_rows(line, cols) - first_row;
+		if (nrows > height - row) {
+			nrows = height - row;
+		}
+		if (line == point_line) {
+			cursor_area_row = row + point_row - first_row;
+		}
+
+		/* Lay the rows out, then draw those that changed */
+		size_t row_end[nrows];
+		int row_cells[nrows];
+		struct layout_out lo = {
+			&display.line_text, first_row, nrows, styles, rulers, row_end, row_cells, STYLE_NORMAL
+		};
+		display.line_text.len = 0;
+		if (line_wrap) {
+			layout_line(line, text_cols, -1, NULL, NULL, &lo, NULL);
+		} else {
+			layout_slice(line, text_cols, display.left_col, &lo);
+		}
+		if (fold >= 0 && text_cols < cols) {
+			char marker[32];
+			int len = snprintf(marker, sizeof(marker), FOLD_MARKER, folds[fold].last - folds[fold].first);
+			textbuf_puts(&display.line_text, style_sgr[STYLE_FOLD]);
+			textbuf_append(&display.line_text, marker, len);
+			textbuf_puts(&display.line_text, style_sgr[STYLE_NORMAL]);
+			row_end[0] = display.line_text.len;
+			row_cells[0] += len;
+		}
+
+		for (int r = 0; r < nrows; r++, row++) {
+			const char *text = display.line_text.data + (r > 0 ? row_end[r - 1] : 0);
+			size_t len = row_end[r] - (r > 0 ? row_end[r - 1] : 0);
+			uint64_t hash = hash_line(text, len) + row_cells[r] + ((uint64_t)gutter << 32);
+			if (hash <= 1) {
+				hash += 2;
+			}
+
+			/* When only the gutter changed, such as a line number, only it is drawn */
+			uint64_t gutter_hash = 0;
+			display.gutter_text.len = 0;
+			if (gutter) {
+				gutter_append(&display.gutter_text, line, first_row + r);
+				gutter_hash = hash_line(display.gutter_text.data, display.gutter_text.len) | 1;
+			}
+			if (display.row_hash[row] != hash) {
+				frame_goto_row(row);
+				frame_append(display.gutter_text.data, display.gutter_text.len);
+				frame_append(text, len);
+				if (gutter + row_cells[r] < screen_cols) {
+					frame_puts("\033[K");
+				}
+				display.row_hash[row] = hash;
+				display.gutter_hash[row] = gutter_hash;
+			} else if (display.gutter_hash[row] != gutter_hash) {
+				frame_goto_row(row);
+				frame_append(display.gutter_text.data, display.gutter_text.len);
+				display.gutter_hash[row] = gutter_hash;
+			}
+		}
+	}
+
+	if (status) {
+		display_status(height, screen_cols, point);
+	}
+	display.status = status;
+
+	/* Shrink the area if the buffer got shorter */
+	if (height + status < display.rows) {
+		frame_goto_row(height + status);
+		frame_puts("\033[J");
+		display.rows = height + status;
+		display.cursor_row = height + status;
+	}
+
+	/* Place the cursor */
+	if (cursor_area_row < 0 || cursor_area_row >= height) {
+		cursor_area_row = height - 1;
+	}
+	frame_goto_row(cursor_area_row);
+	if (gutter + point_x > 0) {
+		frame_printf("\033[%dC", gutter + point_x);
+	}
+	/* tty_getc() writes the frame when jot waits for the next key */
+}
+
+/* Redisplay function that replaces rl_redisplay() */
+static void
+jot_redisplay(void)
+{
+	/*
+	 * Keys are handled at full speed while the terminal is behind: their
+	 * frames are skipped, and tty_getc() draws the last one
+	 */
+	if (display.rows > 0 && !display.paging && frame_link_behind(NULL)) {
+		/* The index still follows each change, as Readline reuses freed undo entries */
+		line_index_sync();
+		display.deferred = 1;
+		frame_stats.skipped++;
+		return;
+	}
+	display_draw();
+}
+
+/*
+ * Move to the bracket matching the one at the cursor, or the first
+ * bracket after the cursor on the current line
+ */
+static int
+jot_match_bracket(int count, int key)
+{
+	if (line_index_sync() != 0) {
+		rl_ding();
+		return 0;
+	}
+
+	int i = -1;
+	for (int pos = rl_point; pos < rl_end && rl_line_buffer[pos] != '\n'; pos++) {
+		if ((i = bracket_at(pos)) >= 0) {
+			break;
+		}
+	}
+	int partner = i >= 0 ? bracket_partner(i) : -1;
+	if (partner < 0) {
+		rl_ding();
+		return 0;
+	}
+	rl_point = brackets[partner].pos;
+	jot_redisplay();
+	return 0;
+}
+
+/* Toggle highlighting of the bracket pair at the cursor */
+static int
+jot_toggle_bracket_highlight(int count, int key)
 {
-	while (count-- > 0) {
-		int buffer_len = rl_end; /* Total number of characters in the buffer */
-		int orig_point = rl_point; /* Save the original cursor position */
-		int line_start = rl_point;
-		int line_col = 0;
-
-		/* Find the start of the current line */
-		rl_point = line_start;
-		while (rl_point > 0) {
-			int saved_point = rl_point;
-			rl_backward_char(1, 0); /* Move back one character */
-			if (rl_line_buffer[rl_point] == '\n') {
-				rl_forward_char(1, 0); /* Move forward to the first character of the current line */
-				break;
-			}
-			if (rl_point == saved_point) {
-				/* Can't move further back */
-				break;
-			}
-			line_start = rl_point;
-			line_col++;
-		}
+	bracket_highlight = !bracket_highlight;
+	jot_redisplay();
+	return 0;
+}
 
-		/* Find the end of the current line */
-		int line_end = rl_point;
-		rl_point = line_end;
-		while (rl_point < buffer_len) {
-			if (rl_line_buffer[rl_point] == '\n') {
-				break;
-			}
-			int saved_point = rl_point;
-			rl_forward_char(1, 0); /* Move forward one character */
-			if (rl_point == saved_point) {
-				/* Can't move forward */
-				break;
-			}
-			line_end = rl_point;
-		}
+/* Toggle the line numbers left of the text */
+static int
+jot_toggle_line_numbers(int count, int key)
+{
+	line_numbers = !line_numbers;
+	display_invalidate();
+	jot_redisplay();
+	return 0;
+}
 
-		/* Check if we're at the last line */
-		if (line_end >= buffer_len) {
-			rl_point = orig_point; /* Restore original position */
-			rl_ding();			 /* Beep to indicate no more lines below */
-			break;
-		}
+/* Toggle the status line below the text */
+static int
+jot_toggle_status_line(int count, int key)
+{
+	status_line = !status_line;
+	jot_redisplay();
+	return 0;
+}
 
-		/* Move to the start of the next line */
-		rl_point = line_end;
-		if (rl_point < buffer_len && rl_line_buffer[rl_point] == '\n') {
-			rl_forward_char(1, 0); /* Move past the newline character */
-		}
+/* Toggle between wrapping long lines and scrolling them sideways */
+static int
+jot_toggle_wrap(int count, int key)
+{
+	line_wrap = !line_wrap;
+	display.left_col = 0;
+	jot_redisplay();
+	return 0;
+}
 
-		int next_line_start = rl_point;
+static int jot_visual_line_up(int count, int key);
+static int jot_visual_line_down(int count, int key);
 
-		/* Find the end of the next line */
-		int next_line_end = next_line_start;
-		rl_point = next_line_start;
-		while (rl_point < buffer_len) {
-			if (rl_line_buffer[rl_point] == '\n') {
-				break;
-			}
-			int saved_point = rl_point;
-			rl_forward_char(1, 0);
-			if (rl_point == saved_point) {
-				/* Can't move forward */
-				break;
-			}
-			next_line_end = rl_point;
-		}
+/* Cell of the row, or column when lines do not wrap, that visual line motion keeps to */
+static int visual_goal_x = 0;
 
-		/* Compute the column position in the next line (line_col may exceed next_line_length) */
-		int next_line_length = next_line_end - next_line_start;
+/*
+ * Move the cursor 'count' screen rows down, or up if 'down' is 0. The
+ * rows of each line come from the wrap cache, and the cursor's row from
+ * the marks of its line, so a move costs the width of a row, not the
+ * length of the lines it crosses.
+ */
+static int
+visual_move(int count, int down)
+{
+	int screen_rows, screen_cols;
 
-		int target_col = (line_col < next_line_length) ? line_col : next_line_length;
+	if (line_index_sync() != 0) {
+		rl_ding();
+		return 0;
+	}
+	display_get_size(&screen_rows, &screen_cols);
+	int cols = screen_cols - display_gutter(screen_cols);
+
+	/* Find the row and cell of the cursor */
+	int point = rl_point < rl_end ? rl_point : rl_end;
+	int line = line_index_find(point);
+	int row = 0, x = 0;
+	int fold = nfolds ? fold_find(line) : -1;
+	if (fold >= 0) {
+		line = folds[fold].first;
+	} else if (!line_wrap) {
+		column_seek(line, point - line_start(line), INT_MAX, &x);
+	} else if (row_find(line, cols, point - line_start(line), &row, &x) != 0) {
+		return down ? jot_move_cursor_down(count, 0) : jot_move_cursor_up(count, 0);
+	}
+	if (rl_last_func != jot_visual_line_up && rl_last_func != jot_visual_line_down) {
+		visual_goal_x = x;
+	}
 
-		/* Move to the calculated column in the next line */
-		rl_point = next_line_start;
-		for (int i = 0; i < target_col && rl_point < next_line_end; i++) {
-			if (rl_line_buffer[rl_point] == '\n') {
-				break;
-			}
-			int saved_point = rl_point;
-			rl_forward_char(1, 0);
-			if (rl_point == saved_point) {
-				/* Can't move forward */
-				break;
-			}
-		}
-		/* If we moved past the end of the line, adjust rl_point back */
-		if (rl_point > next_line_end) {
-			rl_point = next_line_end;
+	while (count-- > 0) {
+		if (down && row + 1 < line_rows(line, cols)) {
+			row++;
+		} else if (down && fold_next_line(line) < line_count) {
+			line = fold_next_line(line);
+			row = 0;
+		} else if (!down && row > 0) {
+			row--;
+		} else if (!down && line > 0) {
+			line = fold_prev_line(line);
+			row = line_rows(line, cols) - 1;
+		} else {
+			rl_ding();
+			break;
 		}
 	}
-	rl_redisplay();
+
+	/* A fold shows its first line from the start */
+	int folded = nfolds && fold_find(line) >= 0;
+	int off = 0;
+	if (!folded && !line_wrap) {
+		off = column_seek(line, INT_MAX, visual_goal_x, &x);
+	} else if (!folded) {
+		off = row_offset_at(line, cols, row, visual_goal_x);
+	}
+	rl_point = line_start(line) + (off > 0 ? off : 0);
+	jot_redisplay();
 	return 0;
 }
 
-/* Custom function to insert a newline character */
+/* Move the cursor up 'count' screen rows */
 static int
-jot_insert_newline(int count, int key)
+jot_visual_line_up(int count, int key)
 {
-	/* Insert a newline character into the input buffer */
-	rl_insert_text("\n");
-	/* Redisplay the input line with the new content */
-	rl_redisplay();
-	return 0; /* Return 0 to indicate the key has been handled */
+	return visual_move(count, 0);
 }
 
+/* Move the cursor down 'count' screen rows */
 static int
-jot_move_to_first_nonblank_next_line(int count, int key)
+jot_visual_line_down(int count, int key)
 {
-	while (count-- > 0) {
-		int buffer_len = strlen(rl_line_buffer);
-		int current_pos = rl_point;
+	return visual_move(count, 1);
+}
 
-		/* Find the end of the current line */
-		int line_end = current_pos;
-		while (line_end < buffer_len && rl_line_buffer[line_end] != '\n') {
-			line_end++;
+/* A line of a unified diff: ' ', '-' or '+' and its line numbers */
+struct diff_entry {
+	char type;
+	int a;   /* Original line, for ' ' and '-' */
+	int b;   /* Buffer line, for ' ' and '+' */
+};
+
+/* Append the text of a diff entry to 'tb' */
+static void
+diff_entry_text(struct textbuf *tb, const struct diff_entry *e)
+{
+	struct line_span span = e->type == '+' ? line_index_span(e->b) : orig_span(e->a);
+	const char *text = (e->type == '+' ? rl_line_buffer : file_contents) + span.start;
+
+	textbuf_append(tb, &e->type, 1);
+	textbuf_append(tb, text, span.len);
+}
+
+/*
+ * Format the unified diff of the original text and the buffer into 'out',
+ * one diff line per entry of 'lines'. Returns the number of lines, 0 if
+ * there are no changes, or -1 on failure.
+ */
+static int
+diff_format(struct textbuf *out, size_t **lines)
+{
+	/* The empty line after a final newline is not shown */
+	int a_count = orig_count;
+	int b_count = line_count;
+	if (orig_span(a_count - 1).len == 0) {
+		a_count--;
+	}
+	if (line_start(b_count - 1) == rl_end) {
+		b_count--;
+	}
+	int a_newline = a_count < orig_count;
+	int b_newline = b_count < line_count;
+
+	struct diff_entry *entries = malloc((a_count + b_count + 1) * sizeof(*entries));
+	if (!entries) {
+		perror("malloc");
+		return -1;
+	}
+
+	/* Merge the two sides into a single edit script */
+	int n = 0;
+	for (int a = 0, b = 0; a < a_count || b < b_count;) {
+		int next_b = b;
+		while (next_b < b_count && (diff_match[next_b] < 0 || diff_match[next_b] >= a_count)) {
+			next_b++;
 		}
+		int next_a = next_b < b_count ? diff_match[next_b] : a_count;
+		if (next_b < b_count &&
+			(next_a == a_count - 1 && !a_newline) != (next_b == b_count - 1 && !b_newline)) {
+			/* Equal text, but only one side lacks the final newline */
+			next_a++;
+			next_b++;
+		}
+		for (; a < next_a; a++) {
+			entries[n++] = (struct diff_entry){ '-', a, -1 };
+		}
+		for (; b < next_b; b++) {
+			entries[n++] = (struct diff_entry){ '+', -1, b };
+		}
+		if (next_b < b_count) {
+			entries[n++] = (struct diff_entry){ ' ', a++, b++ };
+		}
+	}
 
-		/* If we're at the last line, do nothing */
-		if (line_end >= buffer_len) {
-			rl_ding();
-			break;
+	int hunks = 0, nlines = 0, lines_size = 0;
+	*lines = NULL;
+	out->len = 0;
+
+	/* Group the changes into hunks with DIFF_CONTEXT lines of context */
+	int a_line = 0, b_line = 0;   /* Lines of each side before entry i */
+	for (int i = 0; i < n;) {
+		if (entries[i].type == ' ') {
+			a_line++;
+			b_line++;
+			i++;
+			continue;
 		}
 
-		/* Move to the start of the next line */
-		int next_line_start = line_end + 1;
+		/* Changes less than 2 * DIFF_CONTEXT lines apart share a hunk */
+		int start = i > DIFF_CONTEXT ? i - DIFF_CONTEXT : 0;
+		int last_change = i;
+		for (int j = i; j < n && j - last_change <= 2 * DIFF_CONTEXT; j++) {
+			if (entries[j].type != ' ') {
+				last_change = j;
+			}
+		}
+		int end = last_change + DIFF_CONTEXT + 1 < n ? last_change + DIFF_CONTEXT + 1 : n;
 
-		/* Find the end of the next line */
-		int next_line_end = next_line_start;
-		while (next_line_end < buffer_len && rl_line_buffer[next_line_end] != '\n') {
-			next_line_end++;
+		int a_start = a_line - (i - start), b_start = b_line - (i - start);
+		int a_len = 0, b_len = 0;
+		for (int j = start; j < end; j++) {
+			a_len += entries[j].type != '+';
+			b_len += entries[j].type != '-';
 		}
 
-		/* Move to the first non-blank character in the next line */
-		int pos = next_line_start;
-		while (pos < next_line_end && isspace((unsigned char)rl_line_buffer[pos])) {
-			pos++;
+		if (hunks++ == 0) {
+			const char *name = filename ? filename : "stdin";
+			textbuf_puts(out, "--- ");
+			textbuf_puts(out, name);
+			textbuf_puts(out, "\n+++ ");
+			textbuf_puts(out, name);
+			textbuf_puts(out, "\n");
+		}
+		char header[80];
+		snprintf(header, sizeof(header), "@@ -%d,%d +%d,%d @@\n",
+				 a_start + (a_len > 0), a_len, b_start + (b_len > 0), b_len);
+		textbuf_puts(out, header);
+		for (int j = start; j < end; j++) {
+			diff_entry_text(out, &entries[j]);
+			textbuf_puts(out, "\n");
+			if ((entries[j].type != '+' && entries[j].a == a_count - 1 && !a_newline) ||
+				(entries[j].type != '-' && entries[j].b == b_count - 1 && !b_newline)) {
+				textbuf_puts(out, "\\ No newline at end of file\n");
+			}
 		}
 
-		/* Set the new cursor position */
-		rl_point = pos;
+		for (int j = i; j < end; j++) {
+			a_line += entries[j].type != '+';
+			b_line += entries[j].type != '-';
+		}
+		i = end;
 	}
-	rl_redisplay();
-	return 0;
+	free(entries);
+	if (hunks == 0) {
+		return 0;
+	}
+
+	/* Index the start of each output line */
+	nlines = 0;
+	for (size_t pos = 0; pos < out->len;) {
+		if (nlines == lines_size) {
+			lines_size = lines_size ? lines_size * 2 : 256;
+			size_t *new_lines = realloc(*lines, lines_size * sizeof(**lines));
+			if (!new_lines) {
+				perror("realloc");
+				return -1;
+			}
+			*lines = new_lines;
+		}
+		(*lines)[nlines++] = pos;
+		const char *nl = memchr(out->data + pos, '\n', out->len - pos);
+		pos = nl - out->data + 1;
+	}
+	return nlines;
+}
+
+/* Draw diff line 'text' on area row 'row' */
+static void
+diff_draw_row(int row, const char *text, int len, int cols)
+{
+	int style = STYLE_NORMAL;
+	if (len > 0 && text[0] == '+') {
+		style = STYLE_ADDED;
+	} else if (len > 0 && text[0] == '-') {
+		style = STYLE_REMOVED;
+	} else if (len > 0 && text[0] == '@') {
+		style = STYLE_COMMENT;
+	}
+
+	int col = 0;
+	int fit = scan_columns(text, len, cols - 1, &col);
+	frame_goto_row(row);
+	if (style != STYLE_NORMAL) {
+		frame_puts(style_sgr[style]);
+	}
+	frame_append(text, fit);
+	if (style != STYLE_NORMAL) {
+		frame_puts(style_sgr[STYLE_NORMAL]);
+	}
+	frame_puts("\033[K");
 }
 
 /*
- * Vi command to delete 'count' lines ('dd').
- * It behaves slightly differently from jot_kill_line()
+ * Show the unified diff of the buffer against the original text in the
+ * display area, a page at a time. Space shows the next page, b the
+ * previous one, and any other key returns to editing.
  */
 static int
-jot_vi_delete_current_line(int count, int key)
+jot_show_diff(int count, int key)
 {
-	int buffer_len = strlen(rl_line_buffer);
-	int start = rl_point;
-	int end = rl_point;
-
-	/* Find the start of the current line */
-	while (start > 0 && rl_line_buffer[start - 1] != '\n') {
-		start--;
+	struct textbuf out = { NULL, 0, 0 };
+	size_t *lines = NULL;
+	int nlines;
+
+	if (diff_start() != 0 || (nlines = diff_format(&out, &lines)) <= 0) {
+		rl_ding();
+		free(out.data);
+		free(lines);
+		return 0;
 	}
 
-	/* Delete 'count' lines */
-	for (int i = 0; i < count; i++) {
-		/* Find the end of the current line */
-		while (end < buffer_len && rl_line_buffer[end] != '\n') {
-			end++;
+	int screen_rows, cols;
+	display_get_size(&screen_rows, &cols);
+	int height = nlines < screen_rows ? nlines : screen_rows;
+	int page = nlines > height ? height - 1 : height;   /* Leave a row for the prompt */
+	if (page < 1) {
+		page = 1;
+	}
+	if (display_reserve_rows(height) != 0) {
+		free(out.data);
+		free(lines);
+		return 0;
+	}
+	display_grow(height);
+	display.paging = 1;
+
+	for (int top = 0;;) {
+		for (int row = 0; row < height; row++) {
+			int i = top + row;
+			if (row == page) {
+				char prompt[64];
+				int len = snprintf(prompt, sizeof(prompt), "-- %d/%d lines, SPACE for more --",
+								   top + page < nlines ? top + page : nlines, nlines);
+				frame_goto_row(row);
+				frame_puts(style_sgr[STYLE_RULER]);
+				frame_append(prompt, len < cols ? len : cols - 1);
+				frame_puts(style_sgr[STYLE_NORMAL]);
+				frame_puts("\033[K");
+			} else if (i < nlines) {
+				size_t end = i + 1 < nlines ? lines[i + 1] - 1 : out.len - 1;
+				diff_draw_row(row, out.data + lines[i], end - lines[i], cols);
+			} else {
+				frame_goto_row(row);
+				frame_puts("\033[K");
+			}
 		}
-		/* Include the newline character */
-		if (end < buffer_len && rl_line_buffer[end] == '\n') {
-			end++;
+		frame_goto_row(height - 1);
+		frame_flush();
+
+		int c = rl_read_key();
+		if (c == ' ' && top + page < nlines) {
+			top += page;
+		} else if (c == 'b' && top > 0) {
+			top = top > page ? top - page : 0;
+		} else {
+			break;
 		}
 	}
+	free(out.data);
+	free(lines);
 
-	/* Remove the text from start to end */
-	rl_kill_text(start, end);
-	rl_point = start;
-	rl_redisplay();
+	display.paging = 0;
+	display_invalidate();
+	jot_redisplay();
 	return 0;
 }
 
-/* Vi command to delete to end of line ('D') */
+/* Toggle the gutter that marks the lines changed from the original text */
 static int
-jot_vi_delete_to_end_of_line(int count, int key)
+jot_toggle_diff_gutter(int count, int key)
 {
-	int buffer_len = strlen(rl_line_buffer);
-	int start = rl_point;
-	int end = rl_point;
+	if (!diff_gutter && diff_start() != 0) {
+		rl_ding();
+		return 0;
+	}
+	diff_gutter = !diff_gutter;
+	display_invalidate();
+	jot_redisplay();
+	return 0;
+}
 
-	/* Delete to the end of the current line or multiple lines */
-	for (int i = 0; i < count; i++) {
-		while (end < buffer_len && rl_line_buffer[end] != '\n') {
-			end++;
-		}
-		if (i < count - 1 && end < buffer_len && rl_line_buffer[end] == '\n') {
-			end++; /* Include newline if more counts are left */
+/*
+ * Move the terminal cursor below the display area, so that output after
+ * editing does not overwrite it.
+ */
+static void
+display_finish(void)
+{
+	if (display.deferred && display.rows > 0) {
+		/* The text is left on the screen as it was accepted */
+		display_draw();
+	}
+	if (display.rows > 0 && display.status) {
+		/* Take the status line away, leaving the cursor below the text */
+		frame_goto_row(display.rows - 1);
+		frame_puts("\033[K");
+	} else if (display.rows > 0) {
+		frame_goto_row(display.rows - 1);
+		frame_puts("\n");
+	}
+	frame_flush();
+	display.rows = 0;
+	display.status = 0;
+}
+
+/*
+ * Stop for job control. The terminal is given back as jot found it,
+ * and when jot is continued the buffer is drawn again below whatever
+ * the shell printed in the meantime.
+ */
+static void
+suspend_editor(void)
+{
+	tty.suspend_requested = 0;
+	rl_deprep_terminal();
+	display_finish();
+	tty_restore();
+	tty.suspended = 1;
+
+	if (tty.job_pid > 0) {
+		/*
+		 * A daemon session is not in the shell's job: stop the client,
+		 * which passes SIGCONT on when the shell continues it in front.
+		 * SIGCONT is blocked from before the client stops until the
+		 * wait, so that one passed on early stays pending instead of
+		 * being lost.
+		 */
+		sigset_t block, old_mask, wait_mask;
+		sigemptyset(&block);
+		sigaddset(&block, SIGCONT);
+		sigprocmask(SIG_BLOCK, &block, &old_mask);
+		wait_mask = old_mask;
+		sigdelset(&wait_mask, SIGCONT);
+		tty.continued = 0;
+		kill(tty.job_pid, SIGSTOP);
+		while (!tty.continued) {
+			sigsuspend(&wait_mask);
 		}
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	} else {
+		struct sigaction sa, old;
+		sa.sa_handler = SIG_DFL;
+		sa.sa_flags = 0;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGTSTP, &sa, &old);
+		raise(SIGTSTP);
+		sigaction(SIGTSTP, &old, NULL);
 	}
 
-	/* Remove text from cursor to end */
-	rl_kill_text(start, end);
-	rl_point = start;
-	rl_redisplay();
-	return 0;
+	/* Continued: back to jot's settings, with readline's on top */
+	tty.suspended = 0;
+	tty_set_editing();
+	rl_prep_terminal(1);
 }
 
-/* Vi command to join lines ('J') */
+/*
+ * Readline's getc function. It waits for signals as well as input, so
+ * that they are handled here, outside the signal handlers. Any number of
+ * SIGWINCH signals that came in cost one redraw.
+ */
 static int
-jot_vi_join_lines(int count, int key)
+tty_getc(FILE *stream)
 {
-	rl_begin_undo_group();
-
-	while (count-- > 0) {
-		int buffer_len = rl_end;  /* rl_end is the length of the line buffer */
-		int start_pos = rl_point;
+	struct pollfd fds[2] = {
+		{ .fd = fileno(stream), .events = POLLIN },
+		{ .fd = tty.resize_pipe[0], .events = POLLIN },
+	};
 
-		/* Move rl_point to the end of the current line */
-		while (rl_point < buffer_len) {
-			if (rl_line_buffer[rl_point] == '\n') {
-				break;
+	for (;;) {
+		/* A pager is finished first, so suspending waits for it */
+		if (tty.suspend_requested && !display.paging) {
+			suspend_editor();
+		}
+		/*
+		 * What the keys so far drew goes out in one write when jot is
+		 * about to wait, so keys that came in together cost one frame
+		 */
+		int ready = poll(fds, 2, 0);
+		if (ready == 0 || display.frame.len >= FRAME_BATCH_MAX) {
+			frame_flush();
+		}
+		if (ready == 0) {
+			/* A skipped frame is drawn once the terminal has caught up */
+			int timeout = -1;
+			if (display.deferred && !display.paging && !frame_link_behind(&timeout)) {
+				display_draw();
+				frame_flush();
+				timeout = -1;
 			}
-			int saved_point = rl_point;
-			rl_forward_char(1, 0);  /* Move forward one character */
-			if (rl_point == saved_point) {
-				/* Can't move further */
-				break;
+			ready = poll(fds, 2, timeout);
+			if (ready == 0) {
+				continue;
 			}
 		}
-
-		/* Check if we have a newline to join with */
-		if (rl_point >= buffer_len || rl_line_buffer[rl_point] != '\n') {
-			rl_point = start_pos; /* Restore cursor position */
-			rl_ding(); /* Beep to indicate no action */
-			break;
+		if (ready == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return EOF;
 		}
-
-		/* Delete the newline character */
-		rl_delete_text(rl_point, rl_point + 1);
-		buffer_len--;
-
-		/* Remove leading ASCII spaces and tabs from the next line */
-		while (rl_point < buffer_len) {
-			char c = rl_line_buffer[rl_point];
-			if (c != ' ' && c != '\t') {
-				break;
+		if (fds[1].revents & POLLIN) {
+			char drain[64];
+			while (read(tty.resize_pipe[0], drain, sizeof(drain)) > 0) {
+				continue;
+			}
+			int rows, cols;
+			if (tty_get_size(&rows, &cols) == 0) {
+				rl_set_screen_size(rows, cols);
 			}
-			rl_delete_text(rl_point, rl_point + 1);
-			buffer_len--;
+			if (tty.continued && !display.paging) {
+				/* Only the rows in view are drawn again */
+				tty.continued = 0;
+				display_invalidate();
+				jot_redisplay();
+			} else if (!display.paging && display.rows > 0) {
+				jot_redisplay();
+			}
+		}
+		if (fds[0].revents) {
+			return rl_getc(stream);
 		}
+	}
+}
 
-		/* Decide whether to insert a space */
-		char before_char = '\0', after_char = '\0';
+/* Clear the terminal and redraw the buffer at the top */
+static int
+jot_clear_screen(int count, int key)
+{
+	frame_puts("\033[H\033[J");
+	display.rows = 1;
+	display.cursor_row = 0;
+	display_invalidate();
+	jot_redisplay();
+	return 0;
+}
 
-		/* Get the character before the join */
-		if (rl_point > 0) {
-			int saved_point = rl_point;
-			rl_backward_char(1, 0);
-			before_char = rl_line_buffer[rl_point];
-			rl_point = saved_point; /* Restore rl_point */
-		}
+/* Toggle the Git commit message mode */
+static int
+jot_git_commit_mode(int count, int key)
+{
+	set_commit_mode(!commit_mode);
+	jot_redisplay();
+	return 0;
+}
 
-		/* Get the character after the join */
-		if (rl_point < buffer_len) {
-			after_char = rl_line_buffer[rl_point];
-		}
+/*
+ * Moving lines
+ *
+ * Moving a block of lines up or down by one swaps it with the adjacent
+ * line: only the spans of those lines are rebuilt, and since the rows of
+ * the other lines do not change, only the affected rows are redrawn.
+ */
+
+/* Whether 'line' is the empty line after a final newline */
+static int
+is_phantom_line(int line)
+{
+	return line > 0 && line == line_count - 1 && line_start(line) == rl_end;
+}
 
-		int need_space = 0;
-		if (before_char != '\0' && after_char != '\0' &&
-			before_char != ' ' && after_char != ' ' &&
-			before_char != '\n' && after_char != '\n') {
-			need_space = 1;
+/*
+ * Move lines first..last up (direction < 0) or down (direction > 0) by
+ * one line, keeping the cursor and mark on the same text.
+ * Returns -1 if the lines cannot move.
+ */
+static int
+move_lines(int first, int last, int direction)
+{
+	int other = direction < 0 ? first - 1 : last + 1;
+
+	if (other < 0 || other >= line_count || is_phantom_line(other)) {
+		return -1;
+	}
+
+	int n = last - first + 2;
+	struct line_span spans[n];
+	struct line_span other_span = line_index_span(other);
+	int k = 0;
+
+	if (direction > 0) {
+		spans[k++] = other_span;
+	}
+	for (int line = first; line <= last; line++) {
+		spans[k++] = line_index_span(line);
+	}
+	if (direction < 0) {
+		spans[k++] = other_span;
+	}
+
+	int shift = (other_span.len + 1) * (direction < 0 ? -1 : 1);
+	int point = rl_point + shift;
+	int mark = rl_mark + shift;
+	int mark_moves = (rl_mark >= line_start(first) &&
+					  (last + 1 >= line_count || rl_mark < line_start(last + 1)));
+
+	if (replace_lines_with_spans(direction < 0 ? other : first,
+								 direction < 0 ? last : other, spans, n) != 0) {
+		return -1;
+	}
+	rl_point = point <= rl_end ? point : rl_end;
+	if (mark_moves) {
+		rl_mark = mark <= rl_end ? mark : rl_end;
+	}
+	return 0;
+}
+
+/* Move the current line, or the lines of the region, 'count' lines */
+static int
+move_lines_command(int count, int region)
+{
+	int direction = count < 0 ? -1 : 1;
+
+	for (int i = 0; i < abs(count); i++) {
+		int first, last;
+
+		if (line_index_sync() != 0) {
+			rl_ding();
+			break;
+		}
+		if (region) {
+			if (get_region_lines(&first, &last) != 0) {
+				rl_ding();
+				break;
+			}
+		} else {
+			first = last = line_index_find(rl_point);
+		}
+		if (move_lines(first, last, direction) != 0) {
+			rl_ding();
+			break;
 		}
+	}
+	jot_redisplay();
+	return 0;
+}
 
-		if (need_space) {
-			rl_insert_text(" ");
-			buffer_len++;
-			/* rl_point advances after insertion */
-		}
+/* Move the current line up 'count' lines */
+static int
+jot_move_line_up(int count, int key)
+{
+	return move_lines_command(-count, 0);
+}
 
-		/* Optionally adjust cursor position */
-		rl_point = start_pos;
-	}
+/* Move the current line down 'count' lines */
+static int
+jot_move_line_down(int count, int key)
+{
+	return move_lines_command(count, 0);
+}
 
-	rl_end_undo_group();
-	rl_redisplay();
-	return 0;
+/* Move the lines of the region up 'count' lines */
+static int
+jot_move_region_up(int count, int key)
+{
+	return move_lines_command(-count, 1);
 }
 
-static void
-goto_line(int count)
+/* Move the lines of the region down 'count' lines */
+static int
+jot_move_region_down(int count, int key)
 {
-	int pos = 0;
-	int current_line = 1;
-	int target_line = count;
+	return move_lines_command(count, 1);
+}
 
-	int buffer_len = rl_end;
+/*
+ * Git rebase todo mode
+ *
+ * When editing git-rebase-todo, the command word of the current line can
+ * be cycled through pick, squash, fixup and drop with a single key, or set
+ * with C-x t or g and its first letter, and lines are reordered with the
+ * line move commands. The commands do nothing in other files.
+ */
+static int rebase_mode = 0;
 
-	/* Move to the desired line number */
-	while (pos < buffer_len && current_line <= target_line) {
-		if (rl_line_buffer[pos++] == '\n') {
-			current_line++;
-		}
+static const char *const rebase_commands[] = { "pick", "squash", "fixup", "drop" };
+#define NREBASE_COMMANDS (sizeof(rebase_commands) / sizeof(rebase_commands[0]))
+
+/*
+ * Replace the command word of the current todo line. If 'command' is
+ * NULL, the next command in the cycle is used. Returns -1 if the line
+ * does not start with a command.
+ */
+static int
+set_rebase_command(const char *command)
+{
+	if (line_index_sync() != 0) {
+		return -1;
 	}
 
-	/* Ensure pos is at the start of the target line */
+	struct line_span span = line_index_span(line_index_find(rl_point));
+	const char *text = rl_line_buffer + span.start;
+	int word_start = 0;
 
-	/* Move back to the start of the line in case pos overshot due to newline */
-	if (pos > 0 && rl_line_buffer[pos - 1] == '\n') {
-		pos--;
+	while (word_start < span.len && (text[word_start] == ' ' || text[word_start] == '\t')) {
+		word_start++;
 	}
-	while (pos > 0 && rl_line_buffer[pos - 1] != '\n') {
-		pos--;
+	int word_end = word_start;
+	while (word_end < span.len && text[word_end] != ' ' && text[word_end] != '\t') {
+		word_end++;
 	}
-	/* Now move forward to the first non-blank character */
-	while (pos < buffer_len && isspace((unsigned char)rl_line_buffer[pos]) && rl_line_buffer[pos] != '\n') {
-		pos++;
+	int word_len = word_end - word_start;
+	if (word_len == 0 || text[word_start] == '#') {
+		return -1;
 	}
-	rl_point = pos;
-}
 
-/* Vi command to go to line 'count' or end ('G') */
-static int
-jot_vi_goto_line(int count, int key)
-{
-	if (rl_explicit_arg) {
-		/* User provided a count, move to that line number */
-		goto_line(count);
-	} else {
-		goto_line(INT_MAX);
+	if (!command) {
+		/* Other commands, like reword and edit, cycle back to pick */
+		command = rebase_commands[0];
+		for (size_t i = 0; i < NREBASE_COMMANDS; i++) {
+			const char *name = rebase_commands[i];
+			if ((word_len == (int)strlen(name) && memcmp(text + word_start, name, word_len) == 0) ||
+				(word_len == 1 && text[word_start] == name[0])) {
+				command = rebase_commands[(i + 1) % NREBASE_COMMANDS];
+				break;
+			}
+		}
 	}
 
-	rl_redisplay();
+	int start = span.start + word_start;
+	int end = span.start + word_end;
+	int point = rl_point;
+	int delta = (int)strlen(command) - word_len;
+
+	replace_text(start, end, command);
+	rl_point = point >= end ? point + delta : (point > start + (int)strlen(command) ? start + (int)strlen(command) : point);
 	return 0;
 }
 
-/* Vi command to go to first line ('gg') */
 static int
-jot_vi_goto_first_line(int count, int key)
+rebase_command(const char *command)
 {
-	if (rl_explicit_arg) {
-		/* User provided a count, move to that line number */
-		goto_line(count);
-	} else {
-		goto_line(1);
+	if (!rebase_mode || set_rebase_command(command) != 0) {
+		rl_ding();
 	}
-
-	rl_redisplay();
+	jot_redisplay();
 	return 0;
 }
 
-/* Vi command to insert a line below current line and enter insert mode ('o') */
+/* Cycle the command of the current todo line through pick, squash, fixup and drop */
 static int
-jot_vi_insert_line_below(int count, int key)
+jot_rebase_cycle_command(int count, int key)
 {
-	int buffer_len = strlen(rl_line_buffer);
-	int pos = rl_point;
+	return rebase_command(NULL);
+}
 
-	/* Find the end of the current line */
-	while (pos < buffer_len && rl_line_buffer[pos] != '\n') {
-		pos++;
-	}
+static int
+jot_rebase_pick(int count, int key)
+{
+	return rebase_command("pick");
+}
 
-	/* Move after the newline character if there is one */
-	if (pos < buffer_len && rl_line_buffer[pos] == '\n') {
-		pos++; /* Move after newline */
-	}
-	/* Else, pos remains at buffer_len (end of buffer) */
+static int
+jot_rebase_squash(int count, int key)
+{
+	return rebase_command("squash");
+}
 
-	/* Move rl_point to pos */
-	rl_point = pos;
+static int
+jot_rebase_fixup(int count, int key)
+{
+	return rebase_command("fixup");
+}
 
-	/* Insert a newline character */
-	rl_insert_text("\n");
+static int
+jot_rebase_drop(int count, int key)
+{
+	return rebase_command("drop");
+}
 
-	/* After insertion, rl_point advances by 1 to pos + 1 */
+/*
+ * C-x t and the first letter of a todo command set it in the insert maps,
+ * and g and the letter in vi command mode. Alt and the letter would take
+ * M-f and M-d from Emacs mode, and catch Escape typed quickly before a vi
+ * command.
+ */
+static const struct {
+	const char *seq;
+	const char *vi_seq;
+	rl_command_func_t *func;
+} rebase_bindings[] = {
+	{ "\\C-xtp", "gp", jot_rebase_pick },
+	{ "\\C-xts", "gs", jot_rebase_squash },
+	{ "\\C-xtf", "gf", jot_rebase_fixup },
+	{ "\\C-xtd", "gd", jot_rebase_drop },
+};
 
-	/* If we are not at the end of the buffer, adjust rl_point back to the start of the new line */
-	if (pos < buffer_len) {
-		rl_point = pos;
+/* Turn on rebase todo mode and bind its keys */
+static void
+set_rebase_mode(void)
+{
+	/* Tab cycles the todo command, since todo lines need no tabs */
+	rebase_mode = 1;
+	bind_func_in_insert_maps("\t", jot_rebase_cycle_command);
+	bind_func_in_vi_movement_keymap("\t", jot_rebase_cycle_command);
+	for (size_t i = 0; i < sizeof(rebase_bindings) / sizeof(rebase_bindings[0]); i++) {
+		bind_func_in_insert_maps(rebase_bindings[i].seq, rebase_bindings[i].func);
+		bind_func_in_vi_movement_keymap(rebase_bindings[i].vi_seq, rebase_bindings[i].func);
 	}
-	/* Otherwise, when at the end of the buffer, rl_point is already correctly placed */
-
-	/* Switch to Vi insert mode */
-	rl_vi_insertion_mode(1, 0);
-
-	rl_redisplay();
-	return 0;
 }
 
+/*
+ * Progressive mode: the lines above the cursor can be declared final and
+ * written out before the rest of the buffer is accepted, so that the next
+ * command in a pipeline can start on them.
+ */
+static FILE *progressive_out = NULL;   /* Where final lines go, or NULL */
 
-/* Vi command to insert a line above current line and enter insert mode ('O') */
+/*
+ * Drop the original lines that came before buffer line 'line', now that
+ * the lines above it were written out. The cut is made at the original
+ * line that 'line' matches. Inside a run of unmatched lines, which can be
+ * a whole window too large to diff, the original lines of the run are
+ * taken to pair up with its buffer lines in order. The diff is kept, with
+ * the original lines renumbered, so that removing the buffer lines above
+ * 'line' next only rediffs around the new first line.
+ */
 static int
-jot_vi_insert_line_above(int count, int key)
+drop_original_before(int line)
 {
-	int pos = rl_point;
-
-	/* Find the start of the current line */
-	while (pos > 0 && rl_line_buffer[pos - 1] != '\n') {
-		pos--;
+	if (!file_contents) {
+		return 0;
+	}
+	if (diff_start() != 0) {
+		return -1;
+	}
+	int prev = line - 1;
+	while (prev >= 0 && diff_match[prev] < 0) {
+		prev--;
+	}
+	int next = line;
+	while (next < line_count && diff_match[next] < 0) {
+		next++;
+	}
+	int lo = prev >= 0 ? diff_match[prev] + 1 : 0;
+	int hi = next < line_count ? diff_match[next] : orig_count;
+	int cut_line = next == line ? hi : lo + (line - prev - 1);
+	if (cut_line > hi) {
+		cut_line = hi;
 	}
 
-	rl_point = pos;
-
-	/* Insert a newline character */
-	rl_insert_text("\n");
+	size_t len = strlen(file_contents);
+	size_t cut = cut_line < orig_count ? (size_t)orig_starts[cut_line] : len;
+	memmove(file_contents, file_contents + cut, len - cut + 1);
+	char *shrunk = realloc(file_contents, len - cut + 1);
+	if (shrunk) {
+		file_contents = shrunk;
+	}
 
-	/* Move cursor to the beginning of the new line */
-	rl_point = pos;
+	if (cut_line < orig_count) {
+		orig_count -= cut_line;
+		memmove(orig_starts, orig_starts + cut_line, orig_count * sizeof(*orig_starts));
+		memmove(orig_hashes, orig_hashes + cut_line, orig_count * sizeof(*orig_hashes));
+		for (int i = 0; i < orig_count; i++) {
+			orig_starts[i] -= cut;
+		}
+	} else {
+		/* Everything was cut: what is left is one empty line */
+		orig_count = 1;
+		orig_starts[0] = 0;
+		orig_hashes[0] = hash_line("", 0);
+	}
+	for (int i = 0; i < line_count; i++) {
+		diff_match[i] = i >= line && diff_match[i] >= cut_line ? diff_match[i] - cut_line : -1;
+	}
+	return 0;
+}
 
-	/* Switch to Vi insert mode */
-	rl_vi_insertion_mode(1, 0);
+/* Write out the lines above the cursor and remove them from the buffer */
+static int
+jot_emit_lines_above(int count, int key)
+{
+	if (!progressive_out || line_index_sync() != 0) {
+		rl_ding();
+		return 0;
+	}
+	int line = line_index_find(rl_point);
+	int end = line_start(line);
+	if (end == 0) {
+		rl_ding();
+		return 0;
+	}
+	if (fwrite(rl_line_buffer, 1, end, progressive_out) != (size_t)end ||
+		fflush(progressive_out) == EOF) {
+		perror("write");
+		rl_ding();
+		return 0;
+	}
+	if (drop_original_before(line) != 0) {
+		rl_ding();
+	}
 
-	rl_redisplay();
+	/* The text is final: it cannot be changed or brought back by undo */
+	rl_delete_text(0, end);
+	line_index_free_undo_list();
+	rl_point -= end;
+	rl_mark = rl_mark > end ? rl_mark - end : 0;
+	if (diff_gutter && diff_start() != 0) {
+		diff_gutter = 0;
+	}
+	jot_redisplay();
 	return 0;
 }
 
@@ -951,6 +7497,44 @@ read_fp_contents(FILE *fp)
 	return contents;
 }
 
+/*
+ * Read the next record, up to the delimiter 'delim', from 'fp'. The
+ * delimiter is not part of the record; '*terminated' tells whether it
+ * was there. Returns NULL at the end of the input or on error.
+ */
+static char *
+read_record(FILE *fp, int delim, int *terminated)
+{
+	char *record = NULL;
+	size_t size = 0;
+	ssize_t len = getdelim(&record, &size, delim, fp);
+
+	if (len < 0) {
+		if (ferror(fp)) {
+			perror("getdelim");
+		}
+		free(record);
+		return NULL;
+	}
+	*terminated = len > 0 && record[len - 1] == delim;
+	if (*terminated) {
+		record[len - 1] = '\0';
+	}
+	return record;
+}
+
+/* Write an edited record to 'fp', followed by 'delim' unless it is -1 */
+static int
+write_record(FILE *fp, const char *record, int delim)
+{
+	if (fputs(record, fp) == EOF || (delim != -1 && putc(delim, fp) == EOF) ||
+		fflush(fp) == EOF) {
+		perror("write record");
+		return -1;
+	}
+	return 0;
+}
+
 static int
 jot_invoke_fullscreen_editor(int count, int key)
 {
@@ -1001,11 +7585,10 @@ jot_invoke_fullscreen_editor(int count, int key)
 	}
 	fclose(fp); /* This also closes the underlying file descriptor */
 
-	/* Restore terminal settings before launching the editor */
-	restore_terminal_settings();
-
-	/* Deinitialize Readline terminal settings before launching the editor */
+	/* Give the editor the terminal settings jot started with */
 	rl_deprep_terminal();
+	frame_flush();
+	tty_restore();
 
 	/*
 	 * Get the editor command from $JOT_EDITOR environment variable,
@@ -1061,20 +7644,20 @@ jot_invoke_fullscreen_editor(int count, int key)
 	rl_replace_line(new_contents, 0);
 	/* Move the cursor to the end of the buffer */
 	rl_point = rl_end = strlen(new_contents);
+	/* Readline keeps no undo entry for the replaced text */
+	line_index_invalidate();
 	/* Redisplay the updated buffer */
-	rl_redisplay();
+	jot_redisplay();
 	/* Free the allocated buffer */
 	free(new_contents);
 
 	/* Remove the temporary file */
 	unlink(temp_filename);
 
-	/* Reinitialize Readline terminal settings */
+	/* Back to jot's settings, with readline's on top */
+	tty_set_editing();
 	rl_prep_terminal(1);
 
-	/* Re-disable Ctrl+U if necessary (since terminal settings were restored) */
-	disable_ctrl_u_kill_line();
-
 	return 0;
 }
 
@@ -1088,16 +7671,364 @@ initialize_readline_buffer(void)
 		/* Optionally, move the cursor to the beginning */
 		rl_point = 0;
 	}
+	/* The text as loaded is not modified */
+	line_index_invalidate();
+	line_index_sync();
+	buffer_modified = 0;
+	/* The diff gutter stays on for the next record */
+	if (diff_gutter && diff_start() != 0) {
+		diff_gutter = 0;
+	}
+
+	return 0;
+}
+
+/* Drop the state that belongs to the previous record */
+static void
+reset_record_state(void)
+{
+	nfolds = 0;
+	diff_reset();
+	display.top_line = 0;
+	display.top_row = 0;
+}
+
+
+/* jot's functions, by the names used in the inputrc file */
+static const struct {
+	const char *name;
+	rl_command_func_t *func;
+} jot_functions[] = {
+	{ "jot-insert-newline", jot_insert_newline },
+	{ "jot-move-cursor-up", jot_move_cursor_up },
+	{ "jot-move-cursor-down", jot_move_cursor_down },
+	{ "jot-beginning-of-line", jot_beginning_of_line },
+	{ "jot-end-of-line", jot_end_of_line },
+	{ "jot-forward-char", jot_forward_char },
+	{ "jot-backward-char", jot_backward_char },
+	{ "jot-delete-char", jot_delete_char },
+	{ "jot-backward-delete-char", jot_backward_delete_char },
+	{ "jot-vi-delete-char", jot_vi_delete_char },
+	{ "jot-vi-backward-delete-char", jot_vi_backward_delete_char },
+	{ "jot-vi-change-char", jot_vi_change_char },
+	{ "jot-vi-redo", jot_vi_redo },
+	{ "jot-kill-line", jot_kill_line },
+	{ "jot-kill-backward-line", jot_kill_backward_line },
+	{ "jot-kill-whole-line", jot_kill_whole_line },
+	{ "jot-custom-ctrl-d", jot_custom_ctrl_d },
+	{ "jot-invoke-fullscreen-editor", jot_invoke_fullscreen_editor },
+	{ "jot-move-to-first-nonblank-next-line", jot_move_to_first_nonblank_next_line },
+	{ "jot-vi-join-lines", jot_vi_join_lines },
+	{ "jot-vi-insert-line-below", jot_vi_insert_line_below },
+	{ "jot-vi-insert-line-above", jot_vi_insert_line_above },
+	{ "jot-vi-goto-line", jot_vi_goto_line },
+	{ "jot-vi-goto-first-line", jot_vi_goto_first_line },
+	{ "jot-vi-delete-current-line", jot_vi_delete_current_line },
+	{ "jot-vi-delete-to-end-of-line", jot_vi_delete_to_end_of_line },
+	{ "jot-sort-lines", jot_sort_lines },
+	{ "jot-sort-lines-numeric", jot_sort_lines_numeric },
+	{ "jot-sort-lines-numeric-stable", jot_sort_lines_numeric_stable },
+	{ "jot-sort-lines-unique", jot_sort_lines_unique },
+	{ "jot-reverse-lines", jot_reverse_lines },
+	{ "jot-delete-duplicate-lines", jot_delete_duplicate_lines },
+	{ "jot-count-duplicate-lines", jot_count_duplicate_lines },
+	{ "jot-indent-region", jot_indent_region },
+	{ "jot-dedent-region", jot_dedent_region },
+	{ "jot-toggle-comment-region", jot_toggle_comment_region },
+	{ "jot-vi-indent-lines", jot_vi_indent_lines },
+	{ "jot-vi-dedent-lines", jot_vi_dedent_lines },
+	{ "jot-vi-toggle-comment-lines", jot_vi_toggle_comment_lines },
+	{ "jot-vi-indent", jot_vi_indent },
+	{ "jot-vi-dedent", jot_vi_dedent },
+	{ "jot-vi-toggle-comment", jot_vi_toggle_comment },
+	{ "jot-kill-rectangle", jot_kill_rectangle },
+	{ "jot-copy-rectangle", jot_copy_rectangle },
+	{ "jot-yank-rectangle", jot_yank_rectangle },
+	{ "jot-open-rectangle", jot_open_rectangle },
+	{ "jot-fill-paragraph", jot_fill_paragraph },
+	{ "jot-fill-paragraph-optimal", jot_fill_paragraph_optimal },
+	{ "jot-fill-region", jot_fill_region },
+	{ "jot-fill-region-optimal", jot_fill_region_optimal },
+	{ "jot-set-fill-column", jot_set_fill_column },
+	{ "jot-clear-screen", jot_clear_screen },
+	{ "jot-git-commit-mode", jot_git_commit_mode },
+	{ "jot-move-line-up", jot_move_line_up },
+	{ "jot-move-line-down", jot_move_line_down },
+	{ "jot-move-region-up", jot_move_region_up },
+	{ "jot-move-region-down", jot_move_region_down },
+	{ "jot-rebase-cycle-command", jot_rebase_cycle_command },
+	{ "jot-rebase-pick", jot_rebase_pick },
+	{ "jot-rebase-squash", jot_rebase_squash },
+	{ "jot-rebase-fixup", jot_rebase_fixup },
+	{ "jot-rebase-drop", jot_rebase_drop },
+	{ "jot-match-bracket", jot_match_bracket },
+	{ "jot-toggle-bracket-highlight", jot_toggle_bracket_highlight },
+	{ "jot-toggle-wrap", jot_toggle_wrap },
+	{ "jot-toggle-line-numbers", jot_toggle_line_numbers },
+	{ "jot-toggle-status-line", jot_toggle_status_line },
+	{ "jot-visual-line-up", jot_visual_line_up },
+	{ "jot-visual-line-down", jot_visual_line_down },
+	{ "jot-fold-region", jot_fold_region },
+	{ "jot-unfold", jot_unfold },
+	{ "jot-unfold-all", jot_unfold_all },
+	{ "jot-vi-fold-lines", jot_vi_fold_lines },
+	{ "jot-show-diff", jot_show_diff },
+	{ "jot-toggle-diff-gutter", jot_toggle_diff_gutter },
+	{ "jot-emit-lines-above", jot_emit_lines_above },
+};
+
+/* Functions that can mess up formatting, unbound from all keymaps */
+static rl_command_func_t *const unbound_functions[] = {
+	rl_insert_comment,
+	rl_complete,
+	rl_insert_completions,
+	rl_possible_completions,
+	rl_menu_complete,
+	rl_reverse_search_history,
+	rl_forward_search_history,
+	rl_history_search_forward,
+	rl_history_search_backward,
+	rl_noninc_forward_search,
+	rl_noninc_reverse_search,
+	rl_noninc_forward_search_again,
+	rl_noninc_reverse_search_again,
+	rl_clear_screen,
+	rl_clear_display,
+};
+
+/* The keymaps a default binding goes in, as bits of indexes into keymaps[] */
+#define KEYMAPS_ALL          0x1f
+#define KEYMAPS_VI_MOVEMENT  0x08
+#define KEYMAPS_INSERT       0x11   /* Emacs standard and vi insertion */
+
+static const struct {
+	const char *seq;
+	rl_command_func_t *func;
+	unsigned keymaps;
+} default_bindings[] = {
+	{ "\t", rl_insert, KEYMAPS_INSERT },   /* disable auto-completion */
+
+	/* Bind the Enter key (usually '\r') to insert a newline character */
+	{ "\r", jot_insert_newline, KEYMAPS_INSERT },
+
+	/* Bind Ctrl+l to clear the screen and redraw jot's display */
+	{ "\\C-l", jot_clear_screen, KEYMAPS_INSERT | KEYMAPS_VI_MOVEMENT },
+
+	/* Bind Ctrl+n to accept the line */
+	{ "\\C-n", rl_newline, KEYMAPS_ALL },
+
+	/* Bind the custom Ctrl-D function */
+	{ "\\C-d", jot_custom_ctrl_d, KEYMAPS_ALL },
+
+	/* Bind Up/Down arrows to custom cursor movement functions */
+	{ "\\e[A", jot_move_cursor_up, KEYMAPS_ALL },   /* Up arrow */
+	{ "\\e[B", jot_move_cursor_down, KEYMAPS_ALL }, /* Down arrow */
+
+	/* Bind Ctrl+X % to jump to the matching bracket */
+	{ "\\C-x%", jot_match_bracket, KEYMAPS_INSERT },
+
+	/* Bind Ctrl+X z and Ctrl+X Alt+z to fold the region and open a fold */
+	{ "\\C-xz", jot_fold_region, KEYMAPS_INSERT },
+	{ "\\C-x\\ez", jot_unfold, KEYMAPS_INSERT },
+
+	/* Bind Ctrl+X v = to show the changes, like vc-diff in Emacs */
+	{ "\\C-xv=", jot_show_diff, KEYMAPS_INSERT },
+
+	/* Bind Alt+Up/Down to move the current line */
+	{ "\\e[1;3A", jot_move_line_up, KEYMAPS_INSERT | KEYMAPS_VI_MOVEMENT },
+	{ "\\e[1;3B", jot_move_line_down, KEYMAPS_INSERT | KEYMAPS_VI_MOVEMENT },
+
+	/* Bind custom line-oriented functions */
+	{ "\\C-a", jot_beginning_of_line, KEYMAPS_INSERT },
+	{ "\\C-e", jot_end_of_line, KEYMAPS_INSERT },
+	{ "\\C-k", jot_kill_line, KEYMAPS_INSERT },
+	{ "\\C-u", jot_kill_backward_line, KEYMAPS_INSERT },
+
+	/* Home key */
+	{ "\\e[1~", jot_beginning_of_line, KEYMAPS_INSERT },
+	{ "\\e[H", jot_beginning_of_line, KEYMAPS_INSERT },
+	{ "\\eOH", jot_beginning_of_line, KEYMAPS_INSERT },
+
+	/* End key */
+	{ "\\e[4~", jot_end_of_line, KEYMAPS_INSERT },
+	{ "\\e[F", jot_end_of_line, KEYMAPS_INSERT },
+	{ "\\eOF", jot_end_of_line, KEYMAPS_INSERT },
+
+	/*
+	 * Delete key. Readline does not bind keys from the terminal
+	 * description when jot draws the display itself.
+	 */
+	{ "\\e[3~", jot_delete_char, KEYMAPS_INSERT | KEYMAPS_VI_MOVEMENT },
+
+	/* Bind character motion and deletion to the grapheme cluster functions */
+	{ "\\C-f", jot_forward_char, KEYMAPS_INSERT },
+	{ "\\C-b", jot_backward_char, KEYMAPS_INSERT },
+	{ "\\e[C", jot_forward_char, KEYMAPS_ALL },   /* Right arrow */
+	{ "\\e[D", jot_backward_char, KEYMAPS_ALL },  /* Left arrow */
+	{ "\\C-?", jot_backward_delete_char, KEYMAPS_INSERT },
+	{ "\\C-h", jot_backward_delete_char, KEYMAPS_INSERT },
+	{ "h", jot_backward_char, KEYMAPS_VI_MOVEMENT },
+	{ "l", jot_forward_char, KEYMAPS_VI_MOVEMENT },
+	{ " ", jot_forward_char, KEYMAPS_VI_MOVEMENT },
+	{ "\\C-h", jot_backward_char, KEYMAPS_VI_MOVEMENT },
+	{ "x", jot_vi_delete_char, KEYMAPS_VI_MOVEMENT },
+	{ "X", jot_vi_backward_delete_char, KEYMAPS_VI_MOVEMENT },
+	{ "r", jot_vi_change_char, KEYMAPS_VI_MOVEMENT },
+	{ ".", jot_vi_redo, KEYMAPS_VI_MOVEMENT },
+
+	/* Bind custom buffer-oriented functions */
+	{ "\\M-<", rl_beg_of_line, KEYMAPS_INSERT },
+	{ "\\M->", rl_end_of_line, KEYMAPS_INSERT },
+
+	{ "\\C-x\\C-e", jot_invoke_fullscreen_editor, KEYMAPS_INSERT },
+
+	/* Bind region indentation and comment functions */
+	{ "\\C-x>", jot_indent_region, KEYMAPS_INSERT },
+	{ "\\C-x<", jot_dedent_region, KEYMAPS_INSERT },
+	{ "\\M-;", jot_toggle_comment_region, KEYMAPS_INSERT },
+
+	/* Bind rectangle functions to the Emacs C-x r prefix */
+	{ "\\C-xrk", jot_kill_rectangle, KEYMAPS_INSERT },
+	{ "\\C-xr\\M-w", jot_copy_rectangle, KEYMAPS_INSERT },
+	{ "\\C-xry", jot_yank_rectangle, KEYMAPS_INSERT },
+	{ "\\C-xro", jot_open_rectangle, KEYMAPS_INSERT },
+
+	/* Bind paragraph filling functions */
+	{ "\\M-q", jot_fill_paragraph, KEYMAPS_INSERT },
+	{ "\\C-xf", jot_set_fill_column, KEYMAPS_INSERT },
+
+	/* Vi-specific functions in the vi movement keymap */
+	{ "j", jot_move_cursor_down, KEYMAPS_VI_MOVEMENT },
+	{ "k", jot_move_cursor_up, KEYMAPS_VI_MOVEMENT },
+	{ "gj", jot_visual_line_down, KEYMAPS_VI_MOVEMENT },
+	{ "gk", jot_visual_line_up, KEYMAPS_VI_MOVEMENT },
+	{ "J", jot_vi_join_lines, KEYMAPS_VI_MOVEMENT },
+	{ "o", jot_vi_insert_line_below, KEYMAPS_VI_MOVEMENT },
+	{ "O", jot_vi_insert_line_above, KEYMAPS_VI_MOVEMENT },
+	{ "^", jot_beginning_of_line, KEYMAPS_VI_MOVEMENT },
+	{ "$", jot_end_of_line, KEYMAPS_VI_MOVEMENT },
+	{ "G", jot_vi_goto_line, KEYMAPS_VI_MOVEMENT },
+	{ "gg", jot_vi_goto_first_line, KEYMAPS_VI_MOVEMENT },
+	{ "dd", jot_vi_delete_current_line, KEYMAPS_VI_MOVEMENT },
+	{ "D", jot_vi_delete_to_end_of_line, KEYMAPS_VI_MOVEMENT },
+	{ "v", jot_invoke_fullscreen_editor, KEYMAPS_VI_MOVEMENT },
+	{ ">", jot_vi_indent, KEYMAPS_VI_MOVEMENT },
+	{ "<", jot_vi_dedent, KEYMAPS_VI_MOVEMENT },
+	{ "gc", jot_vi_toggle_comment, KEYMAPS_VI_MOVEMENT },
+	{ "gqq", jot_fill_paragraph, KEYMAPS_VI_MOVEMENT },
+	{ "%", jot_match_bracket, KEYMAPS_VI_MOVEMENT },
+	{ "zF", jot_vi_fold_lines, KEYMAPS_VI_MOVEMENT },
+	{ "zd", jot_unfold, KEYMAPS_VI_MOVEMENT },
+	{ "zE", jot_unfold_all, KEYMAPS_VI_MOVEMENT },
+	/* Bind '\r' in Vi movement mode to move cursor to next line */
+	{ "\r", jot_move_to_first_nonblank_next_line, KEYMAPS_VI_MOVEMENT },
+};
+
+/* Whether 'map' is one of keymaps[], which setup_keymaps() visits in turn */
+static int
+is_jot_keymap(Keymap map)
+{
+	for (size_t i = 0; i < sizeof(keymaps) / sizeof(keymaps[0]); i++) {
+		if (keymaps[i] == map) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Unbind the functions in unbound_functions[] from 'map' and the keymaps
+ * it leads to. The keymaps in keymaps[], like the Meta and C-x keymaps the
+ * Emacs keymap leads to, are left to their own pass, so that each entry
+ * is looked at once.
+ */
+static void
+unbind_functions_in_map(Keymap map)
+{
+	for (int key = 0; key < KEYMAP_SIZE; key++) {
+		if (map[key].type == ISKMAP) {
+			if (!is_jot_keymap((Keymap)map[key].function)) {
+				unbind_functions_in_map((Keymap)map[key].function);
+			}
+		} else if (map[key].type == ISFUNC && map[key].function) {
+			for (size_t i = 0; i < sizeof(unbound_functions) / sizeof(unbound_functions[0]); i++) {
+				if (map[key].function == unbound_functions[i]) {
+					map[key].function = NULL;
+					break;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Add jot's functions and bind its default keys. This does not depend on
+ * the options or the terminal, so that the daemon can do it once for all
+ * the sessions it starts.
+ */
+static void
+setup_keymaps(void)
+{
+	/* For conditional processing of inputrc */
+	rl_readline_name = PROGRAM_NAME;
+
+	for (size_t i = 0; i < sizeof(jot_functions) / sizeof(jot_functions[0]); i++) {
+		rl_add_defun(jot_functions[i].name, jot_functions[i].func, -1);
+	}
+	startup_mark(STARTUP_FUNCTIONS);
+
+	/* One pass over each keymap, then its bindings in table order */
+	for (size_t map = 0; map < sizeof(keymaps) / sizeof(keymaps[0]); map++) {
+		unbind_functions_in_map(keymaps[map]);
+		for (size_t i = 0; i < sizeof(default_bindings) / sizeof(default_bindings[0]); i++) {
+			if (default_bindings[i].keymaps & (1u << map)) {
+				rl_generic_bind(ISFUNC, default_bindings[i].seq,
+					(char *)default_bindings[i].func, keymaps[map]);
+			}
+		}
+	}
+	startup_mark(STARTUP_BINDINGS);
+}
+
+/*
+ * Set up Readline the way jot uses it and read the inputrc file. The first
+ * call also sets up the terminal and its keys, which depends on these
+ * settings, so the daemon makes it before starting any session and each
+ * session makes it again as a direct start does.
+ */
+static void
+setup_readline(void)
+{
+	/* Set the startup hook to initialize the Readline buffer */
+	rl_startup_hook = initialize_readline_buffer;
 
-	return 0;
-}
+	/* Draw the buffer with jot's own display */
+	rl_redisplay_function = jot_redisplay;
 
+	/*
+	 * Resizes and job control are handled by tty_getc(), instead of
+	 * by readline, whose handlers would replace jot's
+	 */
+	rl_getc_function = tty_getc;
+	rl_catch_signals = 0;
+	rl_catch_sigwinch = 0;
 
-int
-main(int argc, char **argv)
+	rl_initialize();
+	term_caps_init();
+	unicode_init();
+}
+
+/* Edit the text as given by the command line; returns the exit status */
+static int
+run_editor(int argc, char **argv)
 {
 	int opt_e = 0;       /* Whether the -e option is specified */
 	int opt_p = 0;       /* Whether the --pipe option is specified */
+	int opt_progressive = 0;  /* Whether the --progressive option is specified */
+	int opt_profile = 0;      /* Whether the --profile-startup option is specified */
+	int opt_stats = 0;        /* Whether the --stats option is specified */
+	int record_delim = -1;    /* Record delimiter with -0 or -d, or -1 */
+	int record_terminated = 0; /* Whether the record read ended with it */
 	int opt;
 	char *input = NULL;
 	FILE *file_write = NULL;
@@ -1105,18 +8036,26 @@ main(int argc, char **argv)
 	FILE *orig_stdin = stdin;
 	int exit_status = EXIT_SUCCESS;
 	char *banner = DEFAULT_BANNER;
-
-	save_terminal_settings();
+	char *syntax_name = NULL;
 
 	static struct option long_options[] = {
 		{"pipe", no_argument, 0, 'p'},
 		{"empty", no_argument, 0, 'e'},
 		{"banner", required_argument, 0, 'b'},
+		{"syntax", required_argument, 0, 's'},
+		{"null", no_argument, 0, '0'},
+		{"delimiter", required_argument, 0, 'd'},
+		{"progressive", no_argument, 0, 'P'},
+		{"profile-startup", no_argument, 0, 1},
+		{"stats", no_argument, 0, 2},
+		{"no-wrap", no_argument, 0, 3},
+		{"line-numbers", no_argument, 0, 4},
+		{"status-line", no_argument, 0, 5},
 		{0, 0, 0, 0}
 	};
 
 	/* Parse command-line options using getopt_long */
-	while ((opt = getopt_long(argc, argv, "eb:p", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "eb:ps:0d:P", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'e':
 			opt_e = 1;
@@ -1127,8 +8066,42 @@ main(int argc, char **argv)
 		case 'p':
 			opt_p = 1;
 			break;
+		case 's':
+			syntax_name = optarg;
+			break;
+		case '0':
+			record_delim = '\0';
+			break;
+		case 'd':
+			if (strlen(optarg) != 1) {
+				fprintf(stderr, "Error: the delimiter must be a single character\n");
+				exit_status = EXIT_FAILURE;
+				goto exit_program;
+			}
+			record_delim = (unsigned char)optarg[0];
+			break;
+		case 'P':
+			opt_progressive = 1;
+			break;
+		case 1:
+			opt_profile = 1;
+			break;
+		case 2:
+			opt_stats = 1;
+			break;
+		case 3:
+			line_wrap = 0;
+			break;
+		case 4:
+			line_numbers = 1;
+			break;
+		case 5:
+			status_line = 1;
+			break;
 		default:
-			fprintf(stderr, "Usage: %s [-e] [-p] [-b banner] [filename]\n", argv[0]);
+			fprintf(stderr, "Usage: %s [-e] [-p | -0 | -d delim] [-P] [-b banner] [-s syntax]\n"
+				"       [--profile-startup] [--stats] [--no-wrap] [--line-numbers]\n"
+				"       [--status-line] [filename]\n", argv[0]);
 			exit_status = EXIT_FAILURE;
 			goto exit_program;
 		}
@@ -1147,9 +8120,23 @@ main(int argc, char **argv)
 		goto exit_program;
 	}
 
-	/* For conditional processing of inputrc */
-	rl_readline_name = PROGRAM_NAME;
+	if (opt_progressive && filename != NULL) {
+		fprintf(stderr, "Error: --progressive cannot be used with a filename\n");
+		exit_status = EXIT_FAILURE;
+		goto exit_program;
+	}
+
+	if (record_delim != -1 && (opt_p || filename != NULL)) {
+		fprintf(stderr, "Error: records cannot be used with --pipe or a filename\n");
+		exit_status = EXIT_FAILURE;
+		goto exit_program;
+	}
+	startup_mark(STARTUP_OPTIONS);
 
+	if (tty_save() != 0) {
+		exit_status = EXIT_FAILURE;
+		goto exit_program;
+	}
 
 	/*
 	 * Open /dev/tty for input and output
@@ -1157,7 +8144,7 @@ main(int argc, char **argv)
 	 * That is, when not editing a named file and stdin or
 	 * stdout is not a terminal
 	 */
-	if (opt_p || (filename == NULL && !isatty(fileno(stdout)))) {
+	if (opt_p || record_delim != -1 || (filename == NULL && !isatty(fileno(stdout)))) {
 		if (redirect_stdio_to_tty(&orig_stdout, &orig_stdin) != 0) {
 			exit_status = EXIT_FAILURE;
 			goto exit_program;
@@ -1184,110 +8171,56 @@ main(int argc, char **argv)
 		goto exit_program;
 	}
 
-	/*
-	 * Add our function names
-	 */
-	rl_add_defun("jot-insert-newline", jot_insert_newline, -1);
-	rl_add_defun("jot-move-cursor-up", jot_move_cursor_up, -1);
-	rl_add_defun("jot-move-cursor-down", jot_move_cursor_down, -1);
-	rl_add_defun("jot-beginning-of-line", jot_beginning_of_line, -1);
-	rl_add_defun("jot-end-of-line", jot_end_of_line, -1);
-	rl_add_defun("jot-kill-line", jot_kill_line, -1);
-	rl_add_defun("jot-kill-backward-line", jot_kill_backward_line, -1);
-	rl_add_defun("jot-kill-whole-line", jot_kill_whole_line, -1);
-	rl_add_defun("jot-custom-ctrl-d", jot_custom_ctrl_d, -1);
-	rl_add_defun("jot-invoke-fullscreen-editor", jot_invoke_fullscreen_editor, -1);
-	rl_add_defun("jot-move-to-first-nonblank-next-line", jot_move_to_first_nonblank_next_line, -1);
-
-	/*
-	 * Add Vi-specific functions
-	 */
-	rl_add_defun("jot-vi-join-lines", jot_vi_join_lines, -1);
-	rl_add_defun("jot-vi-insert-line-below", jot_vi_insert_line_below, -1);
-	rl_add_defun("jot-vi-insert-line-above", jot_vi_insert_line_above, -1);
-	rl_add_defun("jot-vi-goto-line", jot_vi_goto_line, -1);
-	rl_add_defun("jot-vi-goto-first-line", jot_vi_goto_first_line, -1);
-	rl_add_defun("jot-vi-delete-current-line", jot_vi_delete_current_line, -1);
-	rl_add_defun("jot-vi-delete-to-end-of-line", jot_vi_delete_to_end_of_line, -1);
-
-	bind_func_in_insert_maps("\t", rl_insert); /* disable auto-completion */
-
-	/*
-	 * Unbind functions that can mess up formatting
-	 */
-	unbind_func_in_all_keymaps(rl_insert_comment);
-	unbind_func_in_all_keymaps(rl_complete);
-	unbind_func_in_all_keymaps(rl_insert_completions);
-	unbind_func_in_all_keymaps(rl_possible_completions);
-	unbind_func_in_all_keymaps(rl_menu_complete);
-	unbind_func_in_all_keymaps(rl_reverse_search_history);
-	unbind_func_in_all_keymaps(rl_forward_search_history);
-	unbind_func_in_all_keymaps(rl_history_search_forward);
-	unbind_func_in_all_keymaps(rl_history_search_backward);
-	unbind_func_in_all_keymaps(rl_noninc_forward_search);
-	unbind_func_in_all_keymaps(rl_noninc_reverse_search);
-	unbind_func_in_all_keymaps(rl_noninc_forward_search_again);
-	unbind_func_in_all_keymaps(rl_noninc_reverse_search_again);
-
-	/* Bind the Enter key (usually '\r') to insert a newline character */
-	bind_func_in_insert_maps("\r", jot_insert_newline);
-
-	/* Bind Ctrl+n to accept the line */
-	bind_func_in_all_keymaps("\\C-n", rl_named_function("accept-line"));
-
-	/* Bind the custom Ctrl-D function */
-	bind_func_in_all_keymaps("\\C-d", jot_custom_ctrl_d);
-
-	/* Bind Up/Down arrows to custom cursor movement functions */
-	bind_func_in_all_keymaps("\\e[A", jot_move_cursor_up);   /* Up arrow */
-	bind_func_in_all_keymaps("\\e[B", jot_move_cursor_down); /* Down arrow */
-
-	/* Bind custom line-oriented functions */
-	bind_func_in_insert_maps("\\C-a", jot_beginning_of_line);
-	bind_func_in_insert_maps("\\C-e", jot_end_of_line);
-	bind_func_in_insert_maps("\\C-k", jot_kill_line);
-	/* Prevent the terminal from handling this */
-	disable_ctrl_u_kill_line();
-	bind_func_in_insert_maps("\\C-u", jot_kill_backward_line);
-
-	/*
-	 * Bind Home and End keys to multiline-aware functions
-	 */
+	if (sigaction(SIGHUP, &sa, NULL) == -1 || sigaction(SIGQUIT, &sa, NULL) == -1) {
+		perror("sigaction");
+		exit_status = EXIT_FAILURE;
+		goto exit_program;
+	}
 
-	/* Home key */
-	bind_func_in_insert_maps("\\e[1~", jot_beginning_of_line);
-	bind_func_in_insert_maps("\\e[H", jot_beginning_of_line);
-	bind_func_in_insert_maps("\\eOH", jot_beginning_of_line);
+	sa.sa_handler = tty_sigwinch_handler;
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGWINCH, &sa, NULL) == -1) {
+		perror("sigaction SIGWINCH");
+		exit_status = EXIT_FAILURE;
+		goto exit_program;
+	}
 
-	/* End key */
-	bind_func_in_insert_maps("\\e[4~", jot_end_of_line);
-	bind_func_in_insert_maps("\\e[F", jot_end_of_line);
-	bind_func_in_insert_maps("\\eOF", jot_end_of_line);
+	sa.sa_handler = tty_sigtstp_handler;
+	if (sigaction(SIGTSTP, &sa, NULL) == -1) {
+		perror("sigaction SIGTSTP");
+		exit_status = EXIT_FAILURE;
+		goto exit_program;
+	}
 
-	/* Bind custom buffer-oriented functions */
-	bind_func_in_insert_maps("\\M-<", rl_beg_of_line); /* M-< */
-	bind_func_in_insert_maps("\\M->", rl_end_of_line);  /* M-> */
+	sa.sa_handler = tty_sigcont_handler;
+	if (sigaction(SIGCONT, &sa, NULL) == -1) {
+		perror("sigaction SIGCONT");
+		exit_status = EXIT_FAILURE;
+		goto exit_program;
+	}
 
-	bind_func_in_insert_maps("\\C-x\\C-e", jot_invoke_fullscreen_editor);
+	/* The handlers above wake tty_getc() through this pipe */
+	if (pipe2(tty.resize_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+		perror("pipe");
+		exit_status = EXIT_FAILURE;
+		goto exit_program;
+	}
 
-	/*
-	 * Bind Vi-specific functions in Vi movement keymap
-	 */
-	bind_func_in_vi_movement_keymap("j", jot_move_cursor_down);
-	bind_func_in_vi_movement_keymap("k", jot_move_cursor_up);
-	bind_func_in_vi_movement_keymap("J", jot_vi_join_lines);
-	bind_func_in_vi_movement_keymap("o", jot_vi_insert_line_below);
-	bind_func_in_vi_movement_keymap("O", jot_vi_insert_line_above);
-	bind_func_in_vi_movement_keymap("^", jot_beginning_of_line);
-	bind_func_in_vi_movement_keymap("$", jot_end_of_line);
-	bind_func_in_vi_movement_keymap("G", jot_vi_goto_line);
-	bind_func_in_vi_movement_keymap("gg", jot_vi_goto_first_line);
-	bind_func_in_vi_movement_keymap("dd", jot_vi_delete_current_line);
-	bind_func_in_vi_movement_keymap("D", jot_vi_delete_to_end_of_line);
-	bind_func_in_vi_movement_keymap("v", jot_invoke_fullscreen_editor);
-	/* Bind '\r' in Vi movement mode to move cursor to next line */
-	bind_func_in_vi_movement_keymap("\r", jot_move_to_first_nonblank_next_line);
+	/* Readline reads and draws through the terminal session */
+	tty.in = fdopen(tty.fd, "r");
+	tty.out = fopencookie(NULL, "w", (cookie_io_functions_t){ .write = frame_stream_write });
+	if (!tty.in || !tty.out) {
+		perror("fdopen tty");
+		exit_status = EXIT_FAILURE;
+		goto exit_program;
+	}
+	rl_instream = tty.in;
+	rl_outstream = tty.out;
+	/* Unbuffered, so that readline's output keeps its place among jot's */
+	setvbuf(tty.out, NULL, _IONBF, 0);
 
+	tty_set_editing();
+	startup_mark(STARTUP_TERMINAL);
 
 	if (opt_p) {
 		/* Read buffer contents from stdin */
@@ -1297,6 +8230,15 @@ main(int argc, char **argv)
 			exit_status = EXIT_FAILURE;
 			goto exit_program;
 		}
+	} else if (record_delim != -1) {
+		/* Read the first record; the others are read as each is accepted */
+		file_contents = read_record(orig_stdin, record_delim, &record_terminated);
+		if (file_contents == NULL) {
+			if (ferror(orig_stdin)) {
+				exit_status = EXIT_FAILURE;
+			}
+			goto exit_program;
+		}
 	} else if (filename && !opt_e) {
 		/* Read the file contents */
 		file_contents = read_file_contents(filename);
@@ -1310,8 +8252,54 @@ main(int argc, char **argv)
 		}
 	}
 
-	/* Set the startup hook to initialize the Readline buffer */
-	rl_startup_hook = initialize_readline_buffer;
+	/* Ctrl+X p passes the lines above the cursor down the pipeline */
+	if (opt_progressive) {
+		progressive_out = orig_stdout;
+		bind_func_in_insert_maps("\\C-xp", jot_emit_lines_above);
+		bind_func_in_vi_movement_keymap("\\C-xp", jot_emit_lines_above);
+	}
+
+	startup_mark(STARTUP_READ);
+
+	if (getenv("NO_COLOR") && getenv("NO_COLOR")[0] != '\0') {
+		style_sgr = mono_styles;
+	}
+
+	/* Highlight the syntax given with --syntax, or detected from the file */
+	if (syntax_name) {
+		if (strcmp(syntax_name, "none") != 0) {
+			const struct syntax *syntax = find_syntax(syntax_name, strlen(syntax_name));
+			if (!syntax) {
+				fprintf(stderr, "Error: unknown syntax '%s'\n", syntax_name);
+				exit_status = EXIT_FAILURE;
+				goto exit_program;
+			}
+			set_syntax(syntax);
+		}
+	} else {
+		const struct syntax *syntax = detect_syntax(filename, file_contents);
+		if (syntax) {
+			set_syntax(syntax);
+		}
+	}
+
+	/* Git commit messages and rebase todo lists get their own modes */
+	if (filename) {
+		const char *base = strrchr(filename, '/');
+		base = base ? base + 1 : filename;
+		if (strcmp(base, "COMMIT_EDITMSG") == 0) {
+			set_commit_mode(1);
+		}
+		if (strcmp(base, "git-rebase-todo") == 0) {
+			set_rebase_mode();
+		}
+	}
+
+	startup_mark(STARTUP_MODES);
+
+	/* Read the inputrc file; readline() would do it otherwise */
+	setup_readline();
+	startup_mark(STARTUP_INPUTRC);
 
 	/* Print the banner if it's not an empty string */
 	if (banner && banner[0] != '\0') {
@@ -1319,7 +8307,37 @@ main(int argc, char **argv)
 		fflush(stdout);
 	}
 	/* Prompt for input */
-	if ((input = readline("")) != NULL) {
+	input = readline("");
+	display_finish();
+	if (opt_profile) {
+		startup_report(stderr);
+	}
+
+	/*
+	 * With records, write each one as it is accepted and edit the next
+	 * in the same process, until the input ends or editing is aborted
+	 */
+	while (input != NULL && record_delim != -1) {
+		if (write_record(orig_stdout, input, record_terminated ? record_delim : -1) != 0) {
+			exit_status = EXIT_FAILURE;
+			goto exit_program;
+		}
+		free(input);
+		input = NULL;
+
+		free(file_contents);
+		file_contents = read_record(orig_stdin, record_delim, &record_terminated);
+		if (file_contents == NULL) {
+			if (ferror(orig_stdin)) {
+				exit_status = EXIT_FAILURE;
+			}
+			goto exit_program;
+		}
+		reset_record_state();
+		input = readline("");
+		display_finish();
+	}
+	if (input != NULL) {
 		/* Write the input to file or stdout */
 		if (filename != NULL) {
 			/* Open file for writing (will create if it doesn't exist) */
@@ -1348,9 +8366,15 @@ exit_program:
 
 	/* Restore Readline's terminal settings */
 	rl_deprep_terminal();
+	frame_flush();
+	if (opt_stats) {
+		frame_stats_report(stderr);
+	}
 
 	/* Restore our saved terminal settings */
-	restore_terminal_settings();
+	if (tty_restore() != 0) {
+		perror("tcsetattr");
+	}
 
 	/* Cleanup resources */
 	free(input);
@@ -1364,3 +8388,411 @@ exit_program:
 
 	return exit_status;
 }
+
+/*
+ * Daemon mode
+ *
+ * Starting jot adds its functions, binds its keys and reads the inputrc
+ * file before the first frame is drawn. 'jot --daemon' does this once and
+ * waits on a socket in XDG_RUNTIME_DIR. When jot finds the socket at
+ * startup, it acts as a client: it passes its standard streams and its
+ * terminal, its arguments, working directory and environment to the
+ * daemon, which forks a session from its ready state to run the editor.
+ * The client forwards signals to the session and exits with its status.
+ *
+ * The inputrc file depends on the environment, so a session is refused,
+ * and the client starts the editor itself, when the variables below
+ * differ from those the daemon was started with.
+ */
+#define DAEMON_MAX_REQUEST (1024 * 1024)
+
+static const char *const daemon_env_names[] = {
+	"TERM", "TERM_PROGRAM", "INPUTRC", "HOME", "LANG", "LC_ALL", "LC_CTYPE"
+};
+static char *daemon_env_values[sizeof(daemon_env_names) / sizeof(daemon_env_names[0])];
+
+static volatile sig_atomic_t client_session_pid = 0;
+static volatile sig_atomic_t client_session_killed = 0;
+static int client_tty_fd = -1;
+
+/* Session request: the size of the strings that follow and their count */
+struct daemon_request {
+	uint32_t len;
+	uint32_t argc;
+};
+
+static int
+daemon_socket_path(struct sockaddr_un *addr)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+
+	if (!dir || dir[0] == '\0') {
+		return -1;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	int len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s.sock", dir, PROGRAM_NAME);
+	return len < 0 || (size_t)len >= sizeof(addr->sun_path) ? -1 : 0;
+}
+
+static int
+write_full(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+read_full(int fd, void *data, size_t len)
+{
+	char *p = data;
+
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (n == 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void
+client_forward_signal(int signum)
+{
+	if (client_session_pid <= 0) {
+		return;
+	}
+	if (signum == SIGCONT && !client_session_killed &&
+		tcgetpgrp(client_tty_fd) != getpgrp()) {
+		/*
+		 * Continued in the background: stop as a job reading the
+		 * terminal would, so that the shell sends SIGCONT again for fg
+		 */
+		raise(SIGTTIN);
+		return;
+	}
+	kill(client_session_pid, signum);
+	if (signum != SIGCONT && signum != SIGTSTP && signum != SIGWINCH) {
+		/* A suspended session acts on the signal only when continued */
+		client_session_killed = 1;
+		kill(client_session_pid, SIGCONT);
+	}
+}
+
+/*
+ * Run the editor in the daemon's process, if one is running. Returns 0
+ * with the session's exit status in '*status', or -1 if jot should start
+ * the editor itself.
+ */
+static int
+client_run(int argc, char **argv, int *status)
+{
+	struct sockaddr_un addr;
+	char cwd[PATH_MAX];
+
+	if (daemon_socket_path(&addr) != 0 || !getcwd(cwd, sizeof(cwd))) {
+		return -1;
+	}
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(sock);
+		return -1;
+	}
+	int tty_fd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+	if (tty_fd == -1) {
+		close(sock);
+		return -1;
+	}
+
+	/* The working directory, the arguments and the environment */
+	struct textbuf strings = { 0 };
+	int failed = textbuf_append(&strings, cwd, strlen(cwd) + 1);
+	for (int i = 0; i < argc; i++) {
+		failed |= textbuf_append(&strings, argv[i], strlen(argv[i]) + 1);
+	}
+	for (char **env = environ; *env; env++) {
+		failed |= textbuf_append(&strings, *env, strlen(*env) + 1);
+	}
+
+	struct daemon_request request = { strings.len, argc };
+	int fds[4] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, tty_fd };
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { &request, sizeof(request) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf)
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	int32_t pid;
+	if (failed || strings.len > DAEMON_MAX_REQUEST || sendmsg(sock, &msg, 0) != sizeof(request) ||
+		write_full(sock, strings.data, strings.len) != 0 ||
+		read_full(sock, &pid, sizeof(pid)) != 0 || pid <= 0) {
+		/* No session was started */
+		free(strings.data);
+		close(tty_fd);
+		close(sock);
+		return -1;
+	}
+	free(strings.data);
+
+	/* Signals from the terminal reach the client: pass them on */
+	struct sigaction sa;
+	sa.sa_handler = client_forward_signal;
+	sa.sa_flags = SA_RESTART;
+	/* One at a time, so that a signal sent before SIGCONT is passed on first */
+	sigfillset(&sa.sa_mask);
+	client_session_pid = pid;
+	client_tty_fd = tty_fd;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGQUIT, &sa, NULL);
+	sigaction(SIGWINCH, &sa, NULL);
+	sigaction(SIGTSTP, &sa, NULL);
+	sigaction(SIGCONT, &sa, NULL);
+
+	int32_t session_status;
+	if (read_full(sock, &session_status, sizeof(session_status)) != 0) {
+		/* The session was killed */
+		session_status = EXIT_FAILURE;
+	}
+	close(tty_fd);
+	close(sock);
+	*status = session_status;
+	return 0;
+}
+
+/* Whether the environment leads to the same inputrc and terminal setup as the daemon's */
+static int
+daemon_env_matches(void)
+{
+	for (size_t i = 0; i < sizeof(daemon_env_names) / sizeof(daemon_env_names[0]); i++) {
+		const char *value = getenv(daemon_env_names[i]);
+		const char *daemon_value = daemon_env_values[i];
+		if ((value == NULL) != (daemon_value == NULL) ||
+			(value && strcmp(value, daemon_value) != 0)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Run a session for the client on 'sock'; called in a forked process */
+static int
+daemon_session(int sock)
+{
+	struct daemon_request request;
+	int fds[4];
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { &request, sizeof(request) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf)
+	};
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(request)) {
+		return EXIT_FAILURE;
+	}
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+		cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		return EXIT_FAILURE;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	if (request.len > DAEMON_MAX_REQUEST || request.argc == 0) {
+		return EXIT_FAILURE;
+	}
+
+	char *strings = malloc(request.len + 1);
+	char **argv = calloc(request.argc + 1, sizeof(*argv));
+	if (!strings || !argv || read_full(sock, strings, request.len) != 0) {
+		return EXIT_FAILURE;
+	}
+	strings[request.len] = '\0';
+
+	/* Unpack the working directory, the arguments and the environment */
+	char *p = strings;
+	char *end = strings + request.len;
+	const char *cwd = p;
+	p += strlen(p) + 1;
+	for (uint32_t i = 0; i < request.argc; i++) {
+		if (p >= end) {
+			return EXIT_FAILURE;
+		}
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	clearenv();
+	for (; p < end; p += strlen(p) + 1) {
+		putenv(p);
+	}
+
+	int32_t pid = getpid();
+	if (!daemon_env_matches() || chdir(cwd) != 0) {
+		/* The client starts the editor itself */
+		pid = -1;
+		write_full(sock, &pid, sizeof(pid));
+		return EXIT_FAILURE;
+	}
+	for (int fd = 0; fd < 3; fd++) {
+		if (dup2(fds[fd], fd) == -1) {
+			return EXIT_FAILURE;
+		}
+		close(fds[fd]);
+	}
+	tty.fd = fds[3];
+
+	/* The client is stopped in place of the session when it suspends */
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0) {
+		tty.job_pid = cred.pid;
+	}
+	if (write_full(sock, &pid, sizeof(pid)) != 0) {
+		return EXIT_FAILURE;
+	}
+
+	/* The functions, bindings and inputrc file are the daemon's */
+	startup_begin();
+	int32_t status = run_editor(request.argc, argv);
+	fflush(NULL);
+	write_full(sock, &status, sizeof(status));
+	return status;
+}
+
+/* Wait for clients and start a session for each */
+static int
+daemon_run(void)
+{
+	struct sockaddr_un addr;
+
+	if (daemon_socket_path(&addr) != 0) {
+		fprintf(stderr, "Error: XDG_RUNTIME_DIR is not set\n");
+		return EXIT_FAILURE;
+	}
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "Error: a daemon is already listening on %s\n", addr.sun_path);
+		close(sock);
+		return EXIT_FAILURE;
+	}
+	/* Remove the socket of a daemon that is gone */
+	unlink(addr.sun_path);
+	/* Create the socket private, so no one can connect before the chmod */
+	mode_t old_umask = umask(077);
+	int bound = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+	umask(old_umask);
+	if (bound != 0) {
+		perror("bind");
+		close(sock);
+		return EXIT_FAILURE;
+	}
+	if (chmod(addr.sun_path, S_IRUSR | S_IWUSR) != 0 || listen(sock, 16) != 0) {
+		perror("listen");
+		close(sock);
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0; i < sizeof(daemon_env_names) / sizeof(daemon_env_names[0]); i++) {
+		const char *value = getenv(daemon_env_names[i]);
+		daemon_env_values[i] = value ? strdup(value) : NULL;
+	}
+
+	/* Read the inputrc file now, instead of in each session */
+	setup_keymaps();
+	setup_readline();
+
+	/* Sessions are not waited for */
+	signal(SIGCHLD, SIG_IGN);
+
+	for (;;) {
+		int conn = accept(sock, NULL, NULL);
+		if (conn == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			perror("accept");
+			close(sock);
+			return EXIT_FAILURE;
+		}
+
+		/* Sessions run as this user, so only serve this user */
+		struct ucred cred;
+		socklen_t cred_len = sizeof(cred);
+		if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+			cred.uid != getuid()) {
+			close(conn);
+			continue;
+		}
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(sock);
+			signal(SIGCHLD, SIG_DFL);
+			exit(daemon_session(conn));
+		}
+		if (pid == -1) {
+			perror("fork");
+		}
+		close(conn);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	int status;
+
+	startup_begin();
+	if (argc == 2 && strcmp(argv[1], "--daemon") == 0) {
+		return daemon_run();
+	}
+	if (client_run(argc, argv, &status) == 0) {
+		return status;
+	}
+	setup_keymaps();
+	return run_editor(argc, argv);
+}
@@ -0,0 +1,468 @@
+/*
+ * Tests of jot's internal functions. The editor is built into this program
+ * with its main function renamed, so the tests can call its static
+ * functions on a buffer filled with rl_insert_text().
+ */
+#define main jot_main
+#include "jot.c"
+#undef main
+
+#include <locale.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/* Replace the buffer with 'text' and index it */
+static void
+set_buffer(const char *text)
+{
+	if (rl_end > 0) {
+		rl_delete_text(0, rl_end);
+	}
+	rl_point = 0;
+	rl_insert_text(text);
+	line_index_sync();
+}
+
+/* Check that the cached start state of every line matches a full lex */
+static void
+check_lex_states(void)
+{
+	int state = 0;
+
+	lex_update(line_count - 1);
+	for (int line = 0; line < line_count; line++) {
+		int len = line_index_span(line).len;
+		CHECK(LINE_LEX_STATE(line) == state);
+		state = current_syntax->eol_states[lex_slice(line, len, len, NULL)];
+	}
+}
+
+/* An edit that keeps the state at the end of its line is relexed alone */
+static void
+test_lex_converges(void)
+{
+	struct textbuf text = { 0 };
+	char line[64];
+
+	for (int i = 0; i < 100; i++) {
+		snprintf(line, sizeof(line), "echo \"line %d\" 'x'\n", i);
+		textbuf_puts(&text, line);
+	}
+	textbuf_append(&text, "", 1);
+	set_buffer(text.data);
+	set_syntax(find_syntax("sh", 2));
+	check_lex_states();
+
+	/* Insert a character inside the string on line 10 */
+	rl_point = line_start(10) + 7;
+	rl_insert_text("x");
+	line_index_sync();
+	CHECK(lex_valid_lines == 11);
+	lex_update(11);
+	CHECK(lex_valid_lines == line_count);
+	check_lex_states();
+
+	/* Open a string: the lines after the edit change state */
+	rl_point = line_start(20);
+	rl_insert_text("\"");
+	line_index_sync();
+	check_lex_states();
+	CHECK(LINE_LEX_STATE(21) != 0);
+
+	/* Close it again */
+	rl_point = line_start(20);
+	rl_delete_text(rl_point, rl_point + 1);
+	line_index_sync();
+	check_lex_states();
+
+	/* Two edits before relexing: no convergence before the later one */
+	rl_point = line_start(80);
+	rl_insert_text("\"");
+	line_index_sync();
+	rl_point = line_start(30) + 7;
+	rl_insert_text("y\nz");
+	line_index_sync();
+	lex_update(40);
+	CHECK(lex_valid_lines == 41);
+	check_lex_states();
+
+	free(text.data);
+	set_syntax(NULL);
+}
+
+/* Check the styles of parts of line 'line' lexed from its column marks */
+static void
+check_lex_slices(int line)
+{
+	struct line_span span = line_index_span(line);
+	unsigned char *whole = malloc(span.len + 1);
+	unsigned char *part = malloc(span.len + 1);
+
+	/* A full lex, without the marks */
+	lex_update(line);
+	wrap_cache_failed = 1;
+	lex_slice(line, 0, span.len, whole);
+	wrap_cache_failed = 0;
+	for (int i = 0; i < 20; i++) {
+		int col;
+		int from = column_seek(line, span.len, rand() % (span.len + 10), &col);
+		int to = from + rand() % 300;
+		to = to < span.len ? to : span.len;
+		lex_slice(line, from, to, part);
+		if (memcmp(whole + from, part + from, to - from) != 0) {
+			CHECK(memcmp(whole + from, part + from, to - from) == 0);
+			break;
+		}
+	}
+	free(whole);
+	free(part);
+}
+
+/* Lexing a long line from its column marks gives the styles of a full lex */
+static void
+test_lex_slices(const char *syntax, const char *const *words, int nwords)
+{
+	struct textbuf text = { 0 };
+
+	srand(2);
+	textbuf_puts(&text, "first line\n");
+	for (int i = 0; i < 3000; i++) {
+		textbuf_puts(&text, words[rand() % nwords]);
+	}
+	textbuf_append(&text, "\nlast line\n", 12);
+	set_buffer(text.data);
+	set_syntax(find_syntax(syntax, strlen(syntax)));
+	line_wrap = 0;
+	for (int step = 0; step < 300; step++) {
+		check_lex_slices(1);
+		struct line_span span = line_index_span(1);
+		const struct column_marks *marks = wrap_cache[1].marks;
+		rl_point = span.start + rand() % span.len;
+		if (marks && marks->count > 1 && rand() % 2) {
+			/* Edit near a mark, which may be in the middle of a token */
+			rl_point = span.start + marks->mark[1 + rand() % (marks->count - 1)].off + rand() % 32;
+		}
+		if (rand() % 2) {
+			rl_insert_text(words[rand() % nwords]);
+		} else {
+			rl_delete_text(rl_point, rl_point + 1);
+		}
+		line_index_sync();
+	}
+	check_lex_slices(1);
+	line_wrap = 1;
+	free(text.data);
+	set_syntax(NULL);
+}
+
+/* Check the line index against the lines of the buffer */
+static void
+check_line_index(void)
+{
+	int line = 0;
+
+	CHECK(line_index_sync() == 0);
+	CHECK(indexed_len == rl_end);
+	for (int pos = 0; pos <= rl_end; pos++) {
+		if (pos == 0 || rl_line_buffer[pos - 1] == '\n') {
+			if (line >= line_count || line_start(line) != pos) {
+				CHECK(line < line_count && line_start(line) == pos);
+				return;
+			}
+			line++;
+		}
+	}
+	CHECK(line == line_count);
+}
+
+/* Random edits and undos keep the line index right */
+static void
+test_line_index(void)
+{
+	static const char *const texts[] = { "a", "\n", "bc\nd", "\n\n", "efgh" };
+
+	set_buffer("one\ntwo\nthree\n");
+	rl_free_undo_list();
+	line_index_invalidate();
+	srand(1);
+	for (int step = 0; step < 20000; step++) {
+		int op = rand() % 10;
+		if (op < 4) {
+			rl_point = rl_end ? rand() % (rl_end + 1) : 0;
+			rl_insert_text(texts[rand() % 5]);
+		} else if (op < 6) {
+			/* Typing: single characters merge into one undo entry */
+			for (int i = rand() % 4; i >= 0; i--) {
+				rl_insert_text(i % 3 ? "x" : "\n");
+			}
+		} else if (op < 8 && rl_end > 0) {
+			int from = rand() % rl_end;
+			int to = from + rand() % 4;
+			rl_delete_text(from, to < rl_end ? to : rl_end);
+		} else if (op == 8) {
+			/* Undo is the last change before the next sync */
+			line_index_sync();
+			rl_do_undo();
+			line_index_sync();
+		} else if (rand() % 50 == 0) {
+			line_index_free_undo_list();
+		}
+		if (rand() % 3 == 0) {
+			check_line_index();
+		}
+	}
+	check_line_index();
+}
+
+/* The buffer is modified after more edits than the undo search covers */
+static void
+test_modified_many_edits(void)
+{
+	set_buffer("one\n");
+	buffer_modified = 0;
+	for (int i = 0; i < 2 * UNDO_SEARCH_MAX; i++) {
+		rl_point = 0;
+		rl_insert_text("ab");
+	}
+	line_index_sync();
+	CHECK(buffer_modified);
+	check_line_index();
+}
+
+/* Commit mode flags short lines that tabs make too wide */
+static void
+test_commit_lint(void)
+{
+	set_commit_mode(1);
+	set_buffer("Subject\n\n\t\t\t\t\t\t\t\t\t\tx\nshort\n");
+	CHECK(line_flags[2] & LINE_COMMIT_OVERLONG);
+	CHECK(!(line_flags[3] & LINE_COMMIT_OVERLONG));
+	set_commit_mode(0);
+}
+
+/* Brackets in strings and comments are not matched */
+static void
+test_brackets_skip_strings(void)
+{
+	const char *text = "f() {\n\techo \"}\" '(' # )\n\tx=$(g)\n}\n";
+
+	set_buffer(text);
+	set_syntax(find_syntax("sh", 2));
+	int open = bracket_at(strchr(text, '{') - text);
+	CHECK(open >= 0 && brackets[bracket_partner(open)].pos == (int)(strrchr(text, '}') - text));
+	CHECK(bracket_at(strchr(text, '(') - text) >= 0);
+	CHECK(bracket_at(strstr(text, "\"}") - text + 1) < 0);
+	CHECK(bracket_at(strstr(text, "'('") - text + 1) < 0);
+	CHECK(bracket_at(strstr(text, "# )") - text + 2) < 0);
+	open = bracket_at(strstr(text, "$(") - text + 1);
+	CHECK(open >= 0 && bracket_partner(open) >= 0);
+
+	/* Opening a string above hides the brackets after it */
+	rl_point = line_start(1);
+	rl_insert_text("'");
+	line_index_sync();
+	CHECK(bracket_at(strstr(rl_line_buffer, "$(") - rl_line_buffer + 1) < 0);
+	set_syntax(NULL);
+	CHECK(bracket_at(strstr(rl_line_buffer, "'(") - rl_line_buffer + 1) >= 0);
+}
+
+/* Emitting lines keeps the original lines a window too large to diff did not reach */
+static void
+test_drop_original(void)
+{
+	struct textbuf orig = { 0 };
+	struct textbuf text = { 0 };
+	char line[32];
+
+	for (int i = 0; i < 1200; i++) {
+		snprintf(line, sizeof(line), "o%d\n", i);
+		textbuf_puts(&orig, line);
+		if (i % 2) {
+			snprintf(line, sizeof(line), "b%d\n", i);
+		}
+		textbuf_puts(&text, line);
+	}
+	textbuf_append(&orig, "", 1);
+	textbuf_append(&text, "", 1);
+	file_contents = orig.data;
+	set_buffer(text.data);
+	CHECK(drop_original_before(100) == 0);
+	CHECK(strncmp(file_contents, "o100\n", 5) == 0);
+
+	/* Emitting lines keeps the diff a fresh one would give */
+	free(file_contents);
+	orig.data = NULL;
+	orig.len = orig.size = 0;
+	text.len = 0;
+	for (int i = 0; i < 1200; i++) {
+		snprintf(line, sizeof(line), "o%d\n", i);
+		textbuf_puts(&orig, line);
+		if (i % 7 == 3) {
+			snprintf(line, sizeof(line), "b%d\n", i);
+		}
+		if (i % 11 != 5) {
+			textbuf_puts(&text, line);
+		}
+	}
+	textbuf_append(&orig, "", 1);
+	textbuf_append(&text, "", 1);
+	diff_reset();
+	file_contents = orig.data;
+	set_buffer(text.data);
+	int *match = malloc(line_count * sizeof(*match));
+	for (int step = 0; step < 100 && line_count > 1; step++) {
+		int line = 1 + rand() % (line_count < 60 ? line_count - 1 : 60);
+		CHECK(drop_original_before(line) == 0);
+		rl_delete_text(0, line_start(line));
+		line_index_sync();
+		CHECK(diff_active);
+		memcpy(match, diff_match, line_count * sizeof(*match));
+		diff_reset();
+		diff_start();
+		if (memcmp(match, diff_match, line_count * sizeof(*match)) != 0) {
+			CHECK(memcmp(match, diff_match, line_count * sizeof(*match)) == 0);
+			break;
+		}
+	}
+	free(match);
+
+	diff_reset();
+	free(file_contents);
+	file_contents = NULL;
+	free(text.data);
+}
+
+/* Vi x, X and r work on whole grapheme clusters */
+static void
+test_vi_char_commands(void)
+{
+	setlocale(LC_ALL, "C.UTF-8");
+	unicode_init();
+	if (!utf8_locale) {
+		return;
+	}
+
+	set_buffer("xe\xcc\x81\xcc\x81yz\n");
+	rl_point = 1;
+	jot_vi_delete_char(1, 'x');
+	CHECK(strcmp(rl_line_buffer, "xyz\n") == 0);
+	CHECK(rl_point == 1);
+
+	strcpy(vi_replacement, "\xe6\x97\xa5");
+	vi_redoing = 1;
+	jot_vi_change_char(2, 'r');
+	vi_redoing = 0;
+	CHECK(strcmp(rl_line_buffer, "x\xe6\x97\xa5\xe6\x97\xa5\n") == 0);
+	CHECK(rl_point == 4);
+
+	jot_vi_backward_delete_char(1, 'X');
+	CHECK(strcmp(rl_line_buffer, "x\xe6\x97\xa5\n") == 0);
+	CHECK(rl_point == 1);
+
+	/* Counts stop at the ends of the line */
+	set_buffer("ab\ncd\n");
+	rl_point = 1;
+	jot_vi_delete_char(5, 'x');
+	CHECK(strcmp(rl_line_buffer, "a\ncd\n") == 0);
+	CHECK(rl_point == 0);
+
+	rl_point = 3;
+	jot_vi_backward_delete_char(5, 'X');
+	CHECK(strcmp(rl_line_buffer, "a\nd\n") == 0);
+	CHECK(rl_point == 2);
+	jot_vi_backward_delete_char(1, 'X');
+	CHECK(strcmp(rl_line_buffer, "a\nd\n") == 0);
+
+	strcpy(vi_replacement, "z");
+	vi_redoing = 1;
+	rl_point = 2;
+	jot_vi_change_char(3, 'r');
+	CHECK(strcmp(rl_line_buffer, "a\nd\n") == 0);
+	jot_vi_change_char(1, 'r');
+	CHECK(strcmp(rl_line_buffer, "a\nz\n") == 0);
+	rl_point = 3;
+	jot_vi_change_char(1, 'r');
+	jot_vi_delete_char(1, 'x');
+	CHECK(strcmp(rl_line_buffer, "a\nz\n") == 0);
+	vi_redoing = 0;
+	setlocale(LC_ALL, "C");
+	unicode_init();
+}
+
+/* Vi operators do nothing when the key after them is not a motion */
+static void
+test_vi_operator_motions(void)
+{
+	set_buffer("abc\n");
+	rl_point = 0;
+	rl_stuff_char('x');
+	jot_vi_indent(1, '>');
+	CHECK(strcmp(rl_line_buffer, "abc\n") == 0);
+
+	rl_stuff_char('x');
+	jot_vi_toggle_comment(1, 'c');
+	CHECK(strcmp(rl_line_buffer, "abc\n") == 0);
+
+	rl_stuff_char('>');
+	jot_vi_indent(1, '>');
+	CHECK(strcmp(rl_line_buffer, "\tabc\n") == 0);
+}
+
+/* Rebase todo mode keeps M-f and M-d, and Escape and a letter in vi */
+static void
+test_rebase_bindings(void)
+{
+	set_rebase_mode();
+	set_buffer("pick abc one\n");
+	rl_point = 0;
+	rl_command_func_t *func = rl_function_of_keyseq("\033f", emacs_standard_keymap, NULL);
+	CHECK(func == rl_forward_word);
+	func(1, 'f');
+	CHECK(rl_point == 4);
+
+	func = rl_function_of_keyseq("\033d", emacs_standard_keymap, NULL);
+	CHECK(func == rl_kill_word);
+	func(1, 'd');
+	CHECK(strcmp(rl_line_buffer, "pick one\n") == 0);
+
+	CHECK(rl_function_of_keyseq("\033d", vi_insertion_keymap, NULL) != jot_rebase_drop);
+	CHECK(rl_function_of_keyseq("\030td", emacs_standard_keymap, NULL) == jot_rebase_drop);
+	CHECK(rl_function_of_keyseq("gd", vi_movement_keymap, NULL) == jot_rebase_drop);
+	rebase_mode = 0;
+}
+
+static const char *const sh_words[] = {
+	"echo ", "\"", "'", "$HOME ", "${x} ", "\\\"", "if ", "# no ", "x", "  ", "\t", "$1"
+};
+static const char *const json_words[] = {
+	"\"key\": ", "\"a string value that runs on for a while\"", ", ", "1.5e3", "true",
+	"{", "}", "\"", ":", "  "
+};
+
+int
+main(void)
+{
+	test_lex_converges();
+	test_lex_slices("sh", sh_words, sizeof(sh_words) / sizeof(sh_words[0]));
+	test_lex_slices("json", json_words, sizeof(json_words) / sizeof(json_words[0]));
+	test_line_index();
+	test_modified_many_edits();
+	test_commit_lint();
+	test_brackets_skip_strings();
+	test_drop_original();
+	test_vi_char_commands();
+	test_vi_operator_motions();
+	test_rebase_bindings();
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}